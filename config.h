@@ -0,0 +1,263 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in.  Generated from configure.ac by autoheader.  */
+
+/* enable debugging */
+/* #undef DEBUG */
+
+/* enable handling of accidental HTTP requests */
+/* #undef HANDLE_HTTP */
+
+/* Define to 1 if you have the <arpa/nameser_compat.h> header file. */
+#define HAVE_ARPA_NAMESER_COMPAT_H 1
+
+/* Define to 1 if you have the <arpa/nameser.h> header file. */
+#define HAVE_ARPA_NAMESER_H 1
+
+/* Define to 1 if you have the <endian.h> header file. */
+#define HAVE_ENDIAN_H 1
+
+/* Do we have ether_header.ether_dhost.ether_addr_octet */
+/* #undef HAVE_ETHER_ADDR_OCTET */
+
+/* Define to 1 if you have the `ether_ntoa' function. */
+#define HAVE_ETHER_NTOA 1
+
+/* Define to 1 if you have the `ether_ntoa_r' function. */
+#define HAVE_ETHER_NTOA_R 1
+
+/* Define to 1 if you have the <fcntl.h> header file. */
+#define HAVE_FCNTL_H 1
+
+/* Define to 1 if you have the `getpwnam_r' function. */
+#define HAVE_GETPWNAM_R 1
+
+/* Define to 1 if you have the <inttypes.h> header file. */
+#define HAVE_INTTYPES_H 1
+
+/* Define to 1 if you have the <linux/if_tun.h> header file. */
+#define HAVE_LINUX_IF_TUN_H 1
+
+/* Define to 1 if you have the <linux/ipv6.h> header file. */
+#define HAVE_LINUX_IPV6_H 1
+
+/* Define to 1 if you have the <linux/sockios.h> header file. */
+#define HAVE_LINUX_SOCKIOS_H 1
+
+/* Define to 1 if you have the `memfd_create' function. */
+#define HAVE_MEMFD_CREATE 1
+
+/* Define to 1 if you have the <netdb.h> header file. */
+#define HAVE_NETDB_H 1
+
+/* Define to 1 if you have the <netinet6/in6_var.h> header file. */
+/* #undef HAVE_NETINET6_IN6_VAR_H */
+
+/* Define to 1 if you have the <netinet6/nd6.h> header file. */
+/* #undef HAVE_NETINET6_ND6_H */
+
+/* Define to 1 if you have the <netinet/ether.h> header file. */
+#define HAVE_NETINET_ETHER_H 1
+
+/* Define to 1 if you have the <netinet/icmp6.h> header file. */
+#define HAVE_NETINET_ICMP6_H 1
+
+/* Define to 1 if you have the <netinet/if_ether.h> header file. */
+#define HAVE_NETINET_IF_ETHER_H 1
+
+/* Define to 1 if you have the <netinet/in6.h> header file. */
+/* #undef HAVE_NETINET_IN6_H */
+
+/* Define to 1 if you have the <netinet/in.h> header file. */
+#define HAVE_NETINET_IN_H 1
+
+/* Define to 1 if you have the <netinet/in_systm.h> header file. */
+#define HAVE_NETINET_IN_SYSTM_H 1
+
+/* Define to 1 if you have the <netinet/ip6.h> header file. */
+#define HAVE_NETINET_IP6_H 1
+
+/* Define to 1 if you have the <netinet/ip.h> header file. */
+#define HAVE_NETINET_IP_H 1
+
+/* Define to 1 if you have the <netinet/tcp.h> header file. */
+#define HAVE_NETINET_TCP_H 1
+
+/* Define to 1 if you have the <netinet/udp.h> header file. */
+#define HAVE_NETINET_UDP_H 1
+
+/* Define to 1 if you have the <net/ethernet.h> header file. */
+#define HAVE_NET_ETHERNET_H 1
+
+/* Define to 1 if you have the <net/if.h> header file. */
+#define HAVE_NET_IF_H 1
+
+/* Define to 1 if you have the <net/if_tun.h> header file. */
+/* #undef HAVE_NET_IF_TUN_H */
+
+/* Define to 1 if you have the <net/tun/if_tun.h> header file. */
+/* #undef HAVE_NET_TUN_IF_TUN_H */
+
+/* Define if you have POSIX threads libraries and header files. */
+#define HAVE_PTHREAD 1
+
+/* Have PTHREAD_PRIO_INHERIT. */
+#define HAVE_PTHREAD_PRIO_INHERIT 1
+
+/* Define to 1 if you have the `pthread_setaffinity_np' function. */
+#define HAVE_PTHREAD_SETAFFINITY_NP 1
+
+/* Define to 1 if you have the <pwd.h> header file. */
+#define HAVE_PWD_H 1
+
+/* Define to 1 if you have the <resolv.h> header file. */
+#define HAVE_RESOLV_H 1
+
+/* Do we have sockaddr_in.sin_len? */
+/* #undef HAVE_SIN_LEN */
+
+/* Do we have stat.st_mtim? */
+#define HAVE_STAT_ST_MTIM 1
+
+/* Do we have stat.st_mtimespec? */
+/* #undef HAVE_STAT_ST_MTIMESPEC */
+
+/* Define to 1 if you have the <stdint.h> header file. */
+#define HAVE_STDINT_H 1
+
+/* Define to 1 if you have the <stdio.h> header file. */
+#define HAVE_STDIO_H 1
+
+/* Define to 1 if you have the <stdlib.h> header file. */
+#define HAVE_STDLIB_H 1
+
+/* Define to 1 if you have the <strings.h> header file. */
+#define HAVE_STRINGS_H 1
+
+/* Define to 1 if you have the <string.h> header file. */
+#define HAVE_STRING_H 1
+
+/* Define to 1 if you have the `strlcat' function. */
+/* #undef HAVE_STRLCAT */
+
+/* Define to 1 if you have the `strlcpy' function. */
+/* #undef HAVE_STRLCPY */
+
+/* Define to 1 if the system has the type `struct ifaliasreq'. */
+/* #undef HAVE_STRUCT_IFALIASREQ */
+
+/* Define to 1 if the system has the type `struct ifreq'. */
+#define HAVE_STRUCT_IFREQ 1
+
+/* Define to 1 if the system has the type `struct in6_aliasreq'. */
+/* #undef HAVE_STRUCT_IN6_ALIASREQ */
+
+/* Define to 1 if the system has the type `struct in6_ifreq'. */
+/* #undef HAVE_STRUCT_IN6_IFREQ */
+
+/* Define to 1 if the system has the type `struct ip'. */
+#define HAVE_STRUCT_IP 1
+
+/* Define to 1 if the system has the type `struct ip6_hdr'. */
+#define HAVE_STRUCT_IP6_HDR 1
+
+/* Define to 1 if the system has the type `struct iphdr'. */
+#define HAVE_STRUCT_IPHDR 1
+
+/* Define to 1 if you have the <syslog.h> header file. */
+#define HAVE_SYSLOG_H 1
+
+/* Define to 1 if you have the <sys/endian.h> header file. */
+/* #undef HAVE_SYS_ENDIAN_H */
+
+/* Define to 1 if you have the <sys/ethernet.h> header file. */
+/* #undef HAVE_SYS_ETHERNET_H */
+
+/* Define to 1 if you have the <sys/eventfd.h> header file. */
+#define HAVE_SYS_EVENTFD_H 1
+
+/* Define to 1 if you have the <sys/mman.h> header file. */
+#define HAVE_SYS_MMAN_H 1
+
+/* Define to 1 if you have the <sys/socket.h> header file. */
+#define HAVE_SYS_SOCKET_H 1
+
+/* Define to 1 if you have the <sys/stat.h> header file. */
+#define HAVE_SYS_STAT_H 1
+
+/* Define to 1 if you have the <sys/types.h> header file. */
+#define HAVE_SYS_TYPES_H 1
+
+/* Define to 1 if you have the <sys/un.h> header file. */
+#define HAVE_SYS_UN_H 1
+
+/* Define to 1 if you have the <sys/wait.h> header file. */
+#define HAVE_SYS_WAIT_H 1
+
+/* Define to 1 if you have the <time.h> header file. */
+#define HAVE_TIME_H 1
+
+/* Define to 1 if you have the <unistd.h> header file. */
+#define HAVE_UNISTD_H 1
+
+/* enable lock contention statistics */
+/* #undef LOCK_STATS */
+
+/* enable RTT measurement */
+/* #undef MEASURE_RTT */
+
+/* Name of package */
+#define PACKAGE "onioncat"
+
+/* Define to the address where bug reports for this package should be sent. */
+#define PACKAGE_BUGREPORT "bf@abenteuerland.at"
+
+/* Define to the full name of this package. */
+#define PACKAGE_NAME "onioncat"
+
+/* Define to the full name and version of this package. */
+#define PACKAGE_STRING "onioncat 4.11.0"
+
+/* Define to the one symbol short name of this package. */
+#define PACKAGE_TARNAME "onioncat"
+
+/* Define to the home page for this package. */
+#define PACKAGE_URL ""
+
+/* Define to the version of this package. */
+#define PACKAGE_VERSION "4.11.0"
+
+/* enable packet logging */
+/* #undef PACKET_LOG */
+
+/* enable packet queue */
+/* #undef PACKET_QUEUE */
+
+/* Define to necessary symbol if this constant uses a non-standard name on
+   your system. */
+/* #undef PTHREAD_CREATE_JOINABLE */
+
+/* Define to 1 if all of the C90 standard headers exist (not just the ones
+   required in a freestanding environment). This macro is provided for
+   backward compatibility; new code need not use it. */
+#define STDC_HEADERS 1
+
+/* SVN Revision */
+#define SVN_REVISION "svnversion"
+
+/* open tunnel device with IFF_NO_PI */
+/* #undef TUN_NO_PI */
+
+/* Version number of package */
+#define VERSION "4.11.0"
+
+/* exclude tunnel device code */
+/* #undef WITHOUT_TUN */
+
+/* Enable DNS lookup for v3 names with resolver. */
+#define WITH_DNS_RESOLVER 1
+
+/* Enable loopback_responder(). */
+#define WITH_LOOPBACK_RESPONDER 1
+
+/* Define to empty if `const' does not conform to ANSI C. */
+/* #undef const */
@@ -29,7 +29,10 @@
 
 
 //! flags to be set by signal handler
-volatile int sig_term_ = 0, sig_usr1_ = 0;
+volatile int sig_term_ = 0, sig_usr1_ = 0, sig_hup_ = 0;
+//! additional identities of option -y, they are added after the own address is known
+static const char *ident_spec_[MAX_IDENT];
+static int ident_spec_cnt_ = 0;
 
 
 static const char *enabled(int n)
@@ -55,17 +58,23 @@ void usage(const char *s)
          "   -e <ifup-script>      execute ifup-script after opening interface\n"
          "   -E <n>                expire hosts entries after <n> seconds. (default = %d)\n"
          "   -f <config_file>      read config from config_file (default = %s)\n"
+         "   -F <mtu>              set MTU of tunnel device, frame buffers are sized accordingly\n"
          "   -g <hosts_path>       set path to hosts file for hosts lookup (default  = \"%s\").\n"
          "                         This option implicitly activates -H.\n"
          "   -G <hosts_cache>      Hosts cache file (default = \"%s\").\n"
          "   -i                    convert onion hostname to IPv6 and exit\n"
          "   -I                    GarliCat mode, use I2P instead of Tor\n"
          "   -J                    Disable remote hostname validation.\n"
+         "   -k <thread>:<cpus>    pin thread to CPUs, e.g. receiver:2 or main:0-1,4\n"
          "   -l [<ip>:]<port>      set ocat listen address and port, default = 127.0.0.1:%d\n"
          "   -L <log_file>         log output to <log_file> (default = stderr)\n"
+         "   -m <socket_path>      offer shared memory packet rings on UNIX socket <socket_path>\n"
+         "   -M <size>[K|M|G]      limit total accounted memory, default = unlimited\n"
          "   -n <tunname>          set the tun device name, may contain format string (e.g. tun%%d)\n"
          "   -o <ipv6_addr>        convert IPv6 address to onion url and exit\n"
+         "   -O                    send queued packets as optimistic data behind SOCKS5 request\n"
          "   -p                    use TAP device instead of TUN\n"
+         "   -Q                    enable TCP Fast Open on listeners and DIRECT connections\n"
          "   -P [<pid_file>]       create pid file at location of <pid_file> (default = %s)\n"
          "   -r                    run as root, i.e. do not change uid/gid\n"
          "   -R                    generate a random local onion URL\n"
@@ -78,6 +87,15 @@ void usage(const char *s)
          "   -U                    disable unidirectional mode\n"
          "   -u <user>             change UID to user, default = \"%s\"\n"
          "   -V                    Disable destination IP verification.\n"
+         "   -W <n>                account traffic per flow in a table of <n> flows\n"
+         "   -x [<ip>:]<port>      serve also the other network (I2P or Tor) in parallel using\n"
+         "                         the SOCKS server at <ip>:<port>\n"
+         "   -y <onion_hostname>[:<port>]\n"
+         "                         Serve an additional local identity. Incoming connections\n"
+         "                         on 127.0.0.1:<port> are bound to this identity.\n"
+         "   -z                    synchronise hosts db with other OnionCat nameservers by zone\n"
+         "                         transfers and serve zone transfers\n"
+         "   -Z <file>             share hosts db with other local OnionCat instances through <file>\n"
          "   -2                    Enable OnionCat3 backwards compatibility options. This is the same as\n"
          "                         setting options -D -H -S.\n"
          "   -4                    enable IPv4 support (default = %d)\n"
@@ -241,6 +259,10 @@ void sig_handler(int sig)
       case SIGUSR1:
          sig_usr1_ = 1;
          break;
+
+      case SIGHUP:
+         sig_hup_ = 1;
+         break;
    }
 }
 
@@ -260,6 +282,12 @@ void proc_signals(void)
       unlock_setup();
       log_msg(LOG_NOTICE, "stats will be cleared after next stats output");
    }
+   if (sig_hup_)
+   {
+      sig_hup_ = 0;
+      log_msg(LOG_NOTICE, "caught SIGHUP");
+      (void) reload_config();
+   }
 }
 
 
@@ -462,11 +490,13 @@ void parse_opt_late(int argc, char *argv[])
 int parse_opt(int argc, char *argv[])
 {
    int c, urlconv = 0;
+   char *s;
+   long n;
 
    log_debug("parse_opt()");
    opterr = 1;
    optind = 1;
-   while ((c = getopt(argc, argv, "f:IA:abBCd:De:E:g:G:hHrRiJopl:t:T:s:SUu:V245:L:P:n:")) != -1)
+   while ((c = getopt(argc, argv, "f:F:IA:abBCd:De:E:g:G:hHrRiJk:m:M:oOpQl:t:T:s:SUu:VW:x:y:zZ:245:L:P:n:")) != -1)
    {
       log_debug("getopt(): c = %c, optind = %d, opterr = %d, optarg = \"%s\"", c, optind, opterr, SSTR(optarg));
       switch (c)
@@ -530,6 +560,12 @@ int parse_opt(int argc, char *argv[])
 
          case 'E':
             CNF(expire) = atoi(optarg);
+            if (CNF(expire) < 0)
+            {
+               log_msg(LOG_ERR, "expiry time must not be negative");
+               exit(1);
+            }
+            CNF(expire_opt) = 1;
             break;
 
          case 'g':
@@ -567,6 +603,45 @@ int parse_opt(int argc, char *argv[])
                add_listener(optarg);
             break;
 
+         case 'k':
+            if (parse_thread_affinity(optarg) == -1)
+               exit(1);
+            break;
+
+         case 'm':
+            CNF(ring_path) = optarg;
+            break;
+
+         case 'Q':
+#if defined(TCP_FASTOPEN) || defined(TCP_FASTOPEN_CONNECT)
+            CNF(tcp_fastopen) = 1;
+#else
+            log_msg(LOG_WARNING, "TCP Fast Open not supported on this system, ignoring -Q");
+#endif
+            break;
+
+         case 'O':
+#ifdef PACKET_QUEUE
+            CNF(socks_opt_data) = 1;
+#else
+            log_msg(LOG_WARNING, "option -O requires packet queue (--enable-packet-queue), ignoring");
+#endif
+            break;
+
+         case 'M':
+            if (mem_set_limit("total", optarg) == -1)
+               exit(1);
+            break;
+
+         case 'F':
+            CNF(tun_mtu) = atoi(optarg);
+            if (CNF(tun_mtu) < MIN_TUN_MTU || CNF(tun_mtu) > 65535)
+            {
+               log_msg(LOG_ERR, "MTU must be in the range %d - 65535", MIN_TUN_MTU);
+               exit(1);
+            }
+            break;
+
          case 'L':
             if (!strcmp(optarg, "syslog"))
                CNF(use_syslog) = 1;
@@ -637,6 +712,35 @@ int parse_opt(int argc, char *argv[])
             CNF(verify_dest) = 1;
             break;
 
+         case 'x':
+            if (set_socks2_dst(optarg) == -1)
+               exit(1);
+            break;
+
+         case 'y':
+            if (ident_spec_cnt_ >= MAX_IDENT)
+               log_msg(LOG_ERR, "maximum number of identities (%d) reached", MAX_IDENT), exit(1);
+            ident_spec_[ident_spec_cnt_++] = optarg;
+            break;
+
+         case 'W':
+            n = strtol(optarg, &s, 0);
+            if (*s || n < 0 || n > MAX_FLOW_SLOTS)
+            {
+               log_msg(LOG_ERR, "number of flow slots must be in the range 0 - %d", MAX_FLOW_SLOTS);
+               exit(1);
+            }
+            CNF(flow_slots) = n;
+            break;
+
+         case 'z':
+            CNF(hosts_sync) = 1;
+            break;
+
+         case 'Z':
+            CNF(shm_hosts) = optarg;
+            break;
+
          case '4':
             CNF(ipv4_enable) = 1;
             break;
@@ -651,6 +755,77 @@ int parse_opt(int argc, char *argv[])
 }
 
 
+/*! The packet forwarder is run by the main thread. It reads the frames from
+ * the tunnel device and hands them over to the routing engine.
+ */
+void packet_forwarder(void)
+{
+   char *buf;
+   int rlen;
+   fd_set rset;
+#ifdef PACKET_LOG
+   int pktlog;
+
+   log_debug("opening packetlog");
+   if ((pktlog = open("pkt_log", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1)
+      log_debug("could not open packet log: %s", strerror(errno));
+#endif
+
+   // frame size is derived from the MTU of the tunnel device
+   if ((buf = malloc(CNF(frame_size))) == NULL)
+      log_msg(LOG_EMERG, "could not get memory for frame buffer: \"%s\"", strerror(errno)), exit(1);
+
+   for (;;)
+   {
+      update_thread_activity();
+      // check if signals have arrived
+      proc_signals();
+
+      // check for termination request
+      if (term_req())
+         break;
+
+#ifdef __OpenBSD__
+      // workaround for OpenBSD userland threads
+      fcntl(CNF(tunfd[0]), F_SETFL, fcntl(CNF(tunfd[0]), F_GETFL) & ~O_NONBLOCK);
+#endif
+      log_debug("reading from tunfd[0] = %d", CNF(tunfd[0]));
+      if ((rlen = tun_read(CNF(tunfd[0]), buf + BUF_OFF, CNF(frame_size) - BUF_OFF)) == -1)
+      {
+         rlen = errno;
+         log_debug("read from tun %d returned on error: \"%s\"", CNF(tunfd[0]), strerror(rlen));
+         if (rlen == EINTR)
+         {
+            log_debug("restarting");
+            continue;
+         }
+         // tunnel device is non-blocking, see tun_writer()
+         if (rlen == EAGAIN)
+         {
+            FD_ZERO(&rset);
+            FD_SET(CNF(tunfd[0]), &rset);
+            (void) oc_select(CNF(tunfd[0]) + 1, &rset, NULL, NULL);
+            continue;
+         }
+         set_term_req();
+         break;
+      }
+      rlen += BUF_OFF;
+
+      log_debug("received on tunfd %d, framesize %d + %d", CNF(tunfd[0]), rlen - 4, 4 - BUF_OFF);
+
+#ifdef PACKET_LOG
+      if ((pktlog != -1) && (write(pktlog, buf, rlen) == -1))
+         log_debug("could not write frame to packet log: %s", strerror(errno));
+#endif
+
+      (void) forward_frame(buf, rlen);
+   }
+
+   free(buf);
+}
+
+
 int main(int argc, char *argv[])
 {
 #ifdef HAVE_GETPWNAM_R
@@ -735,22 +910,12 @@ int main(int argc, char *argv[])
    else
       rand_onion(CNF(onion_url));
 
-   if (validate_hostname(CNF(onion_url)) == -1)
+   if (set_ocat_addr() == -1)
       exit(1);
-   *strchr(CNF(onion_url), '.') = '\0';
 
-   // if it is a v3 hostname
-   if ((int) strlen(CNF(onion_url)) == CNF(l_hs_namelen))
-   {
-      // copy it to the dedicated v3 variable
-      strlcpy(CNF(onion3_url), CNF(onion_url), sizeof(CNF(onion3_url)));
-      // truncate name for IPv6 conversion to the lower 16 chars
-      strlcpy(CNF(onion_url), &CNF(onion_url[CNF(l_hs_namelen) - 16]), 17);
-   }
-   if (oniontipv6(CNF(onion_url), &CNF(ocat_addr)) == -1)
-      log_msg(LOG_ERR, "parameter seems not to be valid onion hostname"), exit(1);
-   if (CNF(ipv4_enable))
-      oniontipv4(CNF(onion_url), &CNF(ocat_addr4), ntohl(CNF(ocat_addr4_mask)));
+   for (c = 0; c < ident_spec_cnt_; c++)
+      if (add_ocat_ident(ident_spec_[c]) == -1)
+         exit(1);
 
    if (!inet_ntop(AF_INET6, &CNF(ocat_addr), ip6addr, INET6_ADDRSTRLEN))
       log_msg(LOG_ERR, "cannot convert IP address with inet_ntop: \"%s\"", strerror(errno)),
@@ -764,17 +929,8 @@ int main(int argc, char *argv[])
       exit(0);
    }
 
-   // add own address to hosts DB
-   if (*CNF(onion3_url))
-   {
-      char hname[300];
-      snprintf(hname, sizeof(hname), "%s%s", CNF(onion3_url), CNF(domain));
-      hosts_add_entry(&CNF(ocat_addr), hname, HSRC_SELF, time(NULL), -1);
-   }
-
    log_msg(LOG_INFO, "%s", CNF(version));
 
-   memcpy(&CNF(ocat_hwaddr[3]), &CNF(ocat_addr.s6_addr[13]), 3);
    if (CNF(use_tap))
       log_msg(LOG_INFO, "MAC address %s", ether_ntoa_r((struct ether_addr*) CNF(ocat_hwaddr), hw));
 
@@ -785,6 +941,10 @@ int main(int argc, char *argv[])
       log_msg(LOG_CRIT, "error opening TUN/TAP device");
       exit(1);
    }
+#else
+   // size frame buffers as tun_alloc() does
+   CNF(frame_size) = (CNF(tun_mtu) ? CNF(tun_mtu) : DEF_TUN_MTU) + FRAME_HDR_LEN;
+   log_msg(LOG_INFO, "frame size set to %d", CNF(frame_size));
 #endif
 
    log_msg(LOG_INFO, "IPv6 address %s", ip6addr);
@@ -818,8 +978,15 @@ int main(int argc, char *argv[])
          add_listener(def);
       }
    }
+   add_ident_listeners();
+
+   if (CNF(flow_slots) > 0)
+      (void) flow_init();
 
-   // start socket receiver thread
+   // start tun writer and socket receiver thread
+   if (init_tun_writer() == -1)
+      log_msg(LOG_EMERG, "couldn't create tun writer notifier"), exit(1);
+   run_ocat_thread("tunwriter", tun_writer, NULL);
    run_ocat_thread("receiver", socket_receiver, NULL);
    // create listening socket and start socket acceptor
    if (CNF(oc_listen_cnt) > 0)
@@ -868,6 +1035,10 @@ int main(int argc, char *argv[])
    if (!getuid())
       mk_cache_dir(STATEDIR, pwd->pw_uid, pwd->pw_gid);
 
+   // map shared hosts db before dropping privileges
+   if (CNF(shm_hosts) != NULL && shm_hosts_open(CNF(shm_hosts)) == -1)
+      log_msg(LOG_WARNING, "continuing without shared hosts db");
+
    // wait for nameserver port 53 to be bound before dropping privileges
    if (CNF(dns_server) && CNF(ocat_ns_port) < 1024)
    {
@@ -905,8 +1076,8 @@ int main(int argc, char *argv[])
       open_connect_log(pwd->pw_dir);
 
    // create socks connector thread and communication queue
-   if (pipe(CNF(socksfd)) == -1)
-      log_msg(LOG_EMERG, "couldn't create socks connector pipe: \"%s\"", strerror(errno)), exit(1);
+   if (init_socks_connector() == -1)
+      log_msg(LOG_EMERG, "couldn't create socks connector notifier"), exit(1);
    if (CNF(socks_dst)->sin_family)
       run_ocat_thread("connector", socks_connector_sel, NULL);
    else
@@ -920,6 +1091,10 @@ int main(int argc, char *argv[])
    if (CNF(controller))
       run_ocat_thread("controller", ocat_controller, NULL);
 
+   // start shared memory packet ring server
+   if (CNF(ring_path))
+      run_ocat_thread("rings", ring_server, NULL);
+
 #ifdef WITH_LOOPBACK_RESPONDER
    // starting loopback responder
    run_ocat_thread("lloopback", local_loopback_responder, NULL);
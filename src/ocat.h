@@ -78,6 +78,12 @@
 #ifdef HAVE_NETINET_IN_SYSTM_H
 #include <netinet/in_systm.h>
 #endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #ifdef HAVE_NET_IF_H
 #include <net/if.h>
 #endif
@@ -180,6 +186,8 @@
 
 //! Maximum number of peers allowed.
 #define MAXPEERS 1024
+//! Maximum number of additional local onion identities (option -y).
+#define MAX_IDENT 16
 #ifdef __OpenBSD__
 #define OCAT_UNAME "_tor"
 #elif __FreeBSD__
@@ -208,13 +216,60 @@
 #define MAX_CTRL_ARGV 10
 //! Maximum frame (packet) size, should be able to keep one maximum size ipv6-packet: 2^16 + 40 + 4
 #define FRAME_SIZE 65580
+//! bytes of a frame in addition to the IP packet (tunnel header + ethernet header)
+#define FRAME_HDR_LEN (4 + (int) sizeof(struct ether_header))
+//! minimum MTU of tunnel device (IPv6 minimum MTU)
+#define MIN_TUN_MTU 1280
+//! MTU assumed if there is no tunnel device and no MTU was set
+#define DEF_TUN_MTU 1500
+//! number of peer structures allocated at once
+#define PEER_SLAB_SIZE 64
+
+//! subsystems of memory accounting
+#define MEM_PEER 0
+#define MEM_RXBUF 1
+#define MEM_PKTQ 2
+#define MEM_HOSTS 3
+#define MEM_ROUTE 4
+#define MEM_RESOLV 5
+#define MEM_SOCKS 6
+#define MEM_TUNQ 7
+#define MEM_FLOWS 8
+#define MEM_SUBSYS_CNT 9
+//! default memory limit of the queue of the tunnel device writer
+#define MEM_TUNQ_LIMIT (4 * 1024 * 1024)
+
+//! kinds of locks of lock statistics
+#define LOCK_PEERS 0
+#define LOCK_PEER 1
+#define LOCK_HOSTS 2
+#define LOCK_V6ROUTE 3
+#define LOCK_V4ROUTE 4
+#define LOCK_MAC 5
+#define LOCK_LOG 6
+#define LOCK_SETUP 7
+#define LOCK_FLOWS 8
+#define LOCK_CNT 9
+
+//! direction of packets in flow accounting
+#define FLOW_IN 0
+#define FLOW_OUT 1
+//! maximum number of flow accounting slots (option -W)
+#define MAX_FLOW_SLOTS 1048576
+
+#ifdef LOCK_STATS
+#define oc_mutex_lock(m, c) lock_stat_lock(m, c)
+#define oc_mutex_unlock(m, c) lock_stat_unlock(m, c)
+#else
+#define oc_mutex_lock(m, c) pthread_mutex_lock(m)
+#define oc_mutex_unlock(m, c) pthread_mutex_unlock(m)
+#endif
 
 //! Standard buffer size 1024 bytes
 #define SIZE_1K 1024
 //! Standard buffer size 256 bytes
 #define SIZE_256 256
 
-#define DEQUEUER_WAKEUP 3
 //! maximum number a packet stays in queue
 #define MAX_QUEUE_DELAY 10
 
@@ -226,8 +281,24 @@
 #define STAT_WAKEUP 600
 //! keepalive time
 #define KEEPALIVE_TIME 60
+//! \# of secs after the cleaner checks the liveness of permanent peers
+#define PERM_CHECK_WAKEUP 1
+//! receive idle time of permanent peers after which a liveness probe is sent
+#define PERM_PROBE_TIME 10
+//! min. timeout of a liveness probe after which a standby connection is opened
+#define PERM_PROBE_TIMEOUT 10
+//! max. timeout of a liveness probe
+#define PERM_PROBE_TIMEOUT_MAX 30
+//! the probe timeout is this multiple of the round trip time of the probes
+#define PERM_RTT_FACTOR 4
+//! time after the probe timeout after which a degraded permanent peer is closed even without standby
+#define PERM_FAIL_TIMEOUT 30
+//! TCP_USER_TIMEOUT of permanent connections in milliseconds
+#define PERM_USER_TIMEOUT 10000
 //! select timeout (to avoid endless blocking)
 #define SELECT_TIMEOUT 10
+//! maximum time a thread sleeps if it has no pending deadline
+#define MAX_SELECT_TIMEOUT 300
 //! maximum time of thread inactivity before warning (should be > than SELECT_TIMEOUT and > CLEANER_WAKEUP)
 #define MAX_INACTIVITY 25
 
@@ -255,6 +326,8 @@
 
 //! Maximum length of thread names.
 #define THREAD_NAME_LEN 11
+//! maximum number of thread affinity settings
+#define MAX_AFFINITY 16
 //! thread stack size (default stack size on OpenBSD is too small)
 #define THREAD_STACK_SIZE 262144
 
@@ -286,6 +359,16 @@
 
 //! maximum number of SOCKS retries before becoming deleted
 #define SOCKS_MAX_RETRY 3
+//! maximum number of bytes of optimistic data sent behind a SOCKS5 request
+#define SOCKS_OPT_DATA 8192
+//! length of TCP Fast Open queue of listeners
+#define TFO_QUEUE_LEN 32
+//! lifetime of resolved names of DIRECT connections in seconds
+#define DIRECT_CACHE_TTL 300
+//! lifetime of failed lookups of DIRECT connections in seconds
+#define DIRECT_CACHE_NEG_TTL 30
+//! maximum number of resolver threads of DIRECT connections
+#define DIRECT_RESOLVERS 4
 //! maximum numner of DNS retries
 #define SOCKS_DNS_RETRY 5
 //! retry time for DNS request
@@ -320,6 +403,8 @@
 #define MIN_RECONNECT_TIME 30
 //! define default maximum number of concurrent controller sessions
 #define MAX_DEF_CTRL_SESS 5
+//! upper limit of concurrent controller sessions
+#define MAX_CTRL_SESS 256
 
 #define MFD_SET(f,s,m) {FD_SET(f, s); m = f > m ? f : m;}
 
@@ -349,14 +434,25 @@
 #define SSTR(x) (x != NULL ? x : "(nil)")
 
 // Solaris and the Windows OpenVPN tunnel driver do not send a 4 byte tunnel
-// header thus we adjust reads and writes.
-#if defined(__sun__) || defined(__CYGWIN__)
+// header thus we adjust reads and writes. On Linux the header is omitted if
+// the device is opened with IFF_NO_PI (see --enable-tun-nopi).
+#if defined(__sun__) || defined(__CYGWIN__) || (defined(__linux__) && defined(TUN_NO_PI))
 #define BUF_OFF 4
 #else
 #define BUF_OFF 0
 #endif
 
 
+//! Additional local onion identity (option -y)
+typedef struct OcatIdent
+{
+   char onion_url[ONION_URL_LEN + 1];  //!< lower 16 chars of hostname
+   char onion3_url[SIZE_256];          //!< long hs v3 onion name, empty for v2 and I2P
+   struct in6_addr addr;               //!< IPv6 address of identity
+   int port;                           //!< local listener port, 0 if none
+   int net_type;                       //!< network type of identity
+} OcatIdent_t;
+
 //! General configuration data
 /*! OcatSetup is used as a global structure holding general configuration
  * parameters for OnionCat.
@@ -449,8 +545,6 @@ struct OcatSetup
    struct sockaddr **ctrl_listen;
    int *ctrl_listen_fd;
    int ctrl_listen_cnt;
-   //! communication pipe for socks "selected" connector
-   int socksfd[2];
    int net_type;
    int max_ctrl, ctrl_active;
    //! pipe filedescriptors for pid deletion process
@@ -470,6 +564,19 @@ struct OcatSetup
    uint16_t ocat_ns_port;  //!< default port number of name server
    int expire;             //!< expiry time of remote hosts entries
    int verify_dest;        //!< verify destination address of incoming packets
+   char *ring_path;        //!< path of UNIX socket for packet ring clients
+   OcatIdent_t *ident;     //!< additional local onion identities
+   int ident_cnt;          //!< number of entries in ident
+   int net2_type;          //!< type of 2nd network served in parallel (option -x), -1 if none
+   struct sockaddr_in6 socks2_dst; //!< SOCKS server of 2nd network, may be sockaddr_in
+   int tun_mtu;            //!< MTU of tunnel device, 0 = keep system default
+   int frame_size;         //!< max. frame size including tunnel and ethernet header
+   int socks_opt_data;     //!< send queued packets as optimistic data behind SOCKS5 request
+   int tcp_fastopen;       //!< enable TCP Fast Open
+   int hosts_sync;         //!< bulk hosts synchronisation with other nameservers
+   char *shm_hosts;        //!< path of hosts db shared with other local instances
+   int flow_slots;         //!< number of slots of flow accounting table, 0 = disabled
+   int expire_opt;         //!< expiry time was set with option -E
 };
 
 #ifdef PACKET_QUEUE
@@ -502,31 +609,49 @@ typedef struct Socks5Hdr
    char addr;
 } __attribute__((packed)) Socks5Hdr_t;
 
-//! This structure holds all data associated with a peer (a remote OnionCat).
+//! Rarely accessed data of a peer which is kept out of line of OcatPeer_t.
+typedef struct OcatPeerCold
+{
+   char sname[SIZE_256];   //!< source hostname as specified by peer
+   time_t hosts_time;      //!< time of last hosts db update by keepalive
+   char fragbuf[];         //!< (de)frag buffer of CNF(frame_size) bytes
+} OcatPeerCold_t;
+
+//! memory size of the out of line data of a peer
+#define PEER_COLD_SIZE (sizeof(OcatPeerCold_t) + CNF(frame_size))
+
+/*! This structure holds all data associated with a peer (a remote OnionCat).
+ * The fields which are accessed when scanning the peer list are kept at the
+ * beginning, large buffers are found in OcatPeerCold_t. */
 typedef struct OcatPeer
 {
    struct OcatPeer *next;  //!< pointer to next peer in list
    struct in6_addr addr;   //!< remote address of peer
    int tcpfd;              //!< remote file descriptor
-   time_t time;            //!< timestamp of latest packet
-   time_t sdelay;          //!< connection setup delay
-   time_t otime;           //!< opening time
    int state;              //!< status of peer
+   int perm;               //!< keep peer permanently open
    int dir;                //!< direction this session was opened
+   time_t time;            //!< timestamp of latest packet
+   time_t rtime;           //!< timestamp of latest received data
+   time_t ptime;           //!< timestamp of pending liveness probe, 0 if none
+   int standby;            //!< standby connection was requested for this peer
+   int prtt;               //!< smoothed round trip time of liveness probes in seconds
+   int fraglen;            //!< current frag buffer size
+   int skip;               //!< bytes of oversized packet still to be dropped
+   pthread_mutex_t mutex;  //!< mutex for thread locking
+   struct in6_addr saddr;  //!< source address as specified by peer
+   struct in6_addr laddr;  //!< local identity of peer, unspecified for CNF(ocat_addr)
    unsigned long out;      //!< bytes output
    unsigned long in;       //!< bytes input
    uint32_t *tunhdr;       //!< pointer to local tun frame header
    char *fragbuf;          //!< pointer to (de)frag buffer
-   int fraglen;            //!< current frag buffer size
-   pthread_mutex_t mutex;  //!< mutex for thread locking
-   int perm;               //!< keep peer permanently open
+   time_t sdelay;          //!< connection setup delay
+   time_t otime;           //!< opening time
    time_t last_io;         //!< timestamp when last I/O packet measurement started
    unsigned inm;
    unsigned outm;
    int rand;               //!< random peer number
-   struct in6_addr saddr;  //!< source address as specified by peer
-   char sname[SIZE_256];   //!< source hostname as specified by peer
-   char _fragbuf[FRAME_SIZE]; //!< (de)frag buffer
+   OcatPeerCold_t *cold;   //!< out of line data
 } OcatPeer_t;
 
 //! OcatThread is a control structure to manage each thread of OnionCat.
@@ -542,6 +667,7 @@ typedef struct OcatThread
    void *parm;
    int ready;              //!< thread is ready, i.e. every initialization is done
    time_t t_act;           //!< timestamp of latest activity
+   time_t t_wait;          //!< thread waits for events until this time
    int flags;              //!< some flags, used for debugging
 } OcatThread_t;
 
@@ -553,12 +679,17 @@ typedef struct SocksQueue
 {
    struct SocksQueue *next;
    struct in6_addr addr;
+   struct in6_addr laddr;  //!< address of local identity, unspecified for the main identity
    int state;
    int perm;
    int fd;
    time_t restart_time;
    time_t connect_time;
    int retry;
+#ifdef PACKET_QUEUE
+   char *opt_data;         //!< copy of optimistic data sent behind SOCKS5 request
+   int opt_len;
+#endif
 #ifdef WITH_DNS_LOOKUP
    struct sockaddr_in6 ns_addr;
    uint16_t id;
@@ -566,6 +697,29 @@ typedef struct SocksQueue
 #endif
 } SocksQueue_t;
 
+//! Coalescing cross-thread notifier, see ocatnotify.c.
+typedef struct OcatNotify
+{
+   int fd[2];              //!< eventfd (fd[0] == fd[1]) or pipe
+   int pending;            //!< a wakeup is pending
+} OcatNotify_t;
+
+//! Element of a lock-free multi-producer/single-consumer queue.
+typedef struct OcatMpscNode
+{
+   struct OcatMpscNode *next;
+} OcatMpscNode_t;
+
+//! Frame queued for the tun writer, see tun_writer().
+typedef struct OcatTunFrame
+{
+   OcatMpscNode_t node;    //!< queue link, must be first element
+   int len;                //!< length of IP packet
+   uint32_t tunhdr;        //!< tunnel header of packet
+   //! frame buffer, the packet starts at offset FRAME_HDR_LEN
+   char frame[];
+} OcatTunFrame_t;
+
 //! IPv4 routing table entry
 typedef struct IPv4Route
 {
@@ -670,6 +824,7 @@ extern char *tun_dev_;
 
 /* ocat.c */
 void proc_signals(void);
+void packet_forwarder(void);
 
 /* ocatlog.c */
 int open_connect_log(const char*);
@@ -694,7 +849,11 @@ int oniontipv4(const char *, struct in_addr *, int);
 int has_ocat_prefix(const struct in6_addr *);
 void rand_onion(char *);
 const char *inet_ntops(const struct sockaddr *, struct sockaddr_str *);
+int validate_onionname0(const char *, struct in6_addr *, int);
 int validate_onionname(const char *, struct in6_addr *);
+int addr_net_type(const struct in6_addr *);
+int domain_net_type(const char *);
+void strtolower(char *);
 /*
 #define IN6_HAS_TOR_PREFIX(a) ((((__const uint32_t *) (a))[0] == ((__const uint32_t*)(TOR_PREFIX))[0]) \
       && (((__const uint16_t*)(a))[2] == ((__const uint16_t*)(TOR_PREFIX))[2]))
@@ -708,21 +867,32 @@ int tun_alloc(char *, int);
 /* ocatctrl.c */
 void *ctrl_handler(void *);
 void parse_config(int );
+int reload_config(void);
 void *ocat_controller(void *);
 
 /* ocatroute.c */
 extern int sockfd_[2];
 void init_peers(void);
 void *socket_receiver(void *);
-void packet_forwarder(void);
+int forward_frame(char *, int);
 #ifdef PACKET_QUEUE
 void *packet_dequeuer(void *);
 #endif
 void *socket_acceptor(void *);
 void *socket_cleaner(void *);
 int insert_peer(int, const SocksQueue_t *, time_t);
-int run_listeners(struct sockaddr **, int *, int, int (*)(int));
+int run_listeners(struct sockaddr **, int *, int, int (*)(int), OcatNotify_t *);
+void update_listeners(struct sockaddr **, int);
 int send_keepalive(OcatPeer_t *);
+int send_probe(OcatPeer_t *);
+void wake_socket_receiver(void);
+int init_tun_writer(void);
+void *tun_writer(void *);
+#ifdef PACKET_QUEUE
+void wake_dequeuer(void);
+int dequeue_packets(const struct in6_addr *, char *, int);
+void requeue_packets(const struct in6_addr *, const char *, int);
+#endif
 void set_select_timeout(struct timeval *);
 void set_select_timeout0(struct timeval *, int);
 void set_nonblock(int);
@@ -744,8 +914,13 @@ void detach_thread(void);
 int snprint_threads(char *, int , const char *);
 void print_threads(FILE *);
 void log_threads(void);
+int set_thread_affinity(const char *, const char *);
+int parse_thread_affinity(const char *);
+void print_thread_affinity(int);
 int term_req(void);
 void set_term_req(void);
+int term_wakeup_fd(void);
+void set_thread_wait(time_t);
 int wait_thread_by_name_ready(const char *);
 int set_thread_ready(void);
 void update_thread_activity(void);
@@ -781,11 +956,23 @@ void init_setup(void);
 void post_init_setup(void);
 void lock_setup(void);
 void unlock_setup(void);
+int set_ocat_addr(void);
+int add_ocat_ident(const char *);
+void add_ident_listeners(void);
+const OcatIdent_t *get_ident(const struct in6_addr *);
+const OcatIdent_t *get_ident_by_fd(int);
+int is_local_addr(const struct in6_addr *);
+void print_idents(int);
+int set_socks2_dst(const char *);
 
 /* ocatipv4route.c */
-struct in6_addr *ipv4_lookup_route(uint32_t);
+struct in6_addr *ipv4_lookup_route(uint32_t, struct in6_addr *);
 int ipv4_add_route_a(const char *, const char *, const char *);
 void print_routes(int);
+int ipv4_add_route(IPv4Route_t *, IPv4Route_t **, uint32_t);
+int ipv4_parse_route(const char *, const char *, const char *, IPv4Route_t *);
+void ipv4_free_routes(IPv4Route_t *);
+void ipv4_replace_routes(IPv4Route_t *);
 
 /* ocateth.c */
 int eth_check(char *, int);
@@ -804,8 +991,13 @@ uint16_t *malloc_ckbuf(struct in6_addr, struct in6_addr, uint16_t, uint8_t, cons
 /* ocatsocks.c */
 void socks_enqueue(const SocksQueue_t *);
 void socks_queue(struct in6_addr, int);
+void socks_queue_ident(struct in6_addr, int, const struct in6_addr *);
+void socks_queue_delayed(struct in6_addr, int, const struct in6_addr *, time_t);
+void socks_hold(struct in6_addr, time_t);
+void socks_cancel(struct in6_addr);
 void print_socks_queue(int);
 void sig_socks_connector(void);
+int init_socks_connector(void);
 void *socks_connector_sel(void *);
 int test_socks_server(void);
 int synchron_socks_connect(const struct in6_addr *);
@@ -821,12 +1013,53 @@ void delete_listeners(struct sockaddr **, int *, int);
 int fdprintf(int, const char *, va_list);
 int oc_select(int, fd_set *, fd_set *, fd_set *);
 int oc_select0(int, fd_set *, fd_set *, fd_set *, int);
+int oc_select_until(int, fd_set *, fd_set *, fd_set *, time_t);
 
 /* ocatipv6route.c */
-struct in6_addr *ipv6_lookup_route(const struct in6_addr *);
+struct in6_addr *ipv6_lookup_route(const struct in6_addr *, struct in6_addr *);
 void ipv6_print_routes(int);
 int ipv6_add_route(const IPv6Route_t *);
 int ipv6_add_route_a(const char *, const char *, const char *);
+int ipv6_parse_route(const char *, const char *, const char *, IPv6Route_t *);
+int ipv6_replace_routes(IPv6Route_t *, int);
+
+/* ocatlib.c */
+int lib_deliver_packet(const char *, int);
+
+/* ocatnotify.c */
+int notify_init(OcatNotify_t *);
+void notify_close(OcatNotify_t *);
+void notify_signal(OcatNotify_t *);
+void notify_clear(OcatNotify_t *);
+void mpsc_push(OcatMpscNode_t **, OcatMpscNode_t *);
+OcatMpscNode_t *mpsc_take(OcatMpscNode_t **);
+
+/* ocatmem.c */
+void mem_account(int, size_t);
+void mem_release(int, size_t);
+int mem_charge(int, size_t);
+int mem_avail(int, size_t);
+int mem_set_limit(const char *, const char *);
+void print_mem_usage(int);
+
+/* ocatlock.c */
+#ifdef LOCK_STATS
+int lock_stat_lock(pthread_mutex_t *, int);
+int lock_stat_unlock(pthread_mutex_t *, int);
+#endif
+void lock_stat_reset(void);
+void print_lock_stats(int);
+
+/* ocatring.c */
+void *ring_server(void *);
+int ring_deliver_packet(const char *, int);
+void print_ring_clients(int);
+
+/* ocatflow.c */
+int flow_init(void);
+void flow_account(const char *, int, int);
+void flow_reset(void);
+void print_flows(int, int);
 
 #ifdef __CYGWIN__
 /* ocat_wintuntap.c */
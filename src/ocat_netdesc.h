@@ -46,6 +46,8 @@ struct NetDesc
 extern const struct NetDesc netdesc_[2];
 
 #define NDESC(x) (netdesc_[CNF(net_type)].x)
+//! network descriptor of a specific network type
+#define NDESC_NT(n, x) (netdesc_[n].x)
 
 
 // ----- these are #defines for Tor -----
@@ -45,6 +45,25 @@ typedef struct ctrl_cmd
 } ctrl_cmd_t;
 
 
+//! settings collected while the config file is reloaded
+typedef struct config_reload
+{
+   struct sockaddr **listen;        //!< new listeners, NULL if none configured
+   int listen_cnt;
+   struct sockaddr_in6 socks_dst;   //!< new SOCKS server
+   int socks_set;                   //!< 1 if socks_dst was configured
+   IPv4Route_t *route4;             //!< new IPv4 routing tree
+   IPv6Route_t *route6;             //!< new IPv6 routing table
+   int route6_cnt;
+   int route_set;                   //!< 1 if routes were configured
+} config_reload_t;
+
+
+// non-NULL while reloading, protected by reload_mutex_
+static config_reload_t *reload_ = NULL;
+static pthread_mutex_t reload_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+
 
 #ifdef WITH_DNS_RESOLVER
 static const char *code_str(int code)
@@ -157,9 +176,13 @@ int ctrl_cmd_usage(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
          "dig <ipv6> ..... Do a hostname lookup.\n"
 #endif
          "hosts .......... list hosts database\n"
+         "idents ......... list local onion identities\n"
          "hreload ........ reload hosts database\n"
+         "reload ......... reload config file\n"
          "status [detail]. list peer status\n"
          "threads ........ show active threads\n"
+         "affinity [<thread> <cpus>]\n"
+         "   ............. show CPU affinity of threads or pin thread to CPUs, e.g. 0-3,6\n"
          "route .......... show routing table\n"
          "route <dst IP> <netmask> <IPv6 gw>\n"
          "   ............. add route to routing table\n"
@@ -167,8 +190,15 @@ int ctrl_cmd_usage(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
          "   ............. connect to a hidden service. if \"perm\" is set,\n"
          "   ............. connection will stay open forever\n"
          "macs ........... show MAC address table\n"
+         "locks [reset] .. show or reset lock contention statistics\n"
+         "flows [<n>|reset]\n"
+         "   ............. show top <n> flows by bytes (default 10) or clear flow table\n"
+         "mem ............ show memory usage of subsystems\n"
+         "memlimit <subsystem> <size>\n"
+         "   ............. set memory limit of subsystem or \"total\", 0 = unlimited\n"
          "ns ............. List OnionCat peer nameservers.\n"
          "queue .......... list pending SOCKS connections\n"
+         "rings .......... list attached packet ring clients\n"
          "setup .......... show internal setup struct\n"
          "version ........ show version\n"
          "write <f> <n> .. write n random bytes to fd f\n"
@@ -224,7 +254,7 @@ int ctrl_cmd_status(fdbuf_t *fdb, int argc, char **argv)
                peer->dir == PEER_INCOMING ? "IN" : "OUT", peer->dir,
                (long) (time(NULL) - peer->time), peer->in, in, u[0], peer->out, out, u[1], (long) peer->sdelay, timestr,
                peer->perm ? "PERMANENT" : "TEMPORARY", peer->perm, peer->rand,
-               inet_ntop(AF_INET6, &peer->saddr, addrstr2, sizeof(addrstr2)), peer->sname
+               inet_ntop(AF_INET6, &peer->saddr, addrstr2, sizeof(addrstr2)), peer->cold->sname
                );
          }
          else
@@ -305,6 +335,26 @@ int ctrl_cmd_threads(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
 }
 
 
+int ctrl_cmd_affinity(fdbuf_t *fdb, int argc, char **argv)
+{
+   if (argc > 1)
+   {
+      if (argc < 3)
+      {
+         log_msg_fd(fdb->fd, LOG_ERR, "usage: affinity <thread> <cpus>");
+         return 1;
+      }
+      if (set_thread_affinity(argv[1], argv[2]) == -1)
+      {
+         log_msg_fd(fdb->fd, LOG_ERR, "could not set affinity of \"%s\"", argv[1]);
+         return 1;
+      }
+   }
+   print_thread_affinity(fdb->fd);
+   return 1;
+}
+
+
 int ctrl_cmd_term(fdbuf_t *UNUSED(fdb), int UNUSED(argc), char **UNUSED(argv))
 {
    set_term_req();
@@ -319,9 +369,30 @@ int ctrl_cmd_kill(fdbuf_t *UNUSED(fdb), int UNUSED(argc), char **UNUSED(argv))
 }
 
 
+static const char *route_err_str(int c)
+{
+   switch (c)
+   {
+      case E_RT_NOTORGW:
+         return "gateway has not TOR prefix";
+
+      case E_RT_ILLNM:
+         return "illegal netmask or prefix length";
+
+      case E_RT_DUP:
+         return "route already exists";
+
+      case E_RT_GWSELF:
+         return "gateway points to me";
+
+      default:
+         return "";
+   }
+}
+
+
 int ctrl_cmd_route(fdbuf_t *fdb, int argc, char **argv)
 {
-   char *s;
    int c;
 
    if (argc == 1)
@@ -341,38 +412,68 @@ int ctrl_cmd_route(fdbuf_t *fdb, int argc, char **argv)
       if ((c = ipv6_add_route_a(argv[1], argv[2], argv[3])) > 0)
          c = 0;
 
-   switch (c)
-   {
-      case E_RT_NOTORGW:
-         s = "gateway has not TOR prefix";
-         break;
+   if (c)
+      log_msg_fd(fdb->fd, LOG_ERR, "%d %s", c, route_err_str(c));
 
-      case E_RT_ILLNM:
-         s = "illegal netmask or prefix length";
-         break;
+   return 1;
+}
 
-      case E_RT_DUP:
-         s = "route already exists";
-         break;
 
-      case E_RT_GWSELF:
-         s = "gateway points to me";
-         break;
+int ctrl_cmd_macs(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
+{
+   print_mac_tbl(fdb->fd);
+   return 1;
+}
 
-      default:
-         s = "";
+
+int ctrl_cmd_mem(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
+{
+   print_mem_usage(fdb->fd);
+   return 1;
+}
+
+
+int ctrl_cmd_locks(fdbuf_t *fdb, int argc, char **argv)
+{
+   if (argc > 1 && !strcmp(argv[1], "reset"))
+      lock_stat_reset();
+   else
+      print_lock_stats(fdb->fd);
+   return 1;
+}
+
+
+int ctrl_cmd_flows(fdbuf_t *fdb, int argc, char **argv)
+{
+   if (argc > 1 && !strcmp(argv[1], "reset"))
+      flow_reset();
+   else
+      print_flows(fdb->fd, argc > 1 ? atoi(argv[1]) : 0);
+   return 1;
+}
+
+
+int ctrl_cmd_memlimit(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   if (mem_set_limit(argv[1], argv[2]) == -1)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "could not set memory limit of \"%s\"", argv[1]);
+      return -1;
    }
+   return 1;
+}
 
-   if (c)
-      log_msg_fd(fdb->fd, LOG_ERR, "%d %s", c, s);
 
+int ctrl_cmd_idents(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
+{
+   print_idents(fdb->fd);
    return 1;
 }
 
 
-int ctrl_cmd_macs(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
+int ctrl_cmd_rings(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
 {
-   print_mac_tbl(fdb->fd);
+   print_ring_clients(fdb->fd);
    return 1;
 }
 
@@ -441,6 +542,17 @@ int ctrl_cmd_hreload(fdbuf_t *UNUSED(fdb), int UNUSED(argc), char **UNUSED(argv)
 }
 
 
+int ctrl_cmd_reload(fdbuf_t *fdb, int UNUSED(argc), char **UNUSED(argv))
+{
+   if (reload_config() == -1)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "reload failed");
+      return -1;
+   }
+   return 1;
+}
+
+
 int ctrl_cmd_connect(fdbuf_t *fdb, int argc, char **argv)
 {
    struct in6_addr in6;
@@ -477,15 +589,23 @@ static ctrl_cmd_t cmd_[] =
    {"close", ctrl_cmd_close, 2},
    {"write", ctrl_cmd_random_write, 3},
    {"threads", ctrl_cmd_threads, 1},
+   {"affinity", ctrl_cmd_affinity, 1},
    {"terminate", ctrl_cmd_term, 1},
    {"kill", ctrl_cmd_kill, 1},
    {"route", ctrl_cmd_route, 1},
    {"macs", ctrl_cmd_macs, 1},
+   {"mem", ctrl_cmd_mem, 1},
+   {"locks", ctrl_cmd_locks, 1},
+   {"flows", ctrl_cmd_flows, 1},
+   {"memlimit", ctrl_cmd_memlimit, 3},
+   {"rings", ctrl_cmd_rings, 1},
+   {"idents", ctrl_cmd_idents, 1},
    {"queue", ctrl_cmd_queue, 1},
    {"setup", ctrl_cmd_setup, 1},
    {"version", ctrl_cmd_version, 1},
    {"hosts", ctrl_cmd_hosts, 1},
    {"hreload", ctrl_cmd_hreload, 1},
+   {"reload", ctrl_cmd_reload, 1},
    {"connect", ctrl_cmd_connect, 1},
    {"ns", ctrl_cmd_ns, 1},
 
@@ -497,6 +617,7 @@ int config_cmd_connect(fdbuf_t *fdb, int argc, char **argv)
 {
    SocksQueue_t sq;
    struct in6_addr in6;
+   OcatPeer_t *peer;
    int perm = 0;
 
    if (validate_onionname(argv[1], &in6) == -1)
@@ -508,6 +629,17 @@ int config_cmd_connect(fdbuf_t *fdb, int argc, char **argv)
    if (argc > 2 && !strcmp("perm", argv[2]))
       perm = 1;
 
+   // connector is already running, don't connect twice
+   if (reload_ != NULL)
+   {
+      lock_peers();
+      peer = search_peer(&in6);
+      unlock_peers();
+      if (peer == NULL)
+         socks_queue(in6, perm);
+      return 1;
+   }
+
    memset(&sq, 0, sizeof(sq));
    IN6_ADDR_COPY(&sq.addr, &in6);
    sq.perm = perm;
@@ -517,9 +649,194 @@ int config_cmd_connect(fdbuf_t *fdb, int argc, char **argv)
 }
 
 
+int config_cmd_affinity(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   if (set_thread_affinity(argv[1], argv[2]) == -1)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "could not set affinity of \"%s\"", argv[1]);
+      return -1;
+   }
+   return 1;
+}
+
+
+int config_cmd_listen(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   struct sockaddr_in6 saddr;
+   struct sockaddr **addr;
+
+   if (reload_ == NULL)
+   {
+      add_listener(argv[1]);
+      return 1;
+   }
+
+   memset(&saddr, 0, sizeof(saddr));
+   if (strsockaddr(argv[1], (struct sockaddr*) &saddr) == -1)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "could not convert address string \"%s\"", argv[1]);
+      return -1;
+   }
+
+   if ((addr = realloc(reload_->listen, sizeof(*addr) * (reload_->listen_cnt + 1))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not get memory for listener list: \"%s\"", strerror(errno));
+      return -1;
+   }
+   reload_->listen = addr;
+   if ((addr[reload_->listen_cnt] = malloc(sizeof(saddr))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not get memory for listener: \"%s\"", strerror(errno));
+      return -1;
+   }
+   memcpy(addr[reload_->listen_cnt++], &saddr, sizeof(saddr));
+   return 1;
+}
+
+
+int config_cmd_socks(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   struct sockaddr_in6 saddr;
+
+   lock_setup();
+   memcpy(&saddr, CNF(socks_dst6), sizeof(saddr));
+   unlock_setup();
+
+   if (!strcasecmp(argv[1], "none"))
+      saddr.sin6_family = 0;
+   else if (strsockaddr(argv[1], (struct sockaddr*) &saddr) == -1)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "could not convert address string \"%s\"", argv[1]);
+      return -1;
+   }
+
+   if (reload_ == NULL)
+   {
+      memcpy(CNF(socks_dst6), &saddr, sizeof(saddr));
+      return 1;
+   }
+
+   memcpy(&reload_->socks_dst, &saddr, sizeof(saddr));
+   reload_->socks_set = 1;
+   return 1;
+}
+
+
+/*! Add a route to the routing table or to the new routing table if the config
+ * file is reloaded.
+ */
+int config_cmd_route(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   IPv4Route_t route4;
+   IPv6Route_t route6, *rt;
+   int c, i;
+
+   // any route statement makes the reload replace the routing tables
+   if (reload_ != NULL)
+      reload_->route_set = 1;
+
+   if (reload_ == NULL)
+   {
+      if ((c = ipv4_add_route_a(argv[1], argv[2], argv[3])) == E_RT_SYNTAX)
+         if ((c = ipv6_add_route_a(argv[1], argv[2], argv[3])) > 0)
+            c = 0;
+   }
+   else if ((c = ipv4_parse_route(argv[1], argv[2], argv[3], &route4)) != E_RT_SYNTAX)
+   {
+      if (!c)
+         c = ipv4_add_route(&route4, &reload_->route4, 0);
+   }
+   else if (!(c = ipv6_parse_route(argv[1], argv[2], argv[3], &route6)))
+   {
+      for (i = 0; i < reload_->route6_cnt; i++)
+         if (IN6_ARE_ADDR_EQUAL(&reload_->route6[i].dest, &route6.dest) && reload_->route6[i].prefixlen == route6.prefixlen)
+            break;
+
+      if (i < reload_->route6_cnt)
+         c = E_RT_DUP;
+      else if ((rt = realloc(reload_->route6, sizeof(*rt) * (reload_->route6_cnt + 1))) == NULL)
+         c = E_RT_NOMEM;
+      else
+      {
+         reload_->route6 = rt;
+         memcpy(&rt[reload_->route6_cnt++], &route6, sizeof(route6));
+      }
+   }
+
+   if (c < 0)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "route %s %s %s: %d %s", argv[1], argv[2], argv[3], c, route_err_str(c));
+      return -1;
+   }
+   return 1;
+}
+
+
+/*! Convert a numeric argument of a config statement.
+ * @param fdb Pointer to fdbuf of config file.
+ * @param s String to convert.
+ * @param min Minimum value.
+ * @param max Maximum value.
+ * @return The value or -1 if s is not a number within min and max.
+ */
+static int config_num(fdbuf_t *fdb, const char *s, int min, int max)
+{
+   char *end;
+   long n;
+
+   errno = 0;
+   n = strtol(s, &end, 10);
+   if (errno || end == s || *end != '\0' || n < min || n > max)
+   {
+      log_msg_fd(fdb->fd, LOG_ERR, "value \"%s\" out of range %d - %d", s, min, max);
+      return -1;
+   }
+   return n;
+}
+
+
+/*! Set the expiry time of hosts entries. It is ignored if it was set with
+ * option -E.
+ */
+int config_cmd_expire(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   int n;
+
+   if ((n = config_num(fdb, argv[1], 0, INT_MAX)) == -1)
+      return -1;
+
+   lock_setup();
+   if (!CNF(expire_opt))
+      CNF(expire) = n;
+   unlock_setup();
+   return 1;
+}
+
+
+int config_cmd_max_ctrl(fdbuf_t *fdb, int UNUSED(argc), char **argv)
+{
+   int n;
+
+   if ((n = config_num(fdb, argv[1], 1, MAX_CTRL_SESS)) == -1)
+      return -1;
+
+   lock_setup();
+   CNF(max_ctrl) = n;
+   unlock_setup();
+   return 1;
+}
+
+
 static ctrl_cmd_t config_cmd_[] =
 {
    {"connect", config_cmd_connect, 1},
+   {"affinity", config_cmd_affinity, 3},
+   {"listen", config_cmd_listen, 2},
+   {"socks", config_cmd_socks, 2},
+   {"route", config_cmd_route, 4},
+   {"expire", config_cmd_expire, 2},
+   {"max_ctrl", config_cmd_max_ctrl, 2},
+   {"memlimit", ctrl_cmd_memlimit, 3},
 
    {NULL, NULL, 0}
 };
@@ -713,6 +1030,62 @@ void parse_config(int fd)
 }
 
 
+/*! Reread the config file and apply the changes without restarting. The
+ * listeners are replaced if the config file contains "listen" statements. The
+ * routing tables are replaced if it contains "route" statements, otherwise
+ * the routes which were added by the controller are kept. A
+ * changed SOCKS server applies to new connections only, existing peers are
+ * not touched.
+ * @return 0 on success, -1 if the config file could not be opened.
+ */
+int reload_config(void)
+{
+   config_reload_t cr;
+   int fd, changed;
+
+   pthread_mutex_lock(&reload_mutex_);
+   if ((fd = open(CNF(config_file), O_RDONLY)) == -1)
+   {
+      log_msg(LOG_ERR, "could not open config file \"%s\": \"%s\"", CNF(config_file), strerror(errno));
+      pthread_mutex_unlock(&reload_mutex_);
+      return -1;
+   }
+
+   log_msg(LOG_NOTICE, "reloading config file \"%s\"", CNF(config_file));
+   memset(&cr, 0, sizeof(cr));
+   reload_ = &cr;
+   parse_config(fd);
+   reload_ = NULL;
+
+   if (cr.listen != NULL)
+   {
+      log_msg(LOG_INFO, "updating %d listener(s)", cr.listen_cnt);
+      update_listeners(cr.listen, cr.listen_cnt);
+   }
+
+   if (cr.socks_set)
+   {
+      lock_setup();
+      if ((changed = memcmp(CNF(socks_dst6), &cr.socks_dst, sizeof(cr.socks_dst))))
+         memcpy(CNF(socks_dst6), &cr.socks_dst, sizeof(cr.socks_dst));
+      unlock_setup();
+      if (changed)
+         log_msg(LOG_NOTICE, "SOCKS server changed, used for new connections");
+   }
+
+   if (cr.route_set)
+   {
+      log_msg(LOG_INFO, "replacing routing tables");
+      ipv4_replace_routes(cr.route4);
+      (void) ipv6_replace_routes(cr.route6, cr.route6_cnt);
+   }
+   pthread_mutex_unlock(&reload_mutex_);
+
+   log_msg(LOG_NOTICE, "config reloaded");
+   return 0;
+}
+
+
 int run_ctrl_handler(int fd)
 {
    // check number of controller sessions
@@ -735,7 +1108,7 @@ int run_ctrl_handler(int fd)
 
 void *ocat_controller(void *UNUSED(p))
 {
-   if (run_listeners(CNF(ctrl_listen), CNF(ctrl_listen_fd), CNF(ctrl_listen_cnt), run_ctrl_handler) == -1)
+   if (run_listeners(CNF(ctrl_listen), CNF(ctrl_listen_fd), CNF(ctrl_listen_cnt), run_ctrl_handler, NULL) == -1)
       log_msg(LOG_WARNING, "could not start controller");
    return NULL;
 }
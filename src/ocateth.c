@@ -51,7 +51,7 @@ void print_mac_tbl(int fd)
    char buf[INET6_ADDRSTRLEN];
 
    //fprintf(f, "  # age MAC               C   address\n");
-   pthread_mutex_lock(&mac_mutex_);
+   oc_mutex_lock(&mac_mutex_, LOCK_MAC);
 
    for (i = 0; i < mac_cnt_; i++)
    {
@@ -61,7 +61,7 @@ void print_mac_tbl(int fd)
       dprintf(fd, "%s\n", buf);
    }
 
-   pthread_mutex_unlock(&mac_mutex_);
+   oc_mutex_unlock(&mac_mutex_, LOCK_MAC);
 }
 
 
@@ -74,7 +74,7 @@ void mac_cleanup(void)
    char hw[20];
 #endif
 
-   pthread_mutex_lock(&mac_mutex_);
+   oc_mutex_lock(&mac_mutex_, LOCK_MAC);
 
    for (i = 0; i < mac_cnt_; i++)
       if (mac_tbl_[i].age + MAX_MAC_AGE < time(NULL))
@@ -85,7 +85,7 @@ void mac_cleanup(void)
          i--;
       }
 
-   pthread_mutex_unlock(&mac_mutex_);
+   oc_mutex_unlock(&mac_mutex_, LOCK_MAC);
 }
 
 
@@ -98,7 +98,7 @@ int mac_set(const struct in6_addr *in6, uint8_t *hwaddr)
 {
    int i;
 
-   pthread_mutex_lock(&mac_mutex_);
+   oc_mutex_lock(&mac_mutex_, LOCK_MAC);
 
    for (i = mac_cnt_ - 1; i >= 0; i--)
       if (IN6_ARE_ADDR_EQUAL(in6, &mac_tbl_[i].in6addr))
@@ -114,7 +114,7 @@ int mac_set(const struct in6_addr *in6, uint8_t *hwaddr)
          break;
       }
 
-   pthread_mutex_unlock(&mac_mutex_);
+   oc_mutex_unlock(&mac_mutex_, LOCK_MAC);
 
    return i;
 }
@@ -136,7 +136,7 @@ int mac_add_entry(const uint8_t *hwaddr, struct in6_addr in6)
 {
    int e = -1;
 
-   pthread_mutex_lock(&mac_mutex_);
+   oc_mutex_lock(&mac_mutex_, LOCK_MAC);
 
    if (mac_cnt_ < MAX_MAC_ENTRY)
    {
@@ -148,7 +148,7 @@ int mac_add_entry(const uint8_t *hwaddr, struct in6_addr in6)
       e = mac_cnt_++;
    }
 
-   pthread_mutex_unlock(&mac_mutex_);
+   oc_mutex_unlock(&mac_mutex_, LOCK_MAC);
 
    return e;
 }
@@ -164,7 +164,7 @@ int mac_get_ip(const uint8_t *hwaddr, struct in6_addr *in6)
 {
    int i;
 
-   pthread_mutex_lock(&mac_mutex_);
+   oc_mutex_lock(&mac_mutex_, LOCK_MAC);
 
    for (i = mac_cnt_ - 1; i >= 0; i--)
       if (!memcmp(hwaddr, &mac_tbl_[i].hwaddr, ETHER_ADDR_LEN))
@@ -175,7 +175,7 @@ int mac_get_ip(const uint8_t *hwaddr, struct in6_addr *in6)
          break;
       }
 
-   pthread_mutex_unlock(&mac_mutex_);
+   oc_mutex_unlock(&mac_mutex_, LOCK_MAC);
 
    return i;
 }
@@ -298,7 +298,7 @@ int ndp_solicit(const struct in6_addr *src, const struct in6_addr *dst)
    win_write_tun(buf + 4, sizeof(buf) - 4);
 #else
    log_debug("writing %d bytes ndp solicitation to tunfd %d", (int) sizeof(buf), CNF(tunfd[1]));
-   if (write(CNF(tunfd[1]), buf, sizeof(buf)) < (int) sizeof(buf))
+   if (tun_write(CNF(tunfd[1]), buf + BUF_OFF, sizeof(buf) - BUF_OFF) < (int) sizeof(buf) - BUF_OFF)
       log_msg(LOG_ERR, "short write to tun fd %d", CNF(tunfd[1]));
 #endif
 
@@ -422,7 +422,7 @@ int ndp_soladv(char *buf, int rlen)
    win_write_tun(buf + 4, rlen - 4);
 #else
    log_debug("writing %d bytes to tunfd %d", rlen, CNF(tunfd[1]));
-   if (write(CNF(tunfd[1]), buf, rlen) < rlen)
+   if (tun_write(CNF(tunfd[1]), buf + BUF_OFF, rlen - BUF_OFF) < rlen - BUF_OFF)
       log_msg(LOG_ERR, "short write");
 #endif
 
@@ -0,0 +1,358 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatflow.c
+ *  This file contains the per-flow accounting. If enabled with option -W
+ *  every packet which is forwarded from the tunnel device to a peer or
+ *  received from a peer is accounted to its flow which is identified by the
+ *  5-tuple (addresses, protocol, ports) and the direction.
+ *  The flows are kept in a fixed-size open-addressing hash table with one
+ *  cache line per entry. If all slots within the probe window of a flow are
+ *  in use, the least recently seen of them is evicted.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/06/23
+ */
+
+
+#include "ocat.h"
+
+
+#define FLOW_CACHE_LINE 64
+//! length of IPv4 header without options
+#define FLOW_IP4HLEN 20
+//! number of consecutive slots searched for a flow
+#define FLOW_PROBE 8
+//! number of flows shown by default by print_flows()
+#define FLOW_TOP_DEF 10
+//! max. number of flows shown by print_flows()
+#define FLOW_TOP_MAX 1024
+
+
+//! key of a flow, the addresses of IPv4 flows are stored v4-mapped
+typedef struct OcatFlowKey
+{
+   struct in6_addr src;
+   struct in6_addr dst;
+   uint16_t sport;
+   uint16_t dport;
+   uint8_t proto;
+   uint8_t ver;            //!< IP version (4 or 6)
+   uint8_t dir;            //!< FLOW_IN or FLOW_OUT
+   uint8_t pad;
+} OcatFlowKey_t;
+
+
+//! accounting data of a flow, it fits exactly into a cache line
+typedef struct OcatFlow
+{
+   OcatFlowKey_t key;
+   uint64_t bytes;
+   uint32_t pkts;          //!< number of packets, 0 means slot is free
+   uint32_t first;         //!< time of first packet
+   uint32_t last;          //!< time of last packet
+   uint32_t pad;
+} OcatFlow_t;
+
+
+static OcatFlow_t *flow_ = NULL;
+static unsigned flow_mask_;
+//! number of flows evicted from the table
+static unsigned long flow_evict_ = 0;
+static pthread_mutex_t flow_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*! Allocate the flow table. The number of slots CNF(flow_slots) is rounded
+ * up to the next power of 2.
+ * @return 0 on success, -1 on error.
+ */
+int flow_init(void)
+{
+   unsigned n;
+   void *p;
+   int e;
+
+   if (sizeof(OcatFlow_t) != FLOW_CACHE_LINE)
+      log_msg(LOG_WARNING, "size of flow entry (%d) does not match cache line", (int) sizeof(OcatFlow_t));
+
+   for (n = FLOW_PROBE; n < (unsigned) CNF(flow_slots); n <<= 1);
+
+   if (mem_charge(MEM_FLOWS, n * sizeof(OcatFlow_t)) == -1)
+   {
+      log_msg(LOG_ERR, "memory limit reached, flow accounting disabled");
+      return -1;
+   }
+   if ((e = posix_memalign(&p, FLOW_CACHE_LINE, n * sizeof(OcatFlow_t))))
+   {
+      log_msg(LOG_ERR, "could not get memory for flow table: \"%s\"", strerror(e));
+      mem_release(MEM_FLOWS, n * sizeof(OcatFlow_t));
+      return -1;
+   }
+
+   memset(p, 0, n * sizeof(OcatFlow_t));
+   flow_mask_ = n - 1;
+   flow_ = p;
+   log_msg(LOG_INFO, "flow accounting enabled with %u slots", n);
+   return 0;
+}
+
+
+/*! FNV-1a hash of a flow key.
+ */
+static unsigned flow_hash(const OcatFlowKey_t *key)
+{
+   const uint8_t *s = (const uint8_t*) key;
+   uint32_t h = 2166136261U;
+   unsigned i;
+
+   for (i = 0; i < sizeof(*key); i++)
+      h = (h ^ s[i]) * 16777619U;
+   return h;
+}
+
+
+/*! Fill flow key from an IP packet.
+ * @return 0 on success, -1 if the packet could not be parsed.
+ */
+static int flow_key(OcatFlowKey_t *key, const char *buf, int len)
+{
+   const uint8_t *p = (const uint8_t*) buf;
+   int hlen;
+
+   memset(key, 0, sizeof(*key));
+   if (len < 1)
+      return -1;
+
+   key->ver = p[0] >> 4;
+   if (key->ver == 6)
+   {
+      if (len < (int) IP6HLEN)
+         return -1;
+      key->proto = p[offsetof(struct ip6_hdr, ip6_nxt)];
+      memcpy(&key->src, p + offsetof(struct ip6_hdr, ip6_src), sizeof(key->src));
+      memcpy(&key->dst, p + offsetof(struct ip6_hdr, ip6_dst), sizeof(key->dst));
+      hlen = IP6HLEN;
+   }
+   else if (key->ver == 4)
+   {
+      if (len < FLOW_IP4HLEN || (hlen = (p[0] & 0xf) * 4) < FLOW_IP4HLEN)
+         return -1;
+      key->proto = p[9];
+      key->src.s6_addr[10] = key->src.s6_addr[11] = 0xff;
+      memcpy(&key->src.s6_addr[12], p + 12, 4);
+      key->dst.s6_addr[10] = key->dst.s6_addr[11] = 0xff;
+      memcpy(&key->dst.s6_addr[12], p + 16, 4);
+      // ports are only in the first fragment
+      if ((p[6] & 0x1f) || p[7])
+         return 0;
+   }
+   else
+      return -1;
+
+   if ((key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) && len >= hlen + 4)
+   {
+      key->sport = (p[hlen] << 8) | p[hlen + 1];
+      key->dport = (p[hlen + 2] << 8) | p[hlen + 3];
+   }
+   return 0;
+}
+
+
+/*! Account a packet to its flow. This function does nothing if flow
+ * accounting is disabled.
+ * @param buf Pointer to IP packet (without tunnel header).
+ * @param len Length of packet.
+ * @param dir Direction of packet, FLOW_IN or FLOW_OUT.
+ */
+void flow_account(const char *buf, int len, int dir)
+{
+   OcatFlowKey_t key;
+   OcatFlow_t *f, *victim = NULL;
+   uint32_t now;
+   unsigned h, i;
+
+   if (flow_ == NULL || flow_key(&key, buf, len) == -1)
+      return;
+
+   key.dir = dir;
+   now = time(NULL);
+   h = flow_hash(&key);
+
+   oc_mutex_lock(&flow_mutex_, LOCK_FLOWS);
+   for (i = 0; i < FLOW_PROBE; i++)
+   {
+      f = &flow_[(h + i) & flow_mask_];
+      if (!f->pkts)
+      {
+         victim = f;
+         break;
+      }
+      if (!memcmp(&f->key, &key, sizeof(key)))
+      {
+         f->pkts++;
+         f->bytes += len;
+         f->last = now;
+         oc_mutex_unlock(&flow_mutex_, LOCK_FLOWS);
+         return;
+      }
+      if (victim == NULL || f->last < victim->last)
+         victim = f;
+   }
+
+   if (victim->pkts)
+      flow_evict_++;
+   victim->key = key;
+   victim->pkts = 1;
+   victim->bytes = len;
+   victim->first = victim->last = now;
+   oc_mutex_unlock(&flow_mutex_, LOCK_FLOWS);
+}
+
+
+/*! Clear the flow table. */
+void flow_reset(void)
+{
+   if (flow_ == NULL)
+      return;
+
+   oc_mutex_lock(&flow_mutex_, LOCK_FLOWS);
+   memset(flow_, 0, (flow_mask_ + 1) * sizeof(*flow_));
+   flow_evict_ = 0;
+   oc_mutex_unlock(&flow_mutex_, LOCK_FLOWS);
+}
+
+
+static int flow_cmp(const void *a, const void *b)
+{
+   const OcatFlow_t *fa = a, *fb = b;
+
+   return fa->bytes < fb->bytes ? 1 : fa->bytes > fb->bytes ? -1 : 0;
+}
+
+
+/*! Move the flow at index i of a min-heap (ordered by bytes) down to its
+ * position.
+ * @param heap Pointer to heap.
+ * @param cnt Number of flows in the heap.
+ * @param i Index of flow.
+ */
+static void flow_heap_down(OcatFlow_t *heap, int cnt, int i)
+{
+   OcatFlow_t t;
+   int c;
+
+   for (; (c = 2 * i + 1) < cnt; i = c)
+   {
+      if (c + 1 < cnt && heap[c + 1].bytes < heap[c].bytes)
+         c++;
+      if (heap[i].bytes <= heap[c].bytes)
+         break;
+      t = heap[i];
+      heap[i] = heap[c];
+      heap[c] = t;
+   }
+}
+
+
+static const char *flow_addr(const OcatFlowKey_t *key, const struct in6_addr *addr, char *buf, int len)
+{
+   if (key->ver == 4)
+      return inet_ntop(AF_INET, &addr->s6_addr[12], buf, len);
+   return inet_ntop(AF_INET6, addr, buf, len);
+}
+
+
+/*! Output the flows with the most bytes. The top flows are collected in a
+ * min-heap of n entries while the table is scanned, thus the memory used is
+ * bounded by FLOW_TOP_MAX entries and it is charged to MEM_FLOWS.
+ * @param fd File descriptor to write to.
+ * @param n Max. number of flows to show. If n <= 0, FLOW_TOP_DEF flows are
+ * shown, at most FLOW_TOP_MAX.
+ */
+void print_flows(int fd, int n)
+{
+   char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+   OcatFlow_t *cp, *f;
+   unsigned long evict;
+   int i, j, cnt, used;
+   time_t now;
+
+   if (flow_ == NULL)
+   {
+      dprintf(fd, "flow accounting not enabled, see option -W\n");
+      return;
+   }
+
+   if (n <= 0)
+      n = FLOW_TOP_DEF;
+   if (n > FLOW_TOP_MAX)
+      n = FLOW_TOP_MAX;
+
+   if (mem_charge(MEM_FLOWS, n * sizeof(*cp)) == -1)
+   {
+      dprintf(fd, "memory limit reached\n");
+      return;
+   }
+   if ((cp = malloc(n * sizeof(*cp))) == NULL)
+   {
+      log_msg(LOG_ERR, "malloc failed: %s", strerror(errno));
+      mem_release(MEM_FLOWS, n * sizeof(*cp));
+      return;
+   }
+
+   // take a snapshot of the top flows to sort them without holding the lock
+   oc_mutex_lock(&flow_mutex_, LOCK_FLOWS);
+   for (i = 0, cnt = 0, used = 0, f = flow_; i <= (int) flow_mask_; i++, f++)
+   {
+      if (!f->pkts)
+         continue;
+      used++;
+      if (cnt < n)
+      {
+         cp[cnt++] = *f;
+         // turn snapshot into heap as soon as it is full
+         if (cnt == n)
+            for (j = n / 2 - 1; j >= 0; j--)
+               flow_heap_down(cp, cnt, j);
+      }
+      else if (f->bytes > cp[0].bytes)
+      {
+         cp[0] = *f;
+         flow_heap_down(cp, cnt, 0);
+      }
+   }
+   evict = flow_evict_;
+   oc_mutex_unlock(&flow_mutex_, LOCK_FLOWS);
+
+   qsort(cp, cnt, sizeof(*cp), flow_cmp);
+
+   now = time(NULL);
+   dprintf(fd, "%d of %u slots used, %lu evicted\n", used, flow_mask_ + 1, evict);
+   dprintf(fd, "dir proto %39s %5s %39s %5s %10s %12s %6s %6s\n",
+         "source", "sport", "destination", "dport", "packets", "bytes", "first", "last");
+   for (i = 0, f = cp; i < cnt; i++, f++)
+      dprintf(fd, "%-3s %5d %39s %5d %39s %5d %10u %12llu %6ld %6ld\n",
+            f->key.dir == FLOW_IN ? "in" : "out", f->key.proto,
+            flow_addr(&f->key, &f->key.src, src, sizeof(src)), f->key.sport,
+            flow_addr(&f->key, &f->key.dst, dst, sizeof(dst)), f->key.dport,
+            f->pkts, (unsigned long long) f->bytes,
+            (long) (now - f->first), (long) (now - f->last));
+
+   free(cp);
+   mem_release(MEM_FLOWS, n * sizeof(*cp));
+}
+
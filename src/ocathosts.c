@@ -71,11 +71,14 @@ static struct hosts_info hosts_ = {{0, 0}, -1, NULL, 0, ""};
 static char *path_hosts_ = NULL;
 static pthread_mutex_t hosts_mutex_ = PTHREAD_MUTEX_INITIALIZER;
 static int hosts_db_modified_ = 0;
+//! serial number of the hosts db, it is increased on every change
+static uint32_t hosts_serial_ = 0;
 static ns_ent_t ns_[MAX_NS];
 static pthread_mutex_t ns_mutex_ = PTHREAD_MUTEX_INITIALIZER;
 
 
 int hosts_add_entry_unlocked(const struct in6_addr *addr, const char *name, hsrc_t source, time_t age, int ttl);
+static int hosts_add_entry0(const struct in6_addr *addr, const char *name, hsrc_t source, time_t age, int ttl, int share);
 
 
 /*! Set path to hosts file.
@@ -136,7 +139,7 @@ void hosts_cleanup(void)
 {
    int i;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    for (i = 0; i < hosts_.hosts_ent_cnt; i++)
    {
       // ignore hosts with ttl not expired
@@ -151,12 +154,13 @@ void hosts_cleanup(void)
 
       // dec length of list
       hosts_.hosts_ent_cnt--;
+      mem_release(MEM_HOSTS, sizeof(*hosts_.hosts_ent));
       // mark db as modified
-      hosts_db_modified_ = 1;
+      hosts_db_modified_ |= HOSTS_MOD_DATA;
       // restart again on same position (undo i++ of for loop)
       i--;
    }
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 }
 
 
@@ -171,24 +175,21 @@ void hosts_cleanup(void)
  */
 int hosts_read(time_t age, const char *phosts)
 {
-   int e, n, o = 0, c, src, ttl;
+   int n, o = 0, c, src, ttl;
    char buf[HOSTS_LINE_LENGTH + 1], *s, *nptr, *rem, *host;
-   struct addrinfo hints, *res;
+   struct in6_addr addr;
    fdbuf_t fdb;
 
    log_msg(LOG_INFO, "reading hosts file %s", phosts);
    if (fd_open(&fdb, phosts, O_RDONLY) == -1)
       return -1;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    // expire all hosts file entries in memory DB
    for (n = 0; n < hosts_.hosts_ent_cnt; n++)
       if (hosts_.hosts_ent[n].source == HSRC_HOSTS)
          hosts_.hosts_ent[n].ttl = 0;
 
-   memset(&hints, 0, sizeof(hints));
-   hints.ai_family = AF_INET6;
-   hints.ai_flags = AI_NUMERICHOST;
    while (fd_gets(&fdb, buf, sizeof(buf)) > 0)
    {
       // skip leading spaces
@@ -208,18 +209,11 @@ int hosts_read(time_t age, const char *phosts)
       if ((s = strtok_r(s, " \t\r\n", &nptr)) == NULL)
          continue;
 
-      if ((e = getaddrinfo(s, NULL, &hints, &res)) != 0)
+      // numeric IPv6 addresses only, inet_pton(3) is much cheaper than
+      // getaddrinfo(3) for large files
+      if (inet_pton(AF_INET6, s, &addr) != 1)
       {
-         log_debug("getaddrinfo(\"%s\"...) failed: \"%s\"", s, gai_strerror(e));
-         continue;
-      }
-
-      // to be on the safe side check address family
-      if (res->ai_family != AF_INET6)
-      {
-         // this should never happen
-         log_debug("ai_family = %d (!= AF_INET6)", res->ai_family);
-         freeaddrinfo(res);
+         log_debug("\"%s\" is not an IPv6 address", s);
          continue;
       }
 
@@ -231,7 +225,6 @@ int hosts_read(time_t age, const char *phosts)
          {
             o++;
             host = s;
-            //hosts_add_entry_unlocked(&((struct sockaddr_in6*) res->ai_addr)->sin6_addr, s, HSRC_HOSTS, age, -1);
             break;
          }
       }
@@ -277,13 +270,11 @@ int hosts_read(time_t age, const char *phosts)
          else if (age + ttl - time(NULL) <= HOSTS_EXP_REFRESH)
             ttl = time(NULL) - age + HOSTS_EXP_REFRESH;
 
-         hosts_add_entry_unlocked(&((struct sockaddr_in6*) res->ai_addr)->sin6_addr, host, src, age, ttl);
+         hosts_add_entry_unlocked(&addr, host, src, age, ttl);
       }
-
-      freeaddrinfo(res);
    }
 
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
    oe_close(fdb.fd);
 
    hosts_cleanup();
@@ -391,6 +382,37 @@ int hosts_get_name_unlocked(const struct in6_addr *addr, char *buf, int s)
 }
 
 
+/*! Import an entry from the shared hosts table (see ocatshm.c) into the
+ * local hosts db. The hosts db must be locked. Any local process may write to
+ * the shared table, thus the entry is imported as HSRC_NET after the name was
+ * validated. It is not written back to the shared table.
+ * Lookups by name are not done in the shared table because the address of
+ * a valid name is calculated from the name anyway.
+ * @param addr Pointer to IPv6 address.
+ * @return Returns the index in the local db or -1 if there is no such entry
+ * in the shared table.
+ */
+static int hosts_shm_import_unlocked(const struct in6_addr *addr)
+{
+   char buf[SIZE_256];
+   struct in6_addr taddr;
+   int source, ttl;
+   time_t age;
+
+   if (shm_hosts_get(addr, buf, sizeof(buf), &source, &age, &ttl) == -1)
+      return -1;
+
+   if (validate_onionname(buf, &taddr) == -1 || !IN6_ARE_ADDR_EQUAL(addr, &taddr))
+   {
+      log_msg(LOG_WARNING, "invalid entry \"%s\" in shared hosts table", buf);
+      return -1;
+   }
+
+   log_debug("importing \"%s\" from shared hosts table", buf);
+   return hosts_add_entry0(addr, buf, HSRC_NET, age, ttl, 0);
+}
+
+
 /*! Return name for IPv6 address.
  *  @return On success it returns a value >= 0. If not found, -1 is returned.
  **/
@@ -398,15 +420,17 @@ int hosts_get_name_ext(const struct in6_addr *addr, char *buf, int s, int *sourc
 {
    int i;
 
-   pthread_mutex_lock(&hosts_mutex_);
-   if ((i = hosts_get_name_unlocked(addr, buf, s)) != -1)
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
+   if ((i = hosts_get_name_unlocked(addr, buf, s)) == -1 && (i = hosts_shm_import_unlocked(addr)) != -1 && buf != NULL)
+      strlcpy(buf, hosts_.hosts_ent[i].name, s);
+   if (i != -1)
    {
       if (source != NULL)
          *source = hosts_.hosts_ent[i].source;
       if (age != NULL)
          *age = hosts_.hosts_ent[i].age;
    }
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 
    return i;
 }
@@ -418,6 +442,34 @@ int hosts_get_name(const struct in6_addr *addr, char *buf, int s)
 }
 
 
+/*! Return the address of a hostname. Expired entries are ignored.
+ * @param name Pointer to hostname. It is compared case-insensitively.
+ * @param addr Pointer to variable which receives the address.
+ * @param ttl If not NULL, the remaining TTL of the entry is stored here. It is
+ * -1 if the entry does not expire.
+ * @return On success it returns a value >= 0. If not found, -1 is returned.
+ */
+int hosts_get_addr_by_name(const char *name, struct in6_addr *addr, int *ttl)
+{
+   struct hosts_ent *h;
+   int i, n = -1;
+
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
+   for (i = 0, h = hosts_.hosts_ent; i < hosts_.hosts_ent_cnt; i++, h++)
+      if (!strcasecmp(name, h->name) && hosts_ttl(h))
+      {
+         IN6_ADDR_COPY(addr, &h->addr);
+         if (ttl != NULL)
+            *ttl = hosts_ttl(h);
+         n = i;
+         break;
+      }
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
+
+   return n;
+}
+
+
 /*! Search for slot with lower metric than m.
  * @return Returns index of an empty slot which is 0 <= index < MAX_NS. If not
  * empty slot was found, MAX_NS is returned.
@@ -486,7 +538,7 @@ static int hosts_update_ns0(void)
    memset(mod, 0, sizeof(mod));
    j = -1;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    for (i = 0; i < hosts_.hosts_ent_cnt; i++)
    {
       // ignore self and empty entries
@@ -540,7 +592,7 @@ static int hosts_update_ns0(void)
    qsort(ns_, MAX_NS, sizeof(ns_[0]), cmp_ns);
    pthread_mutex_unlock(&ns_mutex_);
 
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 
    return 0;
 }
@@ -615,6 +667,7 @@ static void hosts_copy_data(struct hosts_ent *h, const char *name, int source, t
    h->source = source;
    h->age = age;
    h->ttl = ttl;
+   h->serial = ++hosts_serial_;
    if (strcmp(h->name, name))
    {
       strlcpy(h->name, name, NI_MAXHOST);
@@ -653,6 +706,18 @@ int hosts_ttl_delay(const struct in6_addr *addr)
  * @return Returns the index in the database or -1 on error.
  */
 int hosts_add_entry_unlocked(const struct in6_addr *addr, const char *name, hsrc_t source, time_t age, int ttl)
+{
+   return hosts_add_entry0(addr, name, source, age, ttl, 1);
+}
+
+
+/*! This is the implementation of hosts_add_entry_unlocked().
+ * @param share If 0 the entry is not written to the shared hosts table and no
+ * random delay is added to the TTL. This is used for entries which are
+ * imported from the shared table. Only entries which were learned from the
+ * network and which expire are shared anyway.
+ */
+static int hosts_add_entry0(const struct in6_addr *addr, const char *name, hsrc_t source, time_t age, int ttl, int share)
 {
    struct in6_addr taddr;
    struct hosts_ent *h;
@@ -670,16 +735,26 @@ int hosts_add_entry_unlocked(const struct in6_addr *addr, const char *name, hsrc
    }
 
    // add random delay
-   if (ttl > 0)
+   if (ttl > 0 && share)
       ttl += hosts_ttl_delay(addr);
 
+   // entries of the hosts file or the command line would never expire in
+   // the shared table
+   share = share && source >= HSRC_KPLV && ttl >= 0;
+
    // check if entry already exists
    if ((n = hosts_get_name_unlocked(addr, NULL, 0)) == -1)
    {
       // create new entry if there is no entry yet
+      if (mem_charge(MEM_HOSTS, sizeof(*h)) == -1)
+      {
+         log_msg(LOG_WARNING, "memory limit reached, hosts entry not added");
+         return -1;
+      }
       if ((h = realloc(hosts_.hosts_ent, (hosts_.hosts_ent_cnt + 1) * sizeof(*h))) == NULL)
       {
          log_msg(LOG_ERR, "realloc failed: %s", strerror(errno));
+         mem_release(MEM_HOSTS, sizeof(*h));
          return -1;
       }
 
@@ -698,14 +773,28 @@ int hosts_add_entry_unlocked(const struct in6_addr *addr, const char *name, hsrc
       // copy data to new entry
       hosts_copy_data(&hosts_.hosts_ent[n], name, source, age, ttl);
       // mark db as modified
-      hosts_db_modified_ = 1;
+      hosts_db_modified_ |= HOSTS_MOD_DATA;
+      if (share)
+         shm_hosts_put(addr, name, source, age, ttl);
+   }
+   else if (hosts_.hosts_ent[n].source == source && !strcmp(hosts_.hosts_ent[n].name, name))
+   {
+      // same data again (e.g. keepalive), just refresh the timestamp
+      hosts_.hosts_ent[n].age = age;
+      hosts_.hosts_ent[n].ttl = ttl;
+      hosts_.hosts_ent[n].serial = ++hosts_serial_;
+      hosts_db_modified_ |= HOSTS_MOD_AGE;
+      if (share)
+         shm_hosts_put(addr, name, source, age, ttl);
    }
    else if (hosts_.hosts_ent[n].source >= source)
    {
       log_debug("overwriting old.source = %d, new.source = %d", hosts_.hosts_ent[n].source, source);
       hosts_copy_data(&hosts_.hosts_ent[n], name, source, age, ttl);
       // mark db as modified
-      hosts_db_modified_ = 1;
+      hosts_db_modified_ |= HOSTS_MOD_DATA;
+      if (share)
+         shm_hosts_put(addr, name, source, age, ttl);
    }
    else
    {
@@ -749,10 +838,10 @@ void host_stats_inc_q(const struct in6_addr *addr)
 {
    int i;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    if ((i = hosts_get_name_unlocked(addr, NULL, 0)) != -1)
       hosts_.hosts_ent[i].stat.q_cnt++;
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 }
 
 
@@ -762,7 +851,7 @@ void host_stats_inc_ans(const struct in6_addr *addr, int code)
 {
    int i;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    if ((i = hosts_get_name_unlocked(addr, NULL, 0)) != -1)
    {
       switch (code)
@@ -775,7 +864,7 @@ void host_stats_inc_ans(const struct in6_addr *addr, int code)
             break;
       }
    }
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 }
 
 
@@ -792,9 +881,9 @@ int hosts_add_entry(const struct in6_addr *addr, const char *name, hsrc_t source
 {
    int n;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    n = hosts_add_entry_unlocked(addr, name, source, age, ttl);
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
    return n;
 }
 
@@ -865,7 +954,7 @@ void hosts_refresh(void)
 {
    int i;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    for (i = 0; i < hosts_.hosts_ent_cnt; i++)
       if (hosts_.hosts_ent[i].source > HSRC_HOSTS)
       {
@@ -881,7 +970,7 @@ void hosts_refresh(void)
             hosts_.hosts_ent[i].ttl = time(NULL) - hosts_.hosts_ent[i].age + HOSTS_KPLV_TTL;
          }
       }
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 }
 
 
@@ -934,7 +1023,7 @@ int sn_hosts_list(char *buf, int len)
    len -= wlen;
    buf += wlen;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    for (i = hosts_.hosts_ent_cnt - 1, h = hosts_.hosts_ent; i >= 0; i--, h++)
    {
       if (inet_ntop(AF_INET6, &h->addr, in6, sizeof(in6)) == NULL)
@@ -962,7 +1051,7 @@ int sn_hosts_list(char *buf, int len)
       buf += plen;
       wlen += plen;
    }
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 
    return wlen;
 }
@@ -972,6 +1061,36 @@ void hosts_init(const char *dom)
 {
    hosts_.hdom = dom;
    memset(ns_, 0, sizeof(ns_));
+   // start with the time to keep serial numbers increasing across restarts
+   hosts_serial_ = time(NULL);
+}
+
+
+/*! Call a function for each valid entry of the hosts db which was changed
+ * after a given serial number. The hosts db is locked during the calls, thus
+ * func must not call any other hosts function.
+ * @param serial Serial number, 0 selects all entries. If it is newer than the
+ * serial of the db (i.e. the db was restarted) all entries are selected as
+ * well.
+ * @param func Function which is called for each entry.
+ * @param p Pointer which is passed to func.
+ * @return Returns the current serial number of the hosts db.
+ */
+uint32_t hosts_foreach_since(uint32_t serial, void (*func)(void *, const host_ent_t *), void *p)
+{
+   uint32_t cur;
+   int i;
+
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
+   cur = hosts_serial_;
+   if (serial > cur)
+      serial = 0;
+   for (i = 0; i < hosts_.hosts_ent_cnt; i++)
+      if (hosts_.hosts_ent[i].serial > serial && hosts_ttl(&hosts_.hosts_ent[i]))
+         func(p, &hosts_.hosts_ent[i]);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
+
+   return cur;
 }
 
 
@@ -1010,9 +1129,9 @@ int hosts_save(const char *name)
 
    close(fd);
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    hosts_db_modified_ = 0;
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 
    return 0;
 }
@@ -1043,13 +1162,17 @@ int mk_cache_dir(const char *dir, uid_t uid, gid_t gid)
 }
 
 
+/*! Return the modification state of the hosts db.
+ * @return Returns 0 if the db was not modified since it was saved the last
+ * time, otherwise a bitwise or of HOSTS_MOD_AGE and HOSTS_MOD_DATA.
+ */
 int is_hosts_db_modified(void)
 {
    int m;
 
-   pthread_mutex_lock(&hosts_mutex_);
+   oc_mutex_lock(&hosts_mutex_, LOCK_HOSTS);
    m = hosts_db_modified_;
-   pthread_mutex_unlock(&hosts_mutex_);
+   oc_mutex_unlock(&hosts_mutex_, LOCK_HOSTS);
 
    return m;
 }
@@ -43,11 +43,19 @@
 #define HOSTS_KPLV_TTL 7200
 //! minimum timespan before saving hosts file (to prevent too much disk io)
 #define HOSTS_TIME 300
+//! minimum timespan before saving hosts file if only timestamps were refreshed
+#define HOSTS_AGE_TIME 3600
+//! minimum interval between hosts db refreshes by keepalives of a peer
+#define HOSTS_KPLV_REFRESH 600
 //! Seconds before expiry of hosts entry to renew it
 #define HOSTS_EXP_REFRESH 60
 //! Final expiry time of hosts entry (7d)
 #define HOSTS_EXPIRE 604800
 #define MAX_NS 5
+//! hosts db modification flag: only age/ttl of entries was refreshed
+#define HOSTS_MOD_AGE 1
+//! hosts db modification flag: entries were added, changed, or removed
+#define HOSTS_MOD_DATA 2
 #define NS_UPDATE_TIME 5
 
 
@@ -77,6 +85,7 @@ typedef struct hosts_ent
    hsrc_t source;
    int ttl;
    ns_stats_t stat;
+   uint32_t serial;     //!< serial number of the hosts db at last change
 } host_ent_t;
 
 struct hosts_info
@@ -93,6 +102,7 @@ int hosts_read(time_t , const char *);
 int hosts_check(void);
 int hosts_get_name(const struct in6_addr*, char*, int);
 int hosts_get_name_ext(const struct in6_addr *, char *, int, int *, time_t *);
+int hosts_get_addr_by_name(const char *, struct in6_addr *, int *);
 int hosts_get_ns_rr_metric(struct in6_addr *, hsrc_t *, int *);
 int hosts_get_ns_rr(struct in6_addr *, hsrc_t *, int *);
 int hosts_get_ns(struct in6_addr *, hsrc_t *);
@@ -108,10 +118,17 @@ int hosts_save(const char *);
 int mk_cache_dir(const char *, uid_t , gid_t );
 int is_hosts_db_modified(void);
 int hosts_metric(const host_ent_t *);
+int hosts_ttl(const host_ent_t *);
 void host_stats_inc_q(const struct in6_addr *);
 void host_stats_inc_ans(const struct in6_addr *, int );
 int validate_hostname(const char *);
 void print_ns(int );
+/* ocatshm.c */
+int shm_hosts_open(const char *);
+int shm_hosts_put(const struct in6_addr *, const char *, int, time_t, int);
+int shm_hosts_get(const struct in6_addr *, char *, int, int *, time_t *, int *);
+
+uint32_t hosts_foreach_since(uint32_t, void (*)(void *, const host_ent_t *), void *);
 
 
 #endif
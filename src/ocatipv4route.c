@@ -41,9 +41,15 @@ int ipv4_add_route(IPv4Route_t *route, IPv4Route_t **root, uint32_t cur_nm)
 {
    if (!(*root))
    {
+      if (mem_charge(MEM_ROUTE, sizeof(IPv4Route_t)) == -1)
+      {
+         log_msg(LOG_WARNING, "memory limit reached, route not added");
+         return E_RT_NOMEM;
+      }
       if (!(*root = calloc(1, sizeof(IPv4Route_t))))
       {
          log_msg(LOG_EMERG, "ipv4_add_route: %s", strerror(errno));
+         mem_release(MEM_ROUTE, sizeof(IPv4Route_t));
          return E_RT_NOMEM;
       }
       (*root)->dest = route->dest & cur_nm;
@@ -104,16 +110,18 @@ IPv4Route_t *ipv4_lookup_route__(uint32_t ip, IPv4Route_t *route, uint32_t cur_n
 
 /*! Lookup a route to an ip address in routing table.
  *  @param Ip to find a route for. The Ip must be given in host byte order.
- *  @return Pointer to IPv6 TOR address. */
-struct in6_addr *ipv4_lookup_route(uint32_t ip)
+ *  @param gw Pointer to buffer which receives the gateway.
+ *  @return Pointer to IPv6 TOR address (gw) or NULL if there is no route. */
+struct in6_addr *ipv4_lookup_route(uint32_t ip, struct in6_addr *gw)
 {
    IPv4Route_t *r;
 
-   pthread_mutex_lock(&route_mutex_);
-   r = ipv4_lookup_route__(ip, rroot_, 0);
-   pthread_mutex_unlock(&route_mutex_);
+   oc_mutex_lock(&route_mutex_, LOCK_V4ROUTE);
+   if ((r = ipv4_lookup_route__(ip, rroot_, 0)))
+      IN6_ADDR_COPY(gw, &r->gw);
+   oc_mutex_unlock(&route_mutex_, LOCK_V4ROUTE);
 
-   return r ? &r->gw : NULL;
+   return r ? gw : NULL;
 }
 
 
@@ -149,36 +157,85 @@ void ipv4_print(IPv4Route_t *route, void *f)
 
 void print_routes(int fd)
 {
+   oc_mutex_lock(&route_mutex_, LOCK_V4ROUTE);
    ipv4_traverse(rroot_, ipv4_print, (void*)(intptr_t) fd);
+   oc_mutex_unlock(&route_mutex_, LOCK_V4ROUTE);
 }
 
 
-int ipv4_add_route_a(const char *dest, const char *nm, const char *gw)
+/*! Free an IPv4 routing tree.
+ *  @param route Pointer to root of tree, may be NULL.
+ */
+void ipv4_free_routes(IPv4Route_t *route)
 {
-   IPv4Route_t route;
-   int r;
+   if (!route)
+      return;
+
+   ipv4_free_routes(route->next[0]);
+   ipv4_free_routes(route->next[1]);
+   mem_release(MEM_ROUTE, sizeof(*route));
+   free(route);
+}
+
+
+/*! Replace the IPv4 routing table by a new one. The old table is freed.
+ *  @param root Pointer to root of new routing tree, may be NULL.
+ */
+void ipv4_replace_routes(IPv4Route_t *root)
+{
+   IPv4Route_t *old;
 
-   if (inet_pton(AF_INET, dest, &route.dest) != 1)
+   oc_mutex_lock(&route_mutex_, LOCK_V4ROUTE);
+   old = rroot_;
+   rroot_ = root;
+   oc_mutex_unlock(&route_mutex_, LOCK_V4ROUTE);
+
+   ipv4_free_routes(old);
+}
+
+
+/*! Convert route given as strings into IPv4Route_t.
+ *  @param dest Destination network.
+ *  @param nm Netmask.
+ *  @param gw IPv6 address of the gateway.
+ *  @param route Pointer to route structure which will be filled in.
+ *  @return 0 on success or < 0 (E_RT_xxx) on failure.
+ */
+int ipv4_parse_route(const char *dest, const char *nm, const char *gw, IPv4Route_t *route)
+{
+   if (inet_pton(AF_INET, dest, &route->dest) != 1)
       return E_RT_SYNTAX;
 
-   if (inet_pton(AF_INET, nm, &route.netmask) != 1)
+   if (inet_pton(AF_INET, nm, &route->netmask) != 1)
       return E_RT_SYNTAX;
 
-   if (inet_pton(AF_INET6, gw, &route.gw) != 1)
+   if (inet_pton(AF_INET6, gw, &route->gw) != 1)
       return E_RT_SYNTAX;
 
-   if (!has_ocat_prefix(&route.gw))
+   if (!has_ocat_prefix(&route->gw))
       return E_RT_NOTORGW;
 
-   if (IN6_ARE_ADDR_EQUAL(&route.gw, &CNF(ocat_addr)))
+   if (is_local_addr(&route->gw))
       return E_RT_GWSELF;
 
-   route.netmask = ntohl(route.netmask);
-   route.dest = ntohl(route.dest);
+   route->netmask = ntohl(route->netmask);
+   route->dest = ntohl(route->dest);
+
+   return 0;
+}
+
+
+int ipv4_add_route_a(const char *dest, const char *nm, const char *gw)
+{
+   IPv4Route_t route;
+   int r;
+
+   if ((r = ipv4_parse_route(dest, nm, gw, &route)))
+      return r;
 
-   pthread_mutex_lock(&route_mutex_);
+   oc_mutex_lock(&route_mutex_, LOCK_V4ROUTE);
    r = ipv4_add_route(&route, &rroot_, 0);
-   pthread_mutex_unlock(&route_mutex_);
+   oc_mutex_unlock(&route_mutex_, LOCK_V4ROUTE);
 
    return r;
 }
@@ -58,13 +58,16 @@ void ipv6_reduce(struct in6_addr *net, int prefixlen)
 
 
 /*! Lookup IPv6 route. 
+ *  @param dest Destination address.
+ *  @param gw Pointer to buffer which receives the gateway.
+ *  @return Pointer to gw or NULL if there is no route.
  */
-struct in6_addr *ipv6_lookup_route(const struct in6_addr *dest)
+struct in6_addr *ipv6_lookup_route(const struct in6_addr *dest, struct in6_addr *gw)
 {
    struct in6_addr addr;
    int i, n;
 
-   pthread_mutex_lock(&v6route_mutex_);
+   oc_mutex_lock(&v6route_mutex_, LOCK_V6ROUTE);
    n = v6route_cnt_;
    for (i = 0; i < n; i++)
    {
@@ -73,11 +76,12 @@ struct in6_addr *ipv6_lookup_route(const struct in6_addr *dest)
       if (IN6_ARE_ADDR_EQUAL(&v6route_[i].dest, &addr))
       {
          log_debug("IPv6 route found");
+         IN6_ADDR_COPY(gw, &v6route_[i].gw);
          break;
       }
    }
-   pthread_mutex_unlock(&v6route_mutex_);
-   return i < n ? &v6route_[i].gw : NULL;
+   oc_mutex_unlock(&v6route_mutex_, LOCK_V6ROUTE);
+   return i < n ? gw : NULL;
 }
 
 
@@ -89,14 +93,22 @@ int ipv6_add_route(const IPv6Route_t *route)
    int r = -1;
    IPv6Route_t *rt;
 
-   pthread_mutex_lock(&v6route_mutex_);
+   if (mem_charge(MEM_ROUTE, sizeof(IPv6Route_t)) == -1)
+   {
+      log_msg(LOG_WARNING, "memory limit reached, route not added");
+      return -1;
+   }
+
+   oc_mutex_lock(&v6route_mutex_, LOCK_V6ROUTE);
    if ((rt = realloc(v6route_, sizeof(IPv6Route_t) * (v6route_cnt_ + 1))))
    {
       v6route_ = rt;
       r = v6route_cnt_;
       memcpy(&v6route_[v6route_cnt_++], route, sizeof(IPv6Route_t));
    }
-   pthread_mutex_unlock(&v6route_mutex_);
+   oc_mutex_unlock(&v6route_mutex_, LOCK_V6ROUTE);
+   if (r == -1)
+      mem_release(MEM_ROUTE, sizeof(IPv6Route_t));
    return r;
 }
 
@@ -116,38 +128,99 @@ void ipv6_print_routes(int fd)
 {
    int i;
 
-   pthread_mutex_lock(&v6route_mutex_);
+   oc_mutex_lock(&v6route_mutex_, LOCK_V6ROUTE);
    for (i = 0; i < v6route_cnt_; i++)
       ipv6_print(&v6route_[i], fd);
-   pthread_mutex_unlock(&v6route_mutex_);
+   oc_mutex_unlock(&v6route_mutex_, LOCK_V6ROUTE);
 }
 
 
-int ipv6_add_route_a(const char *prefix, const char *prefixlen, const char *gw)
+/*! Replace the IPv6 routing table by a new one. Internal routes, i.e. those
+ *  pointing to the local address such as the remote loopback route, are
+ *  retained.
+ *  @param route Pointer to new table which is taken over by this function,
+ *  i.e. it must have been allocated with malloc(3).
+ *  @param cnt Number of entries in route.
+ *  @return 0 on success, -1 on error. On error the table is left unchanged.
+ */
+int ipv6_replace_routes(IPv6Route_t *route, int cnt)
 {
-   IPv6Route_t route6;
+   IPv6Route_t *old, *rt;
+   int i, ocnt;
+
+   oc_mutex_lock(&v6route_mutex_, LOCK_V6ROUTE);
+   for (i = 0; i < v6route_cnt_; i++)
+   {
+      if (!is_local_addr(&v6route_[i].gw))
+         continue;
+      if (!(rt = realloc(route, sizeof(IPv6Route_t) * (cnt + 1))))
+      {
+         oc_mutex_unlock(&v6route_mutex_, LOCK_V6ROUTE);
+         log_msg(LOG_ERR, "could not get memory for routing table: \"%s\"", strerror(errno));
+         free(route);
+         return -1;
+      }
+      route = rt;
+      memcpy(&route[cnt++], &v6route_[i], sizeof(IPv6Route_t));
+   }
+   old = v6route_;
+   ocnt = v6route_cnt_;
+   v6route_ = route;
+   v6route_cnt_ = cnt;
+   oc_mutex_unlock(&v6route_mutex_, LOCK_V6ROUTE);
+
+   // the new table is already allocated, thus it cannot be refused
+   mem_release(MEM_ROUTE, sizeof(IPv6Route_t) * ocnt);
+   mem_account(MEM_ROUTE, sizeof(IPv6Route_t) * cnt);
+
+   free(old);
+   return 0;
+}
+
 
-   if (inet_pton(AF_INET6, prefix, &route6.dest) != 1)
+/*! Convert route given as strings into IPv6Route_t.
+ *  @param prefix Destination network.
+ *  @param prefixlen Prefix length.
+ *  @param gw IPv6 address of the gateway.
+ *  @param route Pointer to route structure which will be filled in.
+ *  @return 0 on success or < 0 (E_RT_xxx) on failure.
+ */
+int ipv6_parse_route(const char *prefix, const char *prefixlen, const char *gw, IPv6Route_t *route)
+{
+   if (inet_pton(AF_INET6, prefix, &route->dest) != 1)
       return E_RT_SYNTAX;
 
    errno = 0;
-   route6.prefixlen = strtol(prefixlen, NULL, 10);
+   route->prefixlen = strtol(prefixlen, NULL, 10);
    if (errno)
       return E_RT_SYNTAX;
-   if ((route6.prefixlen < 0) || (route6.prefixlen > 128))
+   if ((route->prefixlen < 0) || (route->prefixlen > 128))
       return E_RT_ILLNM;
 
-   if (inet_pton(AF_INET6, gw, &route6.gw) != 1)
+   if (inet_pton(AF_INET6, gw, &route->gw) != 1)
       return E_RT_SYNTAX;
 
-   if (!has_ocat_prefix(&route6.gw))
+   if (!has_ocat_prefix(&route->gw))
       return E_RT_NOTORGW;
 
-   if (IN6_ARE_ADDR_EQUAL(&route6.gw, &CNF(ocat_addr)))
+   if (is_local_addr(&route->gw))
       return E_RT_GWSELF;
 
-   ipv6_reduce(&route6.dest, route6.prefixlen);
-   if (ipv6_lookup_route(&route6.dest))
+   ipv6_reduce(&route->dest, route->prefixlen);
+   return 0;
+}
+
+
+int ipv6_add_route_a(const char *prefix, const char *prefixlen, const char *gw)
+{
+   IPv6Route_t route6;
+   struct in6_addr gwbuf;
+   int r;
+
+   if ((r = ipv6_parse_route(prefix, prefixlen, gw, &route6)))
+      return r;
+
+   if (ipv6_lookup_route(&route6.dest, &gwbuf))
       return E_RT_DUP;
 
    return ipv6_add_route(&route6);
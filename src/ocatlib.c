@@ -0,0 +1,332 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatlib.c
+ *  This file contains the in-process packet API of libocat. It allows an
+ *  application to run the OnionCat forwarding engine without a tunnel
+ *  device. Outgoing packets are passed in with ocat_lib_inject(), incoming
+ *  packets are delivered to the function registered with
+ *  ocat_lib_set_receiver().
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/05/18
+ */
+
+
+#include "ocat.h"
+#include "ocat_netdesc.h"
+#include "ocathosts.h"
+#include "ocatlib.h"
+
+
+//! packet receive function of the embedding application
+static ocat_rx_func_t rx_func_ = NULL;
+//! parameter passed to rx_func_
+static void *rx_parm_ = NULL;
+
+
+/*! Initialize the OnionCat engine. The network type (Tor or I2P) is detected
+ * from the domain of the hostname.
+ * @param onion_url Local onion hostname including the domain, e.g.
+ * "xxx.onion".
+ * @return 0 on success, -1 on error.
+ */
+int ocat_lib_init(const char *onion_url)
+{
+   init_setup();
+   if (strstr(onion_url, ".i2p") != NULL)
+      CNF(net_type) = NTYPE_I2P;
+   post_init_setup();
+
+   // there is neither a tunnel device nor a controlling terminal, stdin and
+   // stdout belong to the application
+   CNF(use_tap) = 0;
+   CNF(daemon) = 0;
+   CNF(tunfd[0]) = CNF(tunfd[1]) = -1;
+
+   // size the frame buffers as if there was a tunnel device with default MTU
+   CNF(tun_mtu) = DEF_TUN_MTU;
+   CNF(frame_size) = DEF_TUN_MTU + FRAME_HDR_LEN;
+
+   strlcpy(CNF(onion_url), onion_url, sizeof(CNF(onion_url)));
+   if (set_ocat_addr() == -1)
+      return -1;
+
+   log_msg(LOG_INFO, "%s", CNF(version));
+   return 0;
+}
+
+
+/*! Set the MTU of the virtual interface, i.e. the maximum size of the IP
+ * packets passed in and out. The default is DEF_TUN_MTU. It must be called
+ * before ocat_lib_start().
+ * @param mtu MTU, it must be in the range of MIN_TUN_MTU to 65535.
+ * @return 0 on success, -1 if the MTU is out of range.
+ */
+int ocat_lib_set_mtu(int mtu)
+{
+   if (mtu < MIN_TUN_MTU || mtu > 65535)
+   {
+      log_msg(LOG_ERR, "MTU must be in the range %d - 65535", MIN_TUN_MTU);
+      return -1;
+   }
+
+   CNF(tun_mtu) = mtu;
+   CNF(frame_size) = mtu + FRAME_HDR_LEN;
+   return 0;
+}
+
+
+/*! Start the threads of the forwarding engine. This are the receiver, the
+ * acceptor, the cleaner, the SOCKS connector, and the packet dequeuer (if
+ * compiled in). The name server, the controller, and the tun writer are not
+ * started.
+ * @return 0 on success, -1 on error.
+ */
+int ocat_lib_start(void)
+{
+   char def[100];
+
+   if (!CNF(oc_listen_cnt))
+   {
+      if (CNF(socks5) == CONNTYPE_DIRECT)
+      {
+         snprintf(def, sizeof(def), "[::]:%d", NDESC(listen_port));
+         add_listener(def);
+      }
+      else
+      {
+         snprintf(def, sizeof(def), "[::1]:%d", NDESC(listen_port));
+         add_listener(def);
+         snprintf(def, sizeof(def), "127.0.0.1:%d", NDESC(listen_port));
+         add_listener(def);
+      }
+   }
+   add_ident_listeners();
+
+   if (init_socks_connector() == -1)
+   {
+      log_msg(LOG_ERR, "couldn't create socks connector notifier");
+      return -1;
+   }
+
+   if (run_ocat_thread("receiver", socket_receiver, NULL))
+      return -1;
+   if (CNF(oc_listen_cnt) > 0)
+      run_ocat_thread("acceptor", socket_acceptor, NULL);
+   run_ocat_thread("cleaner", socket_cleaner, NULL);
+   if (CNF(socks_dst)->sin_family)
+      run_ocat_thread("connector", socks_connector_sel, NULL);
+#ifdef PACKET_QUEUE
+   run_ocat_thread("dequeuer", packet_dequeuer, NULL);
+#endif
+
+   return 0;
+}
+
+
+/*! Stop all threads of the engine and wait for them to terminate. */
+void ocat_lib_stop(void)
+{
+   set_term_req();
+   sig_socks_connector();
+   (void) join_threads();
+   hosts_save(CNF(hosts_cache));
+   delete_listeners(CNF(oc_listen), CNF(oc_listen_fd), CNF(oc_listen_cnt));
+}
+
+
+/*! Register the packet receive function. It should be called before
+ * ocat_lib_start().
+ * @param func Pointer to receive function or NULL. Incoming packets which are
+ * neither taken by the receive function nor by a packet ring are dropped.
+ * @param parm Arbitrary pointer which is passed to func.
+ */
+void ocat_lib_set_receiver(ocat_rx_func_t func, void *parm)
+{
+   rx_parm_ = parm;
+   rx_func_ = func;
+}
+
+
+/*! Deliver an incoming packet to the embedding application. This function
+ * is called by the socket_receiver().
+ * @return 0 if the packet was delivered, -1 if no receiver is registered.
+ */
+int lib_deliver_packet(const char *buf, int len)
+{
+   if (rx_func_ == NULL)
+      return -1;
+
+   rx_func_(buf, len, rx_parm_);
+   return 0;
+}
+
+
+/*! Inject an outgoing IP packet into the engine. The packet is routed
+ * exactly like a packet which was read from the tunnel device.
+ * @param pkt Pointer to IPv6 or IPv4 packet.
+ * @param len Length of the packet.
+ * @return 0 if the packet was forwarded or queued, -1 if it was dropped.
+ */
+int ocat_lib_inject(const char *pkt, int len)
+{
+   uint32_t key;
+   char *buf;
+   int rc;
+
+   if (len <= 0 || len > CNF(frame_size) - FRAME_HDR_LEN)
+   {
+      log_msg(LOG_ERR, "illegal packet length %d", len);
+      return -1;
+   }
+
+   switch (*pkt & 0xf0)
+   {
+      case 0x60:
+         key = CNF(fhd_key[IPV6_KEY]);
+         break;
+
+      case 0x40:
+         key = CNF(fhd_key[IPV4_KEY]);
+         break;
+
+      default:
+         log_debug("unknown IP version 0x%02x, dropping", *pkt & 0xf0);
+         return -1;
+   }
+
+   // forward_frame() may modify the frame up to CNF(frame_size)
+   if ((buf = malloc(CNF(frame_size))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not get memory for frame: \"%s\"", strerror(errno));
+      return -1;
+   }
+
+   set_tunheader(buf, key);
+   memcpy(buf + 4, pkt, len);
+   rc = forward_frame(buf, len + 4);
+   free(buf);
+   return rc;
+}
+
+
+/*! Queue a connection request to a remote OnionCat.
+ * @param name Onion hostname including the domain.
+ * @param perm Set to 1 to keep the connection open permanently.
+ * @return 0 on success, -1 if the hostname is invalid.
+ */
+int ocat_lib_connect(const char *name, int perm)
+{
+   struct in6_addr in6;
+
+   if (validate_onionname(name, &in6) == -1)
+      return -1;
+
+   socks_queue(in6, perm);
+   return 0;
+}
+
+
+/*! Close all connections to a remote OnionCat.
+ * @param name Onion hostname including the domain.
+ * @return Returns the number of connections closed or -1 if the hostname is
+ * invalid.
+ */
+int ocat_lib_close(const char *name)
+{
+   struct in6_addr in6;
+   OcatPeer_t *peer;
+   int n = 0;
+
+   if (validate_onionname(name, &in6) == -1)
+      return -1;
+
+   lock_peers();
+   while ((peer = search_peer(&in6)) != NULL)
+   {
+      oe_close(peer->tcpfd);
+      delete_peer(peer);
+      n++;
+   }
+   unlock_peers();
+
+   log_msg(LOG_INFO | LOG_FCONN, "%d connection(s) to %s closed", n, name);
+   return n;
+}
+
+
+/*! Output the active peers to a file descriptor. Each line contains the
+ * address, the hostname, the direction, the bytes received and sent, and the
+ * idle time in seconds.
+ * @param fd File descriptor to write to.
+ * @return Returns the number of active peers.
+ */
+int ocat_lib_list_peers(int fd)
+{
+   char addr[INET6_ADDRSTRLEN], name[SIZE_256];
+   OcatPeer_t *peer;
+   int n = 0;
+
+   lock_peers();
+   for (peer = get_first_peer(); peer; peer = peer->next)
+   {
+      if (hosts_get_name(&peer->addr, name, sizeof(name)) < 0)
+         ipv6tonion(&peer->addr, name);
+
+      lock_peer(peer);
+      if (peer->state == PEER_ACTIVE)
+      {
+         dprintf(fd, "%s %s %s %ld %ld %ld%s\n",
+               inet_ntop(AF_INET6, &peer->addr, addr, sizeof(addr)), name,
+               peer->dir == PEER_INCOMING ? "IN" : "OUT", peer->in, peer->out,
+               (long) (time(NULL) - peer->time), peer->perm ? " PERMANENT" : "");
+         n++;
+      }
+      unlock_peer(peer);
+   }
+   unlock_peers();
+
+   return n;
+}
+
+
+/*! Add a hostname to the internal hosts db.
+ * @param name Onion hostname including the domain.
+ * @return Returns the return value of hosts_add_entry() or -1 if the
+ * hostname is invalid.
+ */
+int ocat_lib_add_host(const char *name)
+{
+   struct in6_addr in6;
+
+   if (validate_onionname(name, &in6) == -1)
+      return -1;
+
+   return hosts_add_entry(&in6, name, HSRC_CLI, time(NULL), -1);
+}
+
+
+/*! Output the hosts db to a file descriptor.
+ * @param fd File descriptor to write to.
+ * @return Returns the return value of hosts_list().
+ */
+int ocat_lib_list_hosts(int fd)
+{
+   return hosts_list(fd);
+}
+
@@ -0,0 +1,96 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatlib.h
+ *  Public interface of libocat. This header is installed and does not depend
+ *  on config.h or any other internal header of OnionCat.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/05/18
+ */
+
+#ifndef OCATLIB_H
+#define OCATLIB_H
+
+#include <stdint.h>
+
+
+/*! Packet receive function of the embedding application. It is called from
+ * the receiver thread for every IP packet arriving from a remote OnionCat.
+ * The buffer is only valid during the call.
+ * @param pkt Pointer to the IP packet (IPv6 or IPv4, without tunnel header).
+ * @param len Length of the packet.
+ * @param parm Pointer which was passed to ocat_lib_set_receiver().
+ */
+typedef void (*ocat_rx_func_t)(const char *pkt, int len, void *parm);
+
+int ocat_lib_init(const char *);
+int ocat_lib_set_mtu(int);
+int ocat_lib_start(void);
+void ocat_lib_stop(void);
+void ocat_lib_set_receiver(ocat_rx_func_t, void *);
+int ocat_lib_inject(const char *, int);
+int ocat_lib_connect(const char *, int);
+int ocat_lib_close(const char *);
+int ocat_lib_list_peers(int);
+int ocat_lib_add_host(const char *);
+int ocat_lib_list_hosts(int);
+
+
+/*! Packet rings. A local application connects to the UNIX socket given by
+ * option -m and receives a file descriptor of a shared memory segment (as
+ * SCM_RIGHTS ancillary data) together with a struct ocat_ring_info. The
+ * segment contains two single-producer/single-consumer rings. The tx ring
+ * carries packets from the application to OnionCat, the rx ring carries
+ * packets from OnionCat to the application. Whenever a producer puts a packet
+ * into an empty ring it writes a single byte to the UNIX socket to wake up
+ * the consumer.
+ */
+#define OCAT_RING_MAGIC 0x4f435247
+#define OCAT_RING_VERSION 1
+//! number of slots of each ring, must be a power of 2
+#define OCAT_RING_SLOTS 1024
+//! minimum size of each slot including the leading 32 bit length field, the
+//! actual size depends on the MTU and is found in ocat_ring_t.slot_size
+#define OCAT_RING_SLOT_SIZE 2048
+
+//! ring header, the slots directly follow the header
+typedef struct ocat_ring
+{
+   uint32_t head;          //!< next slot to be written, only changed by producer
+   char _pad0[60];
+   uint32_t tail;          //!< next slot to be read, only changed by consumer
+   char _pad1[60];
+   uint32_t slots;         //!< number of slots
+   uint32_t slot_size;     //!< size of a slot in bytes
+} ocat_ring_t;
+
+//! layout of shared memory segment, sent by OnionCat on connect
+typedef struct ocat_ring_info
+{
+   uint32_t magic;         //!< OCAT_RING_MAGIC
+   uint32_t version;       //!< OCAT_RING_VERSION
+   uint32_t size;          //!< total size of shared memory segment
+   uint32_t tx_off;        //!< offset of tx ring (application -> OnionCat)
+   uint32_t rx_off;        //!< offset of rx ring (OnionCat -> application)
+} ocat_ring_info_t;
+
+int ocat_ring_put(ocat_ring_t *, const char *, int);
+int ocat_ring_get(ocat_ring_t *, char *, int);
+
+#endif
+
@@ -31,7 +31,6 @@
  */
 void oe_close(int fd)
 {
-   struct timeval tv;
    int r;
 
    log_debug("closing %d", fd);
@@ -41,8 +40,7 @@ void oe_close(int fd)
       if (r == EINTR)
       {
          log_msg(LOG_ERR, "close(%d) failed: \"%s\". restarting in a moment...", fd, strerror(r));
-         set_select_timeout(&tv);
-         oc_select(0, NULL, NULL, NULL);
+         oc_select0(0, NULL, NULL, NULL, SELECT_TIMEOUT);
       }
       log_msg(LOG_CRIT, "close(%d) failed: \"%s\"", fd, strerror(r));
       break;
@@ -185,7 +183,7 @@ void add_listener(const char *buf)
 void delete_listeners(struct sockaddr **addr, int *fd, int cnt)
 {
    log_debug("freeing %d sockaddrs", cnt);
-   for (; cnt; cnt--)
+   for (; cnt > 0; cnt--)
       free(addr[cnt - 1]);
    log_debug("freeing sockaddr lists");
    free(addr);
@@ -194,15 +192,37 @@ void delete_listeners(struct sockaddr **addr, int *fd, int cnt)
 
 
 /*! Generic implementation of the select(2) call suitable for OnionCat. All
- * parameters are equal to the original select(2) call except t. t is used to
- * fill in a timeval structure.
+ * parameters are equal to the original select(2) call except deadline. The
+ * call returns at the latest at the time deadline. If deadline is 0 it waits
+ * at most MAX_SELECT_TIMEOUT seconds. The termination wakeup fd is always
+ * added to the read set, thus a termination request wakes up all threads
+ * immediately.
+ * @return Number of ready file descriptors, 0 on timeout or -1 on error. On
+ * termination request -1 is returned and errno is set to ECANCELED.
  */
-int oc_select0(int maxfd, fd_set *rset, fd_set *wset, fd_set *eset, int t)
+int oc_select_until(int maxfd, fd_set *rset, fd_set *wset, fd_set *eset, time_t deadline)
 {
    struct timeval tv;
+   fd_set tset;
+   time_t t = time(NULL);
+   int tfd;
+
+   if (!deadline || deadline - t > MAX_SELECT_TIMEOUT)
+      deadline = t + MAX_SELECT_TIMEOUT;
+   set_select_timeout0(&tv, deadline > t ? deadline - t : 0);
+
+   if ((tfd = term_wakeup_fd()) != -1)
+   {
+      if (rset == NULL)
+      {
+         FD_ZERO(&tset);
+         rset = &tset;
+      }
+      MFD_SET(tfd, rset, maxfd);
+   }
 
-   set_select_timeout0(&tv, t);
-   log_debug2("selecting (maxfd = %d)", maxfd);
+   log_debug2("selecting (maxfd = %d, timeout = %lds)", maxfd, (long) tv.tv_sec);
+   set_thread_wait(deadline);
    if ((maxfd = select(maxfd + 1, rset, wset, eset, &tv)) == -1)
    {
       int e = errno;
@@ -212,17 +232,34 @@ int oc_select0(int maxfd, fd_set *rset, fd_set *wset, fd_set *eset, int t)
    else
    {
       log_debug2("select returned %d fds ready", maxfd);
+      if (maxfd > 0 && tfd != -1 && FD_ISSET(tfd, rset))
+      {
+         log_debug("woken up by termination request");
+         FD_CLR(tfd, rset);
+         errno = ECANCELED;
+         maxfd = -1;
+      }
    }
+   set_thread_wait(0);
 
    return maxfd;
 }
 
 
-/*! This is a wrapper function for oc_select0() with a fixed value of t
- * (SELECT_TIMEOUT).
+/*! This is a wrapper function for oc_select_until() which sleeps at most t
+ * seconds.
+ */
+int oc_select0(int maxfd, fd_set *rset, fd_set *wset, fd_set *eset, int t)
+{
+   return oc_select_until(maxfd, rset, wset, eset, time(NULL) + t);
+}
+
+
+/*! This is a wrapper function for oc_select_until() without a deadline. The
+ * threads sleep until an event occurs.
  */
 int oc_select(int maxfd, fd_set *rset, fd_set *wset, fd_set *eset)
 {
-   return oc_select0(maxfd, rset, wset, eset, SELECT_TIMEOUT);
+   return oc_select_until(maxfd, rset, wset, eset, 0);
 }
 
@@ -0,0 +1,221 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatlock.c
+ *  This file contains the lock contention statistics. If compiled with
+ *  --enable-lock-stats the central mutexes are locked with oc_mutex_lock()
+ *  which counts the acquisitions and records the wait time and the hold time
+ *  per lock. All mutexes of the same kind (e.g. the mutexes of all peers)
+ *  are accounted together. The acquisition time is kept per mutex on a
+ *  per-thread stack of held locks, thus nested locks of the same kind are
+ *  accounted correctly.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/06/09
+ */
+
+
+#include "ocat.h"
+
+
+#ifdef LOCK_STATS
+
+//! number of buckets of the wait time histogram
+#define LOCK_HIST_CNT 7
+//! max. number of accounted locks held by a thread at the same time
+#define LOCK_HELD_MAX 16
+
+//! lock statistics of a kind of lock
+typedef struct OcatLockStat
+{
+   const char *name;
+   unsigned long cnt;         //!< number of acquisitions
+   unsigned long contended;   //!< number of acquisitions which had to wait
+   uint64_t wait;             //!< total wait time in ns
+   uint64_t max_wait;         //!< max. wait time in ns
+   uint64_t max_hold;         //!< max. hold time in ns
+   //! wait time histogram: < 1us, 10us, 100us, 1ms, 10ms, 100ms, >= 100ms
+   unsigned long hist[LOCK_HIST_CNT];
+} OcatLockStat_t;
+
+
+static OcatLockStat_t lock_stat_[LOCK_CNT] =
+{
+   {"peers", 0, 0, 0, 0, 0, {0}},
+   {"peer", 0, 0, 0, 0, 0, {0}},
+   {"hosts", 0, 0, 0, 0, 0, {0}},
+   {"v6route", 0, 0, 0, 0, 0, {0}},
+   {"v4route", 0, 0, 0, 0, 0, {0}},
+   {"mac", 0, 0, 0, 0, 0, {0}},
+   {"log", 0, 0, 0, 0, 0, {0}},
+   {"setup", 0, 0, 0, 0, 0, {0}},
+   {"flows", 0, 0, 0, 0, 0, {0}}
+};
+
+//! lock held by a thread
+typedef struct OcatLockHeld
+{
+   pthread_mutex_t *m;
+   uint64_t t0;               //!< time of acquisition
+} OcatLockHeld_t;
+
+// locks held by the current thread
+static __thread OcatLockHeld_t lock_held_[LOCK_HELD_MAX];
+static __thread int lock_held_cnt_;
+
+
+static uint64_t lock_clock(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void lock_max(uint64_t *max, uint64_t v)
+{
+   uint64_t m = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+   while (v > m && !__atomic_compare_exchange_n(max, &m, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*! Lock a mutex and account the wait time. This function must not log
+ * because the log mutex itself is accounted.
+ * @param m Pointer to mutex.
+ * @param cls Kind of lock (LOCK_xxx).
+ * @return Returns the return value of pthread_mutex_lock(3).
+ */
+int lock_stat_lock(pthread_mutex_t *m, int cls)
+{
+   OcatLockStat_t *ls = &lock_stat_[cls];
+   uint64_t t0, t1, wait = 0;
+   int e, i;
+
+   if ((e = pthread_mutex_trylock(m)) == EBUSY)
+   {
+      t0 = lock_clock();
+      if ((e = pthread_mutex_lock(m)))
+         return e;
+      t1 = lock_clock();
+      wait = t1 - t0;
+      __atomic_add_fetch(&ls->contended, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&ls->wait, wait, __ATOMIC_RELAXED);
+      lock_max(&ls->max_wait, wait);
+   }
+   else if (e)
+      return e;
+   else
+      t1 = lock_clock();
+
+   // the hold time is not accounted if too many locks are held
+   if (lock_held_cnt_ < LOCK_HELD_MAX)
+   {
+      lock_held_[lock_held_cnt_].m = m;
+      lock_held_[lock_held_cnt_].t0 = t1;
+      lock_held_cnt_++;
+   }
+
+   __atomic_add_fetch(&ls->cnt, 1, __ATOMIC_RELAXED);
+   for (i = 0, wait /= 1000; wait && i < LOCK_HIST_CNT - 1; i++, wait /= 10);
+   __atomic_add_fetch(&ls->hist[i], 1, __ATOMIC_RELAXED);
+
+   return 0;
+}
+
+
+/*! Unlock a mutex which was locked with lock_stat_lock() and account the
+ * hold time.
+ * @param m Pointer to mutex.
+ * @param cls Kind of lock (LOCK_xxx).
+ * @return Returns the return value of pthread_mutex_unlock(3).
+ */
+int lock_stat_unlock(pthread_mutex_t *m, int cls)
+{
+   int i;
+
+   // locks are not necessarily released in reverse order
+   for (i = lock_held_cnt_ - 1; i >= 0; i--)
+      if (lock_held_[i].m == m)
+      {
+         lock_max(&lock_stat_[cls].max_hold, lock_clock() - lock_held_[i].t0);
+         lock_held_cnt_--;
+         memmove(&lock_held_[i], &lock_held_[i + 1], (lock_held_cnt_ - i) * sizeof(*lock_held_));
+         break;
+      }
+   return pthread_mutex_unlock(m);
+}
+
+
+/*! Reset the lock statistics. */
+void lock_stat_reset(void)
+{
+   int i, j;
+
+   for (i = 0; i < LOCK_CNT; i++)
+   {
+      __atomic_store_n(&lock_stat_[i].cnt, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&lock_stat_[i].contended, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&lock_stat_[i].wait, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&lock_stat_[i].max_wait, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&lock_stat_[i].max_hold, 0, __ATOMIC_RELAXED);
+      for (j = 0; j < LOCK_HIST_CNT; j++)
+         __atomic_store_n(&lock_stat_[i].hist[j], 0, __ATOMIC_RELAXED);
+   }
+}
+
+
+/*! Output the lock statistics. The times are shown in microseconds.
+ * @param fd File descriptor to write to.
+ */
+void print_lock_stats(int fd)
+{
+   OcatLockStat_t *ls;
+   int i, j;
+
+   dprintf(fd, "%-8s %10s %10s %10s %9s %9s   wait histogram <1us <10us <100us <1ms <10ms <100ms >=100ms\n",
+         "lock", "count", "contended", "wait_us", "maxwait", "maxhold");
+   for (i = 0; i < LOCK_CNT; i++)
+   {
+      ls = &lock_stat_[i];
+      dprintf(fd, "%-8s %10lu %10lu %10lu %9lu %9lu  ", ls->name,
+            __atomic_load_n(&ls->cnt, __ATOMIC_RELAXED),
+            __atomic_load_n(&ls->contended, __ATOMIC_RELAXED),
+            (unsigned long) (__atomic_load_n(&ls->wait, __ATOMIC_RELAXED) / 1000),
+            (unsigned long) (__atomic_load_n(&ls->max_wait, __ATOMIC_RELAXED) / 1000),
+            (unsigned long) (__atomic_load_n(&ls->max_hold, __ATOMIC_RELAXED) / 1000));
+      for (j = 0; j < LOCK_HIST_CNT; j++)
+         dprintf(fd, " %lu", __atomic_load_n(&ls->hist[j], __ATOMIC_RELAXED));
+      dprintf(fd, "\n");
+   }
+}
+
+#else
+
+void lock_stat_reset(void)
+{
+}
+
+
+void print_lock_stats(int fd)
+{
+   dprintf(fd, "lock statistics not available, compile with --enable-lock-stats\n");
+}
+
+#endif
+
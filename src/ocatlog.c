@@ -141,7 +141,7 @@ void vlog_msgf(int out, int lf, const char *fmt, va_list ap)
       th = &ths;
    }
 
-   (void) pthread_mutex_lock(&log_mutex_);
+   (void) oc_mutex_lock(&log_mutex_, LOCK_LOG);
    if (out)
    {
       if (lf & LOG_FFD)
@@ -159,7 +159,7 @@ void vlog_msgf(int out, int lf, const char *fmt, va_list ap)
       syslog(level | LOG_DAEMON, "[%s] %s", th->name, buf);
 
    }
-   (void) pthread_mutex_unlock(&log_mutex_);
+   (void) oc_mutex_unlock(&log_mutex_, LOCK_LOG);
 }
 
 
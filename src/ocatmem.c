@@ -0,0 +1,219 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatmem.c
+ *  This file contains the memory accounting. The dynamic memory of the
+ *  subsystems is accounted separately. Each subsystem and the total may have
+ *  a limit. If a limit is reached, allocations which can be refused (e.g.
+ *  new anonymous peers or queued packets) are refused.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/06/02
+ */
+
+
+#include "ocat.h"
+
+
+//! memory accounting data of a subsystem
+typedef struct OcatMem
+{
+   const char *name;
+   size_t used;            //!< bytes currently in use
+   size_t peak;            //!< max. bytes in use
+   size_t limit;           //!< max. bytes allowed, 0 means unlimited
+   unsigned long refused;  //!< number of refused allocations
+} OcatMem_t;
+
+
+// index MEM_SUBSYS_CNT is the total
+static OcatMem_t mem_[MEM_SUBSYS_CNT + 1] =
+{
+   {"peers", 0, 0, 0, 0},
+   {"rxbufs", 0, 0, 0, 0},
+   {"pktqueue", 0, 0, 0, 0},
+   {"hosts", 0, 0, 0, 0},
+   {"routes", 0, 0, 0, 0},
+   {"resolver", 0, 0, 0, 0},
+   {"socks", 0, 0, 0, 0},
+   {"tunqueue", 0, 0, MEM_TUNQ_LIMIT, 0},
+   {"flows", 0, 0, 0, 0},
+   {"total", 0, 0, 0, 0}
+};
+
+
+static void mem_peak(OcatMem_t *m, size_t used)
+{
+   size_t peak = __atomic_load_n(&m->peak, __ATOMIC_RELAXED);
+
+   while (used > peak && !__atomic_compare_exchange_n(&m->peak, &peak, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*! Account memory to a subsystem without checking the limits. This is used
+ * for allocations which cannot be refused.
+ * @param sys Subsystem (MEM_xxx).
+ * @param size Number of bytes.
+ */
+void mem_account(int sys, size_t size)
+{
+   mem_peak(&mem_[sys], __atomic_add_fetch(&mem_[sys].used, size, __ATOMIC_RELAXED));
+   mem_peak(&mem_[MEM_SUBSYS_CNT], __atomic_add_fetch(&mem_[MEM_SUBSYS_CNT].used, size, __ATOMIC_RELAXED));
+}
+
+
+/*! Release memory which was accounted by mem_charge() or mem_account().
+ * @param sys Subsystem (MEM_xxx).
+ * @param size Number of bytes.
+ */
+void mem_release(int sys, size_t size)
+{
+   __atomic_sub_fetch(&mem_[sys].used, size, __ATOMIC_RELAXED);
+   __atomic_sub_fetch(&mem_[MEM_SUBSYS_CNT].used, size, __ATOMIC_RELAXED);
+}
+
+
+/*! Account memory to a subsystem if neither its limit nor the total limit is
+ * exceeded.
+ * @param sys Subsystem (MEM_xxx).
+ * @param size Number of bytes.
+ * @return 0 on success, -1 if the memory was refused.
+ */
+int mem_charge(int sys, size_t size)
+{
+   OcatMem_t *m = &mem_[sys], *t = &mem_[MEM_SUBSYS_CNT];
+   size_t mu, tu;
+
+   mu = __atomic_add_fetch(&m->used, size, __ATOMIC_RELAXED);
+   tu = __atomic_add_fetch(&t->used, size, __ATOMIC_RELAXED);
+
+   if ((m->limit && mu > m->limit) || (t->limit && tu > t->limit))
+   {
+      mem_release(sys, size);
+      __atomic_add_fetch(&m->refused, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&t->refused, 1, __ATOMIC_RELAXED);
+      return -1;
+   }
+
+   mem_peak(m, mu);
+   mem_peak(t, tu);
+   return 0;
+}
+
+
+/*! Check if memory is available without accounting it.
+ * @param sys Subsystem (MEM_xxx).
+ * @param size Number of bytes.
+ * @return 1 if size bytes could be charged, otherwise 0.
+ */
+int mem_avail(int sys, size_t size)
+{
+   OcatMem_t *m = &mem_[sys], *t = &mem_[MEM_SUBSYS_CNT];
+
+   if ((m->limit && __atomic_load_n(&m->used, __ATOMIC_RELAXED) + size > m->limit) ||
+         (t->limit && __atomic_load_n(&t->used, __ATOMIC_RELAXED) + size > t->limit))
+   {
+      __atomic_add_fetch(&m->refused, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&t->refused, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+   return 1;
+}
+
+
+/*! Convert a size string with an optional unit suffix K, M, or G.
+ * @param s Pointer to string.
+ * @return Number of bytes or -1 on error.
+ */
+static long long parse_size(const char *s)
+{
+   long long n;
+   char *end;
+
+   errno = 0;
+   n = strtoll(s, &end, 10);
+   if (errno || end == s || n < 0)
+      return -1;
+
+   switch (*end)
+   {
+      case 'G':
+      case 'g':
+         n <<= 10;
+         /* fall through */
+      case 'M':
+      case 'm':
+         n <<= 10;
+         /* fall through */
+      case 'K':
+      case 'k':
+         n <<= 10;
+         end++;
+         break;
+   }
+   return *end ? -1 : n;
+}
+
+
+/*! Set the memory limit of a subsystem.
+ * @param name Name of subsystem as shown by print_mem_usage() or "total".
+ * @param size Limit in bytes, optionally followed by K, M, or G. 0 means
+ * unlimited.
+ * @return 0 on success, -1 on error.
+ */
+int mem_set_limit(const char *name, const char *size)
+{
+   long long n;
+   int i;
+
+   for (i = 0; i <= MEM_SUBSYS_CNT; i++)
+      if (!strcmp(mem_[i].name, name))
+         break;
+   if (i > MEM_SUBSYS_CNT)
+   {
+      log_msg(LOG_ERR, "unknown memory subsystem \"%s\"", name);
+      return -1;
+   }
+
+   if ((n = parse_size(size)) == -1)
+   {
+      log_msg(LOG_ERR, "illegal memory size \"%s\"", size);
+      return -1;
+   }
+
+   __atomic_store_n(&mem_[i].limit, (size_t) n, __ATOMIC_RELAXED);
+   log_msg(LOG_INFO, "memory limit of %s set to %lld bytes", name, n);
+   return 0;
+}
+
+
+/*! Output the memory accounting table.
+ * @param fd File descriptor to write to.
+ */
+void print_mem_usage(int fd)
+{
+   int i;
+
+   dprintf(fd, "%-10s %12s %12s %12s %8s\n", "subsystem", "used", "peak", "limit", "refused");
+   for (i = 0; i <= MEM_SUBSYS_CNT; i++)
+      dprintf(fd, "%-10s %12lu %12lu %12lu %8lu\n", mem_[i].name,
+            (unsigned long) __atomic_load_n(&mem_[i].used, __ATOMIC_RELAXED),
+            (unsigned long) __atomic_load_n(&mem_[i].peak, __ATOMIC_RELAXED),
+            (unsigned long) mem_[i].limit,
+            __atomic_load_n(&mem_[i].refused, __ATOMIC_RELAXED));
+}
+
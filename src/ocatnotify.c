@@ -0,0 +1,142 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatnotify.c
+ *  This file contains the cross-thread notification functions. A notifier
+ *  wraps an eventfd (or a pipe on systems without eventfd) which can be
+ *  selected on. Wakeups are coalesced, i.e. if several threads signal the
+ *  notifier before the consumer wakes up, only a single write(2) is done.
+ *  The payload is passed through lock-free multi-producer/single-consumer
+ *  queues.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/05/26
+ */
+
+
+#include "ocat.h"
+
+
+/*! Initialize a notifier.
+ * @param n Pointer to notifier.
+ * @return 0 on success, -1 on error.
+ */
+int notify_init(OcatNotify_t *n)
+{
+   n->pending = 0;
+#ifdef HAVE_SYS_EVENTFD_H
+   if ((n->fd[0] = eventfd(0, EFD_NONBLOCK)) != -1)
+   {
+      n->fd[1] = n->fd[0];
+      return 0;
+   }
+   log_msg(LOG_WARNING, "could not create eventfd: \"%s\", falling back to pipe", strerror(errno));
+#endif
+   if (pipe(n->fd) == -1)
+   {
+      log_msg(LOG_ERR, "could not create notification pipe: \"%s\"", strerror(errno));
+      n->fd[0] = n->fd[1] = -1;
+      return -1;
+   }
+   set_nonblock(n->fd[0]);
+   set_nonblock(n->fd[1]);
+   return 0;
+}
+
+
+/*! Close the file descriptors of a notifier.
+ * @param n Pointer to notifier.
+ */
+void notify_close(OcatNotify_t *n)
+{
+   if (n->fd[0] != -1)
+      oe_close(n->fd[0]);
+   if (n->fd[1] != -1 && n->fd[1] != n->fd[0])
+      oe_close(n->fd[1]);
+   n->fd[0] = n->fd[1] = -1;
+}
+
+
+/*! Wake up the consumer of a notifier. Nothing is written if a wakeup is
+ * already pending.
+ * @param n Pointer to notifier.
+ */
+void notify_signal(OcatNotify_t *n)
+{
+   uint64_t v = 1;
+
+   if (n->fd[1] == -1)
+      return;
+
+   if (__atomic_exchange_n(&n->pending, 1, __ATOMIC_ACQ_REL))
+   {
+      log_debug2("wakeup already pending on fd %d", n->fd[1]);
+      return;
+   }
+
+   if (write(n->fd[1], &v, sizeof(v)) == -1 && errno != EAGAIN)
+      log_msg(LOG_ERR, "could not write to notification fd %d: \"%s\"", n->fd[1], strerror(errno));
+}
+
+
+/*! Acknowledge a wakeup. This must be called by the consumer before it
+ * processes its work, thus every event which is signalled afterwards
+ * triggers a new wakeup.
+ * @param n Pointer to notifier.
+ */
+void notify_clear(OcatNotify_t *n)
+{
+   char buf[64];
+
+   __atomic_store_n(&n->pending, 0, __ATOMIC_RELEASE);
+   // an eventfd is reset by a single read, a pipe is read until it is empty
+   while (read(n->fd[0], buf, sizeof(buf)) > 0 && n->fd[0] != n->fd[1]);
+}
+
+
+/*! Push an element to a multi-producer/single-consumer queue. This is
+ * lock-free and may be called by any thread.
+ * @param head Pointer to head of queue.
+ * @param node Element to add.
+ */
+void mpsc_push(OcatMpscNode_t **head, OcatMpscNode_t *node)
+{
+   node->next = __atomic_load_n(head, __ATOMIC_RELAXED);
+   while (!__atomic_compare_exchange_n(head, &node->next, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*! Remove all elements from a multi-producer/single-consumer queue. This
+ * must only be called by the consumer.
+ * @param head Pointer to head of queue.
+ * @return Pointer to list of elements in the order they were pushed, or NULL
+ * if the queue was empty.
+ */
+OcatMpscNode_t *mpsc_take(OcatMpscNode_t **head)
+{
+   OcatMpscNode_t *list, *rev = NULL, *next;
+
+   // reverse list to restore FIFO order
+   for (list = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE); list; list = next)
+   {
+      next = list->next;
+      list->next = rev;
+      rev = list;
+   }
+   return rev;
+}
+
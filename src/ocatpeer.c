@@ -31,6 +31,8 @@
 static OcatPeer_t *peer_ = NULL;
 // mutex for locking array of peers
 static pthread_mutex_t peer_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+// list of unused peer structures, protected by peer_mutex_
+static OcatPeer_t *peer_free_ = NULL;
 
 
 /*! Return pointer to first peer. */
@@ -70,7 +72,7 @@ OcatPeer_t **get_first_peer_ptr(void)
 int lock_peers(void)
 {
    set_thread_flags(1);
-   int e = pthread_mutex_lock(&peer_mutex_);
+   int e = oc_mutex_lock(&peer_mutex_, LOCK_PEERS);
    set_thread_flags(2);
    return e;
 }
@@ -79,7 +81,7 @@ int lock_peers(void)
 /*! Unlock peer list. */
 int unlock_peers(void)
 {
-   int e = pthread_mutex_unlock(&peer_mutex_);
+   int e = oc_mutex_unlock(&peer_mutex_, LOCK_PEERS);
    set_thread_flags(0);
    return e;
 }
@@ -91,7 +93,7 @@ int lock_peer(OcatPeer_t *peer)
 {
    // safety check
    if (peer == NULL) return -1;
-   return pthread_mutex_lock(&peer->mutex);
+   return oc_mutex_lock(&peer->mutex, LOCK_PEER);
 }
 
 
@@ -101,7 +103,7 @@ int unlock_peer(OcatPeer_t *peer)
 {
    // safety check
    if (peer == NULL) return -1;
-   return pthread_mutex_unlock(&peer->mutex);
+   return oc_mutex_unlock(&peer->mutex, LOCK_PEER);
 }
 
 
@@ -119,6 +121,53 @@ OcatPeer_t *search_peer(const struct in6_addr *addr)
 }
 
 
+/*! Get an unused peer structure. Peer structures are allocated in slabs of
+ * PEER_SLAB_SIZE elements, thus the peers are densely packed in memory.
+ * Peer list MUST be locked before.
+ * @return Pointer to zeroed peer or NULL on error.
+ */
+static OcatPeer_t *alloc_peer(void)
+{
+   OcatPeer_t *peer;
+   int i;
+
+   if (peer_free_ == NULL)
+   {
+      if (!(peer = calloc(PEER_SLAB_SIZE, sizeof(OcatPeer_t))))
+         return NULL;
+      for (i = 0; i < PEER_SLAB_SIZE; i++)
+      {
+         peer[i].next = peer_free_;
+         peer_free_ = &peer[i];
+      }
+   }
+
+   peer = peer_free_;
+   peer_free_ = peer->next;
+   memset(peer, 0, sizeof(*peer));
+   return peer;
+}
+
+
+/*! Return a peer structure to the list of unused peers. The out of line data
+ * is freed.
+ * Peer list MUST be locked before.
+ * @param peer Pointer to peer.
+ */
+static void free_peer(OcatPeer_t *peer)
+{
+   if (peer->cold != NULL)
+   {
+      mem_release(MEM_PEER, sizeof(*peer));
+      mem_release(MEM_RXBUF, PEER_COLD_SIZE);
+   }
+   free(peer->cold);
+   peer->cold = NULL;
+   peer->next = peer_free_;
+   peer_free_ = peer;
+}
+
+
 /*! Create a new empty peer and add it to the peer list.
  *  Peer list MUST be locked befored. */
 OcatPeer_t *get_empty_peer(void)
@@ -126,18 +175,24 @@ OcatPeer_t *get_empty_peer(void)
    int rc;
    OcatPeer_t *peer;
 
-   if (!(peer = calloc(1, sizeof(OcatPeer_t))))
+   if ((peer = alloc_peer()) == NULL || (peer->cold = malloc(PEER_COLD_SIZE)) == NULL)
    {
       log_msg(LOG_ERR, "cannot get memory for new peer: \"%s\"", strerror(errno));
+      if (peer != NULL)
+         free_peer(peer);
       return NULL;
    }
+   mem_account(MEM_PEER, sizeof(*peer));
+   mem_account(MEM_RXBUF, PEER_COLD_SIZE);
+   *peer->cold->sname = '\0';
+   peer->cold->hosts_time = 0;
 
-   peer->tunhdr = (uint32_t*) peer->_fragbuf;
-   peer->fragbuf = &peer->_fragbuf[CNF(fhd_key_len)];
+   peer->tunhdr = (uint32_t*) peer->cold->fragbuf;
+   peer->fragbuf = &peer->cold->fragbuf[CNF(fhd_key_len)];
    if ((rc = pthread_mutex_init(&peer->mutex, NULL)))
    {
       log_msg(LOG_EMERG, "cannot init new peer mutex: \"%s\"", strerror(rc));
-      free(peer);
+      free_peer(peer);
       return NULL;
    }
    peer->rand = random();
@@ -184,6 +239,6 @@ void delete_peer0(OcatPeer_t **p)
    if ((rc = pthread_mutex_destroy(&peer->mutex)))
       log_msg(LOG_ERR, "cannot destroy mutex: \"%s\"", strerror(rc));
    // free memory
-   free(peer);
+   free_peer(peer);
 }
 
@@ -344,11 +344,118 @@ int oc_dn_name(const char *msg, int msglen, const char *dn, char *buf, int len)
 }
 
 
+/*! Find the address of a name. First the name is looked up in the hosts db.
+ * Otherwise, if it is a (subdomain of an) onion name of one of the networks
+ * (see domain_net_type()), the address of the onion name is looked up in the
+ * hosts db or calculated. Since the name is received from remote, invalid
+ * names are logged at debug level only.
+ * @param name Pointer to name.
+ * @param addr Pointer to variable which receives the address.
+ * @param ttl Pointer to variable which receives the TTL.
+ * @return 0 on success, -1 if the name is unknown.
+ */
+static int oc_name_addr(const char *name, struct in6_addr *addr, int *ttl)
+{
+   char buf[NI_MAXHOST];
+   const char *s, *d;
+
+   // look up full name in the hosts db
+   if (hosts_get_addr_by_name(name, addr, ttl) != -1)
+      goto na_ok;
+
+   // find domain of a network, names are case insensitive
+   strlcpy(buf, name, sizeof(buf));
+   strtolower(buf);
+   for (d = strchr(buf, '.'); d != NULL && domain_net_type(d) == -1; d = strchr(d + 1, '.'));
+   if (d == NULL)
+      return -1;
+
+   // find onion name in front of the domain
+   for (s = d; s > buf && s[-1] != '.'; s--);
+
+   // wildcard, i.e. subdomain of a hosts entry
+   if (s != buf && hosts_get_addr_by_name(s, addr, ttl) != -1)
+      goto na_ok;
+
+   // calculate address
+   if (validate_onionname0(s, addr, LOG_DEBUG) == -1)
+      return -1;
+   *ttl = -1;
+
+na_ok:
+   if (*ttl < 0)
+      *ttl = DNS_AAAA_TTL;
+   return 0;
+}
+
+
+/*! This function answers a query for a name. AAAA records are replied for
+ * names which are found by oc_name_addr(). Queries of other types for these
+ * names are answered without data, all other names get NXDOMAIN.
+ * @param dh Pointer to the DNS message. The reply is constructed in place.
+ * @param qlen Length of the query name.
+ * @param msglen Length of the request message.
+ * @param buflen Total length of the buffer.
+ * @return Returns the length of the reply message.
+ */
+static int oc_proc_name_request(HEADER *dh, int qlen, int msglen, int buflen)
+{
+   char name[NI_MAXHOST], *buf = (char*) (dh + 1);
+   struct in6_addr in6;
+   int ttl;
+
+   if (*((uint16_t*) &buf[qlen + 2]) != htons(C_IN) || oc_dn_name((char*) dh, msglen, buf, name, sizeof(name)) == -1)
+   {
+      log_debug("no IN query");
+      dh->rcode = NXDOMAIN;
+      return msglen;
+   }
+
+   if (oc_name_addr(name, &in6, &ttl) == -1)
+   {
+      log_debug("no such name \"%s\"", name);
+      dh->rcode = NXDOMAIN;
+      return msglen;
+   }
+   dh->aa = 1;
+
+   if (*((uint16_t*) &buf[qlen]) != htons(T_AAAA) && *((uint16_t*) &buf[qlen]) != htons(T_ANY))
+   {
+      log_debug("no data of type %d for \"%s\"", ntohs(*((uint16_t*) &buf[qlen])), name);
+      return msglen;
+   }
+
+   if (buflen - msglen < 28)
+   {
+      dh->rcode = SERVFAIL;
+      return msglen;
+   }
+
+   log_msg(LOG_INFO, "got valid DNS request for name %s", name);
+
+   // advance buf pointer to section behind question
+   buf += qlen + 2 + 2;
+
+   // construct compressed name (same as question)
+   buf[0] = 0xc0;
+   buf[1] = sizeof(*dh);
+
+   *((uint16_t*) &buf[2]) = htons(T_AAAA);
+   *((uint16_t*) &buf[4]) = htons(C_IN);
+   *((uint32_t*) &buf[6]) = htonl(ttl);
+   *((uint16_t*) &buf[10]) = htons(sizeof(in6));
+   memcpy(&buf[12], &in6, sizeof(in6));
+   dh->ancount = htons(1);
+
+   return msglen + 12 + sizeof(in6);
+}
+
+
 /*! This function processes a DNS request and constructs the answer directly
  * into the same buffer. If the request contains a valid PTR request and the
  * name is found in the local database, a valid reply message is formed. If the
- * request contains any valid query or the name of the PTR request is not
- * found, a NXDOMAIN message is formed. If a format error in the request is
+ * name of the PTR request is not found, a NXDOMAIN message is formed. Queries
+ * of any other type are answered by oc_proc_name_request(). If a format error in the request is
  * found, a FORMERR message is formed. If any other error occurred, -1 is
  * returned. No reply should be sent.
  * @param buf Pointer to the request/response buffer.
@@ -405,8 +512,12 @@ int oc_proc_request(char *buf, int msglen, int buflen)
       log_debug("removed additional section, msglen = %d", msglen);
    }
 
+   // queries for names
+   if (*((uint16_t*) &buf[n]) != htons(T_PTR))
+      return oc_proc_name_request(dh, n, msglen, buflen);
+
    // check if it is a IN PTR query
-   if (n != IP6REVLEN || *((uint16_t*) &buf[n]) != htons(T_PTR) || *((uint16_t*) &buf[n + 2]) != htons(C_IN))
+   if (n != IP6REVLEN || *((uint16_t*) &buf[n + 2]) != htons(C_IN))
    {
       log_debug("no ptr query");
       dh->rcode = NXDOMAIN;
@@ -455,8 +566,7 @@ int oc_proc_request(char *buf, int msglen, int buflen)
 
    *((uint16_t*) &buf[2]) = htons(T_PTR);
    *((uint16_t*) &buf[4]) = htons(C_IN);
-   int ttl = 3600;
-   *((uint32_t*) &buf[6]) = htonl(ttl);
+   *((uint32_t*) &buf[6]) = htonl(DNS_PTR_TTL);
    //convert c string do dns string
    if ((n = oc_name_dn(name, &buf[12], buflen - msglen - 12)) == -1)
    {
@@ -583,26 +693,431 @@ int oc_proc_response(const char *buf, int msglen, uint16_t org_id, const struct
 }
 
 
-/*! This function creates a DGRAM socket suitable to receive OnionCat DNS
- * queries.
- * @param port Port number of UDP port.
+/*! Set the send and receive timeout of a socket.
+ * @param fd File descriptor of socket.
+ * @param t Timeout in seconds.
+ */
+static void oc_sock_timeout(int fd, int t)
+{
+   struct timeval tv = {t, 0};
+
+   if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+      log_msg(LOG_WARNING, "could not set timeout on fd %d: %s", fd, strerror(errno));
+}
+
+
+/*! Read exactly len bytes from a stream socket.
+ * @param fd File descriptor.
+ * @param buf Pointer to destination buffer.
+ * @param len Number of bytes to read.
+ * @return 0 on success, -1 on error or if the connection was closed.
+ */
+static int oc_read_full(int fd, char *buf, int len)
+{
+   int n;
+
+   for (; len > 0; buf += n, len -= n)
+   {
+      set_thread_wait(time(NULL) + HOSTS_SYNC_TIMEOUT);
+      if ((n = read(fd, buf, len)) == -1)
+      {
+         log_msg(LOG_WARNING, "read() on fd %d failed: %s", fd, strerror(errno));
+         return -1;
+      }
+      if (!n)
+      {
+         log_msg(LOG_WARNING, "connection on fd %d closed prematurely", fd);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+/*! Write exactly len bytes to a stream socket.
+ * @param fd File descriptor.
+ * @param buf Pointer to data.
+ * @param len Number of bytes to write.
+ * @return 0 on success, -1 on error.
+ */
+static int oc_write_full(int fd, const char *buf, int len)
+{
+   int n;
+
+   for (; len > 0; buf += n, len -= n)
+   {
+      set_thread_wait(time(NULL) + HOSTS_SYNC_TIMEOUT);
+      if ((n = write(fd, buf, len)) == -1)
+      {
+         log_msg(LOG_WARNING, "write() on fd %d failed: %s", fd, strerror(errno));
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+/*! Create the SOA record of the OnionCat reverse zone. Only the serial is of
+ * interest, the names are empty.
+ * @param buf Pointer to destination buffer which must have at least zlen +
+ * 32 bytes.
+ * @param zone Name of zone as found in a DNS message.
+ * @param zlen Length of zone.
+ * @param serial Serial number.
+ * @return Returns the length of the record.
+ */
+static int oc_mk_soa(char *buf, const char *zone, int zlen, uint32_t serial)
+{
+   memcpy(buf, zone, zlen);
+   buf += zlen;
+   *((uint16_t*) &buf[0]) = htons(T_SOA);
+   *((uint16_t*) &buf[2]) = htons(C_IN);
+   *((uint32_t*) &buf[4]) = 0;
+   *((uint16_t*) &buf[8]) = htons(22);
+   // empty MNAME and RNAME
+   buf[10] = buf[11] = 0;
+   *((uint32_t*) &buf[12]) = htonl(serial);
+   *((uint32_t*) &buf[16]) = htonl(HOSTS_SYNC_TIME);
+   *((uint32_t*) &buf[20]) = htonl(HOSTS_SYNC_TIMEOUT);
+   *((uint32_t*) &buf[24]) = htonl(HOSTS_KPLV_TTL);
+   *((uint32_t*) &buf[28]) = 0;
+   return zlen + 32;
+}
+
+
+/*! Get the serial number of a SOA record.
+ * @param rdata Pointer to RDATA of SOA record.
+ * @param rdlen Length of RDATA.
+ * @param serial Pointer to variable which receives the serial.
+ * @return 0 on success, -1 on format error.
+ */
+static int oc_soa_serial(const char *rdata, int rdlen, uint32_t *serial)
+{
+   int m, r;
+
+   if ((m = oc_dn_len(rdata, rdlen)) == -1 || (r = oc_dn_len(rdata + m, rdlen - m)) == -1 || m + r + 20 > rdlen)
+      return -1;
+
+   *serial = ntohl(*((uint32_t*) &rdata[m + r]));
+   return 0;
+}
+
+
+/*! Make sure that there are at least n bytes free in the transfer buffer. If
+ * it fails, x->err is set and all further operations on x are ignored.
+ * @return 0 on success, -1 on error.
+ */
+static int xfer_reserve(ocres_xfer_t *x, int n)
+{
+   char *buf;
+   int size;
+
+   if (x->err)
+      return -1;
+   if (x->len + n <= x->size)
+      return 0;
+
+   for (size = x->size ? x->size : XFR_MSG_SIZE; size < x->len + n; size <<= 1);
+   if (mem_charge(MEM_RESOLV, size - x->size) == -1)
+   {
+      log_msg(LOG_WARNING, "memory limit reached, zone transfer aborted");
+      x->err = 1;
+      return -1;
+   }
+   if ((buf = realloc(x->buf, size)) == NULL)
+   {
+      log_msg(LOG_ERR, "realloc failed: %s", strerror(errno));
+      mem_release(MEM_RESOLV, size - x->size);
+      x->err = 1;
+      return -1;
+   }
+   x->buf = buf;
+   x->size = size;
+   return 0;
+}
+
+
+//! Start a new message of a zone transfer.
+static void xfer_begin(ocres_xfer_t *x)
+{
+   if (xfer_reserve(x, 2 + x->hlen) == -1)
+      return;
+
+   x->msg = x->len;
+   memcpy(x->buf + x->len + 2, x->hdr, x->hlen);
+   x->len += 2 + x->hlen;
+   x->ancount = 0;
+}
+
+
+//! Finish current message of a zone transfer, i.e. set its length and counter.
+static void xfer_end(ocres_xfer_t *x)
+{
+   if (x->err)
+      return;
+
+   ((HEADER*) (x->buf + x->msg + 2))->ancount = htons(x->ancount);
+   *((uint16_t*) (x->buf + x->msg)) = htons(x->len - x->msg - 2);
+}
+
+
+//! Add a resource record to a zone transfer.
+static void xfer_rr(ocres_xfer_t *x, const char *rr, int len)
+{
+   if (x->len - x->msg - 2 + len > XFR_MSG_SIZE)
+   {
+      xfer_end(x);
+      xfer_begin(x);
+   }
+   if (xfer_reserve(x, len) == -1)
+      return;
+
+   memcpy(x->buf + x->len, rr, len);
+   x->len += len;
+   x->ancount++;
+}
+
+
+/*! Add the PTR record of a hosts entry to a zone transfer. This is called by
+ * hosts_foreach_since().
+ */
+static void xfer_ptr(void *p, const host_ent_t *h)
+{
+   char rr[IP6REVLEN + 10 + NS_MAXCDNAME];
+   int n, ttl;
+
+   // only the own names are published, entries learned from keepalives or
+   // configured locally would reveal the peers of this node
+   if (h->source != HSRC_SELF)
+      return;
+
+   oc_ip6_ptr((char*) &h->addr, rr);
+   if ((n = oc_name_dn(h->name, &rr[IP6REVLEN + 10], NS_MAXCDNAME)) == -1)
+      return;
+
+   if ((ttl = hosts_ttl(h)) < 0)
+      ttl = DNS_PTR_TTL;
+
+   *((uint16_t*) &rr[IP6REVLEN]) = htons(T_PTR);
+   *((uint16_t*) &rr[IP6REVLEN + 2]) = htons(C_IN);
+   *((uint32_t*) &rr[IP6REVLEN + 4]) = htonl(ttl);
+   *((uint16_t*) &rr[IP6REVLEN + 8]) = htons(n);
+   xfer_rr(p, rr, IP6REVLEN + 10 + n);
+   ((ocres_xfer_t*) p)->cnt++;
+}
+
+
+/*! This function processes a zone transfer request and constructs the
+ * transfer into x. AXFR (RFC5936) and IXFR (RFC1995) requests for the zone
+ * ip6.arpa are accepted. The transfer always is in AXFR format, i.e. it starts
+ * and ends with the SOA record. An IXFR transfer contains all entries which
+ * were changed after the serial of the SOA record in the request. Only
+ * entries of the own identities (HSRC_SELF) are transferred. Deletions
+ * are not transferred, deleted entries time out on the receiver.
+ * @param buf Pointer to the request. The header is modified.
+ * @param msglen Length of the request message.
+ * @param x Pointer to transfer structure which must be zeroed.
+ * @return Returns 0 if a reply was constructed, or -1 on error. In the
+ * latter case x->buf still may have to be freed.
+ */
+int oc_proc_xfer(char *buf, int msglen, ocres_xfer_t *x)
+{
+   char soa[NS_MAXCDNAME + 32];
+   const char *q, *a;
+   uint32_t serial = 0, cur;
+   int n, m, rdlen, soalen, zlen = 0, type = 0;
+   HEADER *dh;
+
+   // safety check
+   if (buf == NULL || msglen < (int) sizeof(*dh))
+      return -1;
+
+   dh = (HEADER*) buf;
+   q = (char*) (dh + 1);
+   x->hdr = buf;
+   x->hlen = sizeof(*dh);
+
+   if (dh->qr || dh->opcode != QUERY || dh->qdcount != htons(1) ||
+         (n = oc_dn_len(q, msglen - sizeof(*dh))) == -1 || (int) sizeof(*dh) + n + 4 > msglen)
+   {
+      log_msg(LOG_INFO, "transfer request format error");
+      dh->rcode = FORMERR;
+      dh->qdcount = 0;
+      goto px_reply;
+   }
+   zlen = n;
+   x->hlen += n + 4;
+   type = ntohs(*((uint16_t*) &q[n]));
+
+   if (type != T_AXFR && type != T_IXFR)
+   {
+      log_msg(LOG_INFO, "query type %d not implemented on TCP", type);
+      dh->rcode = NOTIMP;
+      goto px_reply;
+   }
+
+   if (*((uint16_t*) &q[n + 2]) != htons(C_IN) || strcasecmp(q, "\003ip6\004arpa"))
+   {
+      log_msg(LOG_INFO, "transfer of unknown zone refused");
+      dh->rcode = REFUSED;
+      goto px_reply;
+   }
+
+   // get serial of client from the authority section
+   if (type == T_IXFR && dh->nscount == htons(1))
+   {
+      a = q + n + 4;
+      m = msglen - x->hlen;
+      if ((n = oc_dn_len(a, m)) == -1 || n + 10 > m || *((uint16_t*) &a[n]) != htons(T_SOA) ||
+            (rdlen = ntohs(*((uint16_t*) &a[n + 8]))) > m - n - 10 || oc_soa_serial(&a[n + 10], rdlen, &serial) == -1)
+      {
+         log_msg(LOG_INFO, "IXFR request format error");
+         dh->rcode = FORMERR;
+         goto px_reply;
+      }
+   }
+
+   dh->rcode = NOERROR;
+
+px_reply:
+   dh->qr = 1;
+   dh->aa = 1;
+   dh->ra = 0;
+   dh->ad = 0;
+   dh->tc = 0;
+   dh->ancount = dh->nscount = dh->arcount = 0;
+
+   xfer_begin(x);
+   if (dh->rcode == NOERROR)
+   {
+      // the serial of the leading SOA is set after the entries were collected,
+      // it is followed by 4 other 32 bit values
+      soalen = oc_mk_soa(soa, q, zlen, 0);
+      xfer_rr(x, soa, soalen);
+      n = x->len - 20;
+      cur = hosts_foreach_since(serial, xfer_ptr, x);
+      if (!x->err)
+         *((uint32_t*) (x->buf + n)) = htonl(cur);
+      oc_mk_soa(soa, q, zlen, cur);
+      xfer_rr(x, soa, soalen);
+      log_msg(LOG_INFO, "%cXFR of %d entries, serial %u -> %u", type == T_IXFR ? 'I' : 'A', x->cnt, serial, cur);
+   }
+   xfer_end(x);
+
+   return x->err ? -1 : 0;
+}
+
+
+//! number of zone transfers in progress
+static int xfer_cnt_ = 0;
+
+
+/*! This thread serves a zone transfer on a TCP connection.
+ * @param p File descriptor of connection.
+ */
+static void *oc_ns_xfer(void *p)
+{
+   char buf[PACKETSZ];
+   ocres_xfer_t x;
+   int fd = (intptr_t) p, len;
+   uint16_t mlen;
+
+   detach_thread();
+   set_thread_ready();
+
+   oc_sock_timeout(fd, HOSTS_SYNC_TIMEOUT);
+   memset(&x, 0, sizeof(x));
+
+   if (oc_read_full(fd, (char*) &mlen, sizeof(mlen)) == -1)
+      goto nx_exit;
+   if ((len = ntohs(mlen)) > (int) sizeof(buf))
+   {
+      log_msg(LOG_WARNING, "transfer request too long: %d", len);
+      goto nx_exit;
+   }
+   if (oc_read_full(fd, buf, len) == -1)
+      goto nx_exit;
+
+   if (oc_proc_xfer(buf, len, &x) != -1)
+      (void) oc_write_full(fd, x.buf, x.len);
+
+nx_exit:
+   free(x.buf);
+   mem_release(MEM_RESOLV, x.size);
+   oe_close(fd);
+   __atomic_sub_fetch(&xfer_cnt_, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+
+/*! Accept a zone transfer connection and start a thread which serves it.
+ * @param lfd File descriptor of listening socket.
+ */
+static void oc_ns_accept(int lfd)
+{
+   char addr[INET6_ADDRSTRLEN];
+   struct sockaddr_in6 s6addr;
+   socklen_t slen = sizeof(s6addr);
+   int fd, source;
+
+   if ((fd = accept(lfd, (struct sockaddr*) &s6addr, &slen)) == -1)
+   {
+      log_msg(LOG_ERR, "accept() failed: %s", strerror(errno));
+      return;
+   }
+
+   // transfers are served only to nameservers which were configured in the
+   // hosts file or on the command line
+   if (hosts_get_name_ext(&s6addr.sin6_addr, NULL, 0, &source, NULL) == -1 ||
+         (source != HSRC_CLI && source != HSRC_HOSTS))
+   {
+      log_msg(LOG_INFO, "zone transfer to %s refused, not a configured nameserver",
+            inet_ntop(AF_INET6, &s6addr.sin6_addr, addr, sizeof(addr)));
+      oe_close(fd);
+      return;
+   }
+
+   if (__atomic_add_fetch(&xfer_cnt_, 1, __ATOMIC_RELAXED) > HOSTS_SYNC_MAX_XFER)
+   {
+      log_msg(LOG_WARNING, "too many zone transfers in progress, closing fd %d", fd);
+      __atomic_sub_fetch(&xfer_cnt_, 1, __ATOMIC_RELAXED);
+      oe_close(fd);
+      return;
+   }
+
+   if (run_ocat_thread("nsxfer", oc_ns_xfer, (void*) (intptr_t) fd))
+   {
+      __atomic_sub_fetch(&xfer_cnt_, 1, __ATOMIC_RELAXED);
+      oe_close(fd);
+   }
+}
+
+
+/*! This function creates a socket suitable to receive OnionCat DNS queries.
+ * @param port Port number.
+ * @param type SOCK_DGRAM for queries or SOCK_STREAM for zone transfers. A
+ * stream socket is set to listening state.
  * @return On success the function returns a valid filedescriptor. On error, -1
  * is returned.
  */
-int oc_ns_socket(int port)
+int oc_ns_socket(int port, int type)
 {
    struct sockaddr_in6 s6addr;
    socklen_t slen;
-   int fd;
+   int fd, on = 1;
 
-   // create UDP socket
-   if ((fd = socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
+   // create UDP or TCP socket
+   if ((fd = socket(AF_INET6, type, 0)) == -1)
    {
       log_msg(LOG_ERR, "could not create nameserver socket");
       return -1;
    }
    log_debug("created DNS socket on fd %d", fd);
 
+   if (type == SOCK_STREAM && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+      log_msg(LOG_WARNING, "could not set SO_REUSEADDR on fd %d: %s", fd, strerror(errno));
+
    // init sockaddr structure for socket address
    slen = sizeof(s6addr);
    memset(&s6addr, 0, slen);
@@ -630,6 +1145,13 @@ int oc_ns_socket(int port)
       return -1;
    }
 
+   if (type == SOCK_STREAM && listen(fd, HOSTS_SYNC_MAX_XFER) == -1)
+   {
+      log_msg(LOG_ERR, "could not listen on DNS socket: %s", strerror(errno));
+      oe_close(fd);
+      return -1;
+   }
+
    return fd;
 }
 
@@ -638,21 +1160,26 @@ int oc_ns_socket(int port)
  * one after the other, and processes the requests. If the requests are valid,
  * answers are sent dependent if the names in the queries are found in the
  * local DB, or not. In the latter case NXDOMAIN is replied.
+ * If hosts synchronisation is enabled (option -z), zone transfers are accepted
+ * on the TCP port of the nameserver and served by separate threads.
  */
 void *oc_nameserver(void *p)
 {
    struct sockaddr_str ssaddr;
    struct sockaddr_in6 s6addr;
    char buf[PACKETSZ + 1];
-   int fd = -1, len, n;
+   int fd = -1, tfd = -1, maxfd, len, n;
    socklen_t slen;
    fd_set rset;
 
    detach_thread();
 
-   if ((fd = oc_ns_socket((intptr_t) p)) == -1)
+   if ((fd = oc_ns_socket((intptr_t) p, SOCK_DGRAM)) == -1)
       return NULL;
 
+   if (CNF(hosts_sync) && (intptr_t) p == CNF(ocat_ns_port))
+      tfd = oc_ns_socket((intptr_t) p, SOCK_STREAM);
+
    set_thread_ready();
 
    // loop over connections
@@ -664,12 +1191,21 @@ void *oc_nameserver(void *p)
 
       FD_ZERO(&rset);
       FD_SET(fd, &rset);
-      if ((n = oc_select(fd + 1, &rset, NULL, NULL)) == -1)
+      maxfd = fd;
+      if (tfd != -1)
+         MFD_SET(tfd, &rset, maxfd);
+      if ((n = oc_select(maxfd + 1, &rset, NULL, NULL)) == -1)
          continue;
 
       if (!n)
          continue;
 
+      if (tfd != -1 && FD_ISSET(tfd, &rset))
+         oc_ns_accept(tfd);
+
+      if (!FD_ISSET(fd, &rset))
+         continue;
+
       slen = sizeof(s6addr);
       if ((len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*) &s6addr, &slen)) == -1)
       {
@@ -699,6 +1235,8 @@ void *oc_nameserver(void *p)
       log_msg(LOG_INFO, "DNS reply sent to %s", ssaddr.sstr_addr);
    }
 
+   if (tfd != -1)
+      oe_close(tfd);
    oe_close(fd);
    return NULL;
 }
@@ -773,9 +1311,15 @@ int ocres_query_callback(const struct in6_addr *addr, void (callback)(void *, st
    ocres_state_t *orstate;
    int i, n, on, ret;
 
+   if (mem_charge(MEM_RESOLV, sizeof(*orstate)) == -1)
+   {
+      log_msg(LOG_WARNING, "memory limit reached, query not sent");
+      return -1;
+   }
    if ((orstate = malloc(sizeof(*orstate))) == NULL)
    {
       log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
+      mem_release(MEM_RESOLV, sizeof(*orstate));
       return -1;
    }
 
@@ -786,6 +1330,7 @@ int ocres_query_callback(const struct in6_addr *addr, void (callback)(void *, st
    if ((orstate->fd = socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
    {
       log_msg(LOG_ERR, "could not create resolver socket: %s", strerror(errno));
+      mem_release(MEM_RESOLV, sizeof(*orstate));
       free(orstate);
       return -1;
    }
@@ -801,6 +1346,7 @@ int ocres_query_callback(const struct in6_addr *addr, void (callback)(void *, st
       {
          log_msg(LOG_ERR, "no nameservers available");
          oe_close(orstate->fd);
+         mem_release(MEM_RESOLV, sizeof(*orstate));
          free(orstate);
          return 0;
       }
@@ -871,6 +1417,7 @@ static void ocres_cleanup(ocres_state_t **osp)
          orstate = *osp;
          *osp = (*osp)->next;
          oe_close(orstate->fd);
+         mem_release(MEM_RESOLV, sizeof(*orstate));
          free(orstate);
          continue;
       }
@@ -1030,4 +1577,268 @@ void *oc_resolver(void *UNUSED(p))
 
    return NULL;
 }
+
+
+/*! This function processes a message of an incoming zone transfer and adds
+ * the PTR records to the hosts db.
+ * @param buf Pointer to the message.
+ * @param msglen Length of the message.
+ * @param id Id of the request.
+ * @param s Pointer to transfer state.
+ * @return Returns 0 on success or a negative value (OCRES_Exxx) on error.
+ */
+static int oc_proc_xfer_response(const char *buf, int msglen, uint16_t id, ocres_sync_t *s)
+{
+   char name[SIZE_256];
+   struct in6_addr in6;
+   const char *p;
+   uint32_t serial, ttl;
+   int i, n, rem, type, rdlen;
+   HEADER *dh;
+
+   if (msglen < (int) sizeof(*dh))
+      return OCRES_EFORMAT;
+
+   dh = (HEADER*) buf;
+   p = (char*) (dh + 1);
+   rem = msglen - sizeof(*dh);
+
+   if (dh->id != id)
+   {
+      log_msg(LOG_ERR, "DNS response id does not match request");
+      return OCRES_EID;
+   }
+
+   if (!dh->qr || dh->opcode != QUERY || ntohs(dh->qdcount) > 1)
+   {
+      log_msg(LOG_ERR, "DNS response format error");
+      return OCRES_EFORMAT;
+   }
+
+   if (dh->rcode != NOERROR)
+   {
+      log_msg(LOG_INFO, "zone transfer refused: %d", dh->rcode);
+      return OCRES_ERCODE;
+   }
+
+   // skip question
+   if (dh->qdcount)
+   {
+      if ((n = oc_dn_len(p, rem)) == -1 || n + 4 > rem)
+         return OCRES_EFORMAT;
+      p += n + 4;
+      rem -= n + 4;
+   }
+
+   for (i = ntohs(dh->ancount); i > 0 && s->soa < 2; i--)
+   {
+      if ((n = oc_dn_len(p, rem)) == -1 || n + 10 > rem)
+         return OCRES_EFORMAT;
+      type = ntohs(*((uint16_t*) &p[n]));
+      if ((rdlen = ntohs(*((uint16_t*) &p[n + 8]))) > rem - n - 10)
+         return OCRES_EFORMAT;
+
+      if (type == T_SOA)
+      {
+         if (oc_soa_serial(&p[n + 10], rdlen, &serial) == -1)
+            return OCRES_EFORMAT;
+         if (!s->soa++)
+            s->serial = serial;
+      }
+      else if (type == T_PTR && s->soa == 1)
+      {
+         // a remote TTL must neither be negative (never expire) nor keep the
+         // entry longer than a keepalive would
+         if ((ttl = ntohl(*((uint32_t*) &p[n + 4]))) > HOSTS_KPLV_TTL)
+            ttl = HOSTS_KPLV_TTL;
+         if (n == IP6REVLEN && oc_rev6ptr_addr(p, (char*) &in6) != -1 &&
+               oc_dn_name(buf, msglen, &p[n + 10], name, sizeof(name)) != -1 &&
+               hosts_add_entry(&in6, name, HSRC_NET, time(NULL), ttl) != -1)
+            s->cnt++;
+      }
+
+      p += n + 10 + rdlen;
+      rem -= n + 10 + rdlen;
+   }
+
+   return 0;
+}
+
+
+/*! Do a zone transfer from a nameserver. An IXFR is requested if the serial
+ * of a previous transfer is known, otherwise an AXFR.
+ * @param ns Pointer to the address of the nameserver.
+ * @param serial Pointer to the serial of the last transfer from this
+ * nameserver or 0. It is updated on success.
+ * @return Returns the number of hosts entries which were added or updated, or
+ * -1 on error.
+ */
+static int oc_sync_ns(const struct in6_addr *ns, uint32_t *serial)
+{
+   char addr[INET6_ADDRSTRLEN], req[PACKETSZ], *buf;
+   struct sockaddr_in6 s6addr;
+   ocres_sync_t s;
+   uint16_t mlen, id;
+   HEADER *dh;
+   int fd, len, ret = -1;
+
+   inet_ntop(AF_INET6, ns, addr, sizeof(addr));
+   log_msg(LOG_INFO, "starting %cXFR from %s, serial %u", *serial ? 'I' : 'A', addr, *serial);
+
+   // create request
+   dh = (HEADER*) (req + 2);
+   memset(dh, 0, sizeof(*dh));
+   dh->id = id = rand() & 0xffff;
+   dh->qdcount = htons(1);
+   len = sizeof(*dh);
+   memcpy(req + 2 + len, "\003ip6\004arpa", 10);
+   len += 10;
+   *((uint16_t*) (req + 2 + len)) = htons(*serial ? T_IXFR : T_AXFR);
+   *((uint16_t*) (req + 4 + len)) = htons(C_IN);
+   len += 4;
+   if (*serial)
+   {
+      dh->nscount = htons(1);
+      len += oc_mk_soa(req + 2 + len, "\003ip6\004arpa", 10, *serial);
+   }
+   *((uint16_t*) req) = htons(len);
+
+   if (mem_charge(MEM_RESOLV, 0xffff) == -1)
+   {
+      log_msg(LOG_WARNING, "memory limit reached, zone transfer not started");
+      return -1;
+   }
+   if ((buf = malloc(0xffff)) == NULL)
+   {
+      log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
+      mem_release(MEM_RESOLV, 0xffff);
+      return -1;
+   }
+
+   if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) == -1)
+   {
+      log_msg(LOG_ERR, "could not create socket: %s", strerror(errno));
+      goto sn_exit;
+   }
+   oc_sock_timeout(fd, HOSTS_SYNC_TIMEOUT);
+
+   memset(&s6addr, 0, sizeof(s6addr));
+   s6addr.sin6_family = AF_INET6;
+#ifdef HAVE_SIN_LEN
+   s6addr.sin6_len = sizeof(s6addr);
+#endif
+   s6addr.sin6_port = htons(CNF(ocat_ns_port));
+   IN6_ADDR_COPY(&s6addr.sin6_addr, ns);
+
+   // connect may take a while because the peer has to be connected by Tor
+   set_thread_wait(time(NULL) + HOSTS_SYNC_TIMEOUT);
+   if (connect(fd, (struct sockaddr*) &s6addr, sizeof(s6addr)) == -1)
+   {
+      log_msg(LOG_INFO, "connect() to %s failed: %s", addr, strerror(errno));
+      goto sn_close;
+   }
+
+   if (oc_write_full(fd, req, len + 2) == -1)
+      goto sn_close;
+
+   memset(&s, 0, sizeof(s));
+   while (s.soa < 2)
+   {
+      if (oc_read_full(fd, (char*) &mlen, sizeof(mlen)) == -1 || oc_read_full(fd, buf, ntohs(mlen)) == -1)
+         goto sn_close;
+      if (oc_proc_xfer_response(buf, ntohs(mlen), id, &s))
+         goto sn_close;
+   }
+
+   log_msg(LOG_NOTICE, "received %d hosts entries from %s, serial %u", s.cnt, addr, s.serial);
+   *serial = s.serial;
+   ret = s.cnt;
+
+sn_close:
+   oe_close(fd);
+sn_exit:
+   free(buf);
+   mem_release(MEM_RESOLV, 0xffff);
+   return ret;
+}
+
+
+//! serial numbers of the last zone transfers from the nameservers
+static struct
+{
+   struct in6_addr addr;
+   uint32_t serial;
+} sync_serial_[MAX_NS];
+//! set while a synchronisation is in progress
+static int syncing_ = 0;
+
+
+/*! Return pointer to the serial of the last zone transfer from a nameserver.
+ * If the nameserver is not found, the oldest slot is reused.
+ */
+static uint32_t *oc_sync_serial(const struct in6_addr *ns)
+{
+   static int next = 0;
+   int i;
+
+   for (i = 0; i < MAX_NS; i++)
+      if (IN6_ARE_ADDR_EQUAL(&sync_serial_[i].addr, ns))
+         return &sync_serial_[i].serial;
+
+   i = next;
+   next = (next + 1) % MAX_NS;
+   IN6_ADDR_COPY(&sync_serial_[i].addr, ns);
+   sync_serial_[i].serial = 0;
+   return &sync_serial_[i].serial;
+}
+
+
+/*! This thread synchronises the hosts db with the best nameserver. If the
+ * transfer fails, the next nameserver is tried.
+ */
+static void *hosts_syncer(void *UNUSED(p))
+{
+   struct in6_addr ns;
+   hsrc_t src;
+   int i, n, on, ret;
+
+   detach_thread();
+   set_thread_ready();
+
+   for (i = 0, n = 0; !term_req(); i++)
+   {
+      on = n;
+      if ((ret = hosts_get_ns_rr_metric(&ns, &src, &n)) == -1)
+      {
+         log_msg(LOG_INFO, "no nameservers available for hosts synchronisation");
+         break;
+      }
+
+      // check if round robin list repeated
+      if (i && ret <= on)
+         break;
+
+      if (oc_sync_ns(&ns, oc_sync_serial(&ns)) != -1)
+         break;
+   }
+
+   __atomic_store_n(&syncing_, 0, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+
+/*! Start the synchronisation of the hosts db with the nameservers in the
+ * background unless it is already running.
+ */
+void ocres_sync(void)
+{
+   if (__atomic_exchange_n(&syncing_, 1, __ATOMIC_ACQ_REL))
+   {
+      log_debug("hosts synchronisation already running");
+      return;
+   }
+
+   if (run_ocat_thread("hostsync", hosts_syncer, NULL))
+      __atomic_store_n(&syncing_, 0, __ATOMIC_RELEASE);
+}
 #endif
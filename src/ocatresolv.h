@@ -40,6 +40,18 @@
 #define DNS_MAX_RETRY 5
 #define DNS_RETRY_TIMEOUT 5
 #define MAX_CONCURRENT_Q 5
+//! TTL of PTR answers of entries which do not expire
+#define DNS_PTR_TTL 3600
+//! TTL of AAAA answers of calculated addresses or entries which do not expire
+#define DNS_AAAA_TTL 3600
+//! interval of bulk hosts synchronisation with nameservers
+#define HOSTS_SYNC_TIME 1800
+//! timeout of network operations of a zone transfer
+#define HOSTS_SYNC_TIMEOUT 60
+//! maximum number of concurrently served zone transfers
+#define HOSTS_SYNC_MAX_XFER 4
+//! maximum length of a DNS message within a zone transfer
+#define XFR_MSG_SIZE 16384
 
 /*! resolver error codes */
 //! error in function parameters
@@ -79,6 +91,28 @@ typedef struct ocres_state
    char msg[PACKETSZ];
 } ocres_state_t;
 
+//! outgoing zone transfer
+typedef struct ocres_xfer
+{
+   char *buf;           //!< DNS messages, each prefixed by its length
+   int len;             //!< number of bytes in buf
+   int size;            //!< size of buf
+   int msg;             //!< offset of current message in buf
+   int ancount;         //!< number of answers in current message
+   const char *hdr;     //!< header and question which start each message
+   int hlen;            //!< length of hdr
+   int cnt;             //!< total number of PTR records
+   int err;             //!< set if an error occurred
+} ocres_xfer_t;
+
+//! state of an incoming zone transfer
+typedef struct ocres_sync
+{
+   int soa;             //!< number of SOA records received
+   uint32_t serial;     //!< serial of the first SOA record
+   int cnt;             //!< number of hosts entries added
+} ocres_sync_t;
+
 
 int oc_mk_ptrquery(const char *, char *, int, uint16_t);
 int oc_proc_response(const char *, int , uint16_t , const struct in6_addr *, hsrc_t );
@@ -86,6 +120,8 @@ void *oc_nameserver(void *);
 void *oc_resolver(void *);
 int ocres_query_callback(const struct in6_addr *, void (*)(void *, struct in6_addr, int), void *);
 int ocres_query(const struct in6_addr *);
+int oc_proc_xfer(char *, int, ocres_xfer_t *);
+void ocres_sync(void);
 
 
 #endif
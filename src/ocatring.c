@@ -0,0 +1,475 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatring.c
+ *  This file contains the shared memory packet ring interface. Local
+ *  applications connect to a UNIX socket and receive a shared memory segment
+ *  with two lock-free single-producer/single-consumer rings. See ocatlib.h
+ *  for a description of the layout.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/05/18
+ */
+
+
+// memfd_create() is a GNU extension
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "ocat.h"
+#include "ocatlib.h"
+
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+
+#define MAX_RING_CLIENTS 4
+
+
+typedef struct RingClient
+{
+   int fd;              //!< UNIX socket of client
+   char *base;          //!< shared memory segment
+   size_t size;         //!< size of segment
+   ocat_ring_t *tx;     //!< ring application -> OnionCat
+   ocat_ring_t *rx;     //!< ring OnionCat -> application
+   int drop;            //!< number of packets dropped because rx ring was full
+} RingClient_t;
+
+
+static RingClient_t ring_cl_[MAX_RING_CLIENTS];
+static int ring_cl_cnt_ = 0;
+//! protects ring_cl_, it is changed only by the ring_server() thread
+static pthread_mutex_t ring_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*! Get the size of the slots. A slot takes the largest packet allowed by
+ * the MTU of the tunnel device, rounded up to a cache line, but it is at
+ * least OCAT_RING_SLOT_SIZE bytes.
+ * @return Size of slot including the length field.
+ */
+static uint32_t ring_slot_size(void)
+{
+   uint32_t size = (CNF(frame_size) - FRAME_HDR_LEN + sizeof(uint32_t) + 63) & ~63;
+
+   return size < OCAT_RING_SLOT_SIZE ? OCAT_RING_SLOT_SIZE : size;
+}
+
+
+/*! Get pointer to slot. The geometry is always the one of OnionCat and never
+ * read from shared memory because the application could modify it.
+ */
+static char *ring_slot(ocat_ring_t *r, uint32_t n)
+{
+   return (char*) (r + 1) + (n & (OCAT_RING_SLOTS - 1)) * ring_slot_size();
+}
+
+
+static int ring_put0(ocat_ring_t *r, uint32_t slots, uint32_t slot_size, const char *buf, int len)
+{
+   uint32_t head, tail, n;
+   char *slot;
+
+   if (len < 0 || len > (int) (slot_size - sizeof(uint32_t)))
+      return -1;
+
+   head = r->head;
+   tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   if ((n = head - tail) >= slots)
+      return -1;
+
+   slot = (char*) (r + 1) + (head & (slots - 1)) * slot_size;
+   *((uint32_t*) slot) = len;
+   memcpy(slot + sizeof(uint32_t), buf, len);
+   __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+   // Re-read tail after publishing head. Together with the fence of the
+   // consumer this guarantees that either the consumer sees the new packet
+   // or the producer sees the ring empty and wakes up the consumer.
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   return head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+
+/*! Put a packet into a ring. This function must only be called by the
+ * producer of the ring.
+ * @param r Pointer to ring.
+ * @param buf Pointer to packet.
+ * @param len Length of packet.
+ * @return Returns the number of packets which were in the ring before, i.e.
+ * 0 means that the consumer has to be woken up. If the ring is full or the
+ * packet is too large -1 is returned.
+ */
+int ocat_ring_put(ocat_ring_t *r, const char *buf, int len)
+{
+   return ring_put0(r, r->slots, r->slot_size, buf, len);
+}
+
+
+/*! Get a packet from a ring. This function must only be called by the
+ * consumer of the ring.
+ * @param r Pointer to ring.
+ * @param buf Pointer to destination buffer.
+ * @param len Size of destination buffer.
+ * @return Returns the length of the packet or -1 if the ring is empty. If the
+ * packet is larger than len it is truncated.
+ */
+int ocat_ring_get(ocat_ring_t *r, char *buf, int len)
+{
+   uint32_t tail, plen;
+   char *slot;
+
+   tail = r->tail;
+   if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+      return -1;
+
+   slot = (char*) (r + 1) + (tail & (r->slots - 1)) * r->slot_size;
+   plen = *((uint32_t*) slot);
+   if (plen > r->slot_size - sizeof(uint32_t))
+      plen = r->slot_size - sizeof(uint32_t);
+   memcpy(buf, slot + sizeof(uint32_t), (int) plen < len ? (int) plen : len);
+   __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+   // pairs with the fence in ring_put0()
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   return plen;
+}
+
+
+/*! Create an anonymous shared memory file.
+ * @return File descriptor or -1 on error.
+ */
+static int ring_shm_open(size_t size)
+{
+   int fd;
+#ifndef HAVE_MEMFD_CREATE
+   char path[] = "/tmp/ocatringXXXXXX";
+#endif
+
+#ifdef HAVE_MEMFD_CREATE
+   if ((fd = memfd_create("ocatring", 0)) == -1)
+   {
+      log_msg(LOG_ERR, "memfd_create() failed: \"%s\"", strerror(errno));
+      return -1;
+   }
+#else
+   if ((fd = mkstemp(path)) == -1)
+   {
+      log_msg(LOG_ERR, "could not create shm file: \"%s\"", strerror(errno));
+      return -1;
+   }
+   (void) unlink(path);
+#endif
+
+   if (ftruncate(fd, size) == -1)
+   {
+      log_msg(LOG_ERR, "could not set size of shm file: \"%s\"", strerror(errno));
+      oe_close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+
+/*! Send the shared memory file descriptor together with the ring info to
+ * the client.
+ * @return 0 on success, -1 on error.
+ */
+static int ring_send_fd(int fd, int shmfd, ocat_ring_info_t *ri)
+{
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cmsg;
+   char cbuf[CMSG_SPACE(sizeof(int))];
+
+   memset(&msg, 0, sizeof(msg));
+   memset(cbuf, 0, sizeof(cbuf));
+   iov.iov_base = ri;
+   iov.iov_len = sizeof(*ri);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof(cbuf);
+
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+   memcpy(CMSG_DATA(cmsg), &shmfd, sizeof(int));
+
+   if (sendmsg(fd, &msg, 0) == -1)
+   {
+      log_msg(LOG_ERR, "could not send ring info to client %d: \"%s\"", fd, strerror(errno));
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/*! Setup shared memory rings for a newly connected client.
+ * @param fd File descriptor of UNIX socket.
+ * @return 0 on success, -1 on error.
+ */
+static int ring_add_client(int fd)
+{
+   ocat_ring_info_t ri;
+   RingClient_t rc;
+   int shmfd;
+
+   if (ring_cl_cnt_ >= MAX_RING_CLIENTS)
+   {
+      log_msg(LOG_WARNING, "maximum number of ring clients (%d) reached", MAX_RING_CLIENTS);
+      return -1;
+   }
+
+   memset(&rc, 0, sizeof(rc));
+   rc.fd = fd;
+   rc.size = 2 * (sizeof(ocat_ring_t) + OCAT_RING_SLOTS * ring_slot_size());
+
+   if ((shmfd = ring_shm_open(rc.size)) == -1)
+      return -1;
+
+   if ((rc.base = mmap(NULL, rc.size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0)) == MAP_FAILED)
+   {
+      log_msg(LOG_ERR, "mmap() failed: \"%s\"", strerror(errno));
+      oe_close(shmfd);
+      return -1;
+   }
+
+   memset(&ri, 0, sizeof(ri));
+   ri.magic = OCAT_RING_MAGIC;
+   ri.version = OCAT_RING_VERSION;
+   ri.size = rc.size;
+   ri.tx_off = 0;
+   ri.rx_off = rc.size / 2;
+
+   rc.tx = (ocat_ring_t*) (rc.base + ri.tx_off);
+   rc.rx = (ocat_ring_t*) (rc.base + ri.rx_off);
+   rc.tx->slots = rc.rx->slots = OCAT_RING_SLOTS;
+   rc.tx->slot_size = rc.rx->slot_size = ring_slot_size();
+
+   if (ring_send_fd(fd, shmfd, &ri) == -1)
+   {
+      munmap(rc.base, rc.size);
+      oe_close(shmfd);
+      return -1;
+   }
+   // the mapping stays valid after closing the file
+   oe_close(shmfd);
+   set_nonblock(fd);
+
+   pthread_mutex_lock(&ring_mutex_);
+   ring_cl_[ring_cl_cnt_] = rc;
+   __atomic_store_n(&ring_cl_cnt_, ring_cl_cnt_ + 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&ring_mutex_);
+
+   log_msg(LOG_INFO, "ring client %d attached, %d kB shared memory", fd, (int) rc.size / 1024);
+   return 0;
+}
+
+
+static void ring_del_client(int n)
+{
+   RingClient_t rc;
+
+   pthread_mutex_lock(&ring_mutex_);
+   rc = ring_cl_[n];
+   ring_cl_[n] = ring_cl_[ring_cl_cnt_ - 1];
+   __atomic_store_n(&ring_cl_cnt_, ring_cl_cnt_ - 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&ring_mutex_);
+
+   log_msg(LOG_INFO, "ring client %d detached, %d packets dropped", rc.fd, rc.drop);
+   munmap(rc.base, rc.size);
+   oe_close(rc.fd);
+}
+
+
+/*! Forward all packets of the tx ring of a client. */
+static void ring_drain(RingClient_t *rc)
+{
+   uint32_t tail, len;
+   char *slot;
+
+   while ((tail = rc->tx->tail) != __atomic_load_n(&rc->tx->head, __ATOMIC_ACQUIRE))
+   {
+      slot = ring_slot(rc->tx, tail);
+      len = *((uint32_t*) slot);
+      if (len <= ring_slot_size() - sizeof(uint32_t))
+         (void) ocat_lib_inject(slot + sizeof(uint32_t), len);
+      else
+         log_msg(LOG_WARNING, "illegal packet length %u in ring of client %d", len, rc->fd);
+      __atomic_store_n(&rc->tx->tail, tail + 1, __ATOMIC_RELEASE);
+      // pairs with the fence in ring_put0()
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   }
+}
+
+
+/*! Deliver an incoming packet to all attached ring clients. This function
+ * is called by the socket_receiver() which is the only producer of the rx
+ * rings.
+ * @return 0 if the packet was delivered to at least one client, -1
+ * otherwise.
+ */
+int ring_deliver_packet(const char *buf, int len)
+{
+   int i, n, r = -1;
+
+   // unlocked check of the common case without clients, it is only changed
+   // by the ring_server() thread while it holds the lock
+   if (!__atomic_load_n(&ring_cl_cnt_, __ATOMIC_RELAXED))
+      return -1;
+
+   pthread_mutex_lock(&ring_mutex_);
+   for (i = 0; i < ring_cl_cnt_; i++)
+   {
+      if ((n = ring_put0(ring_cl_[i].rx, OCAT_RING_SLOTS, ring_slot_size(), buf, len)) == -1)
+      {
+         log_debug("rx ring of client %d full, dropping packet of %d bytes", ring_cl_[i].fd, len);
+         ring_cl_[i].drop++;
+         continue;
+      }
+      r = 0;
+      // wakeup client if ring was empty
+      if (!n && send(ring_cl_[i].fd, "", 1, MSG_DONTWAIT) == -1 && errno != EAGAIN)
+      {
+         log_debug("could not wakeup ring client %d: \"%s\"", ring_cl_[i].fd, strerror(errno));
+      }
+   }
+   pthread_mutex_unlock(&ring_mutex_);
+
+   return r;
+}
+
+
+/*! Print ring clients to file descriptor. */
+void print_ring_clients(int fd)
+{
+   int i;
+
+   pthread_mutex_lock(&ring_mutex_);
+   for (i = 0; i < ring_cl_cnt_; i++)
+      dprintf(fd, "ring client fd = %d, tx = %u/%u, rx = %u/%u, drop = %d\n", ring_cl_[i].fd,
+            ring_cl_[i].tx->head - ring_cl_[i].tx->tail, OCAT_RING_SLOTS,
+            ring_cl_[i].rx->head - ring_cl_[i].rx->tail, OCAT_RING_SLOTS, ring_cl_[i].drop);
+   pthread_mutex_unlock(&ring_mutex_);
+}
+
+
+/*! The ring server thread accepts connections of ring clients on the UNIX
+ * socket CNF(ring_path) and forwards the packets of their tx rings.
+ */
+void *ring_server(void *UNUSED(p))
+{
+   struct sockaddr_un sun;
+   int lfd, fd, maxfd, i, len;
+   fd_set rset;
+   char buf[64];
+
+   if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+   {
+      log_msg(LOG_ERR, "could not create UNIX socket: \"%s\"", strerror(errno));
+      return NULL;
+   }
+
+   memset(&sun, 0, sizeof(sun));
+   sun.sun_family = AF_UNIX;
+   strlcpy(sun.sun_path, CNF(ring_path), sizeof(sun.sun_path));
+   (void) unlink(CNF(ring_path));
+
+   if (bind(lfd, (struct sockaddr*) &sun, sizeof(sun)) == -1)
+   {
+      log_msg(LOG_ERR, "could not bind UNIX socket to \"%s\": \"%s\"", CNF(ring_path), strerror(errno));
+      oe_close(lfd);
+      return NULL;
+   }
+
+   // clients may inject packets, thus restrict access to the own user
+   // before connections are accepted
+   if (chmod(CNF(ring_path), S_IRUSR | S_IWUSR) == -1)
+   {
+      log_msg(LOG_ERR, "could not chmod \"%s\": \"%s\"", CNF(ring_path), strerror(errno));
+      oe_close(lfd);
+      (void) unlink(CNF(ring_path));
+      return NULL;
+   }
+
+   if (listen(lfd, MAX_RING_CLIENTS) == -1)
+   {
+      log_msg(LOG_ERR, "could not listen on UNIX socket: \"%s\"", strerror(errno));
+      oe_close(lfd);
+      return NULL;
+   }
+
+   log_msg(LOG_INFO, "ring server listening on \"%s\"", CNF(ring_path));
+
+   for (;;)
+   {
+      update_thread_activity();
+      if (term_req())
+         break;
+
+      FD_ZERO(&rset);
+      FD_SET(lfd, &rset);
+      maxfd = lfd;
+      for (i = 0; i < ring_cl_cnt_; i++)
+         MFD_SET(ring_cl_[i].fd, &rset, maxfd);
+
+      if ((maxfd = oc_select(maxfd + 1, &rset, NULL, NULL)) == -1)
+         continue;
+
+      for (i = 0; i < ring_cl_cnt_; i++)
+      {
+         if (FD_ISSET(ring_cl_[i].fd, &rset))
+         {
+            // consume wakeup bytes, EOF or an error means that client has gone
+            if (!(len = read(ring_cl_[i].fd, buf, sizeof(buf))) || (len == -1 && errno != EAGAIN && errno != EINTR))
+            {
+               ring_del_client(i--);
+               continue;
+            }
+            ring_drain(&ring_cl_[i]);
+         }
+      }
+
+      if (FD_ISSET(lfd, &rset))
+      {
+         if ((fd = accept(lfd, NULL, NULL)) == -1)
+         {
+            log_msg(LOG_ERR, "could not accept ring client: \"%s\"", strerror(errno));
+            continue;
+         }
+         if (ring_add_client(fd) == -1)
+            oe_close(fd);
+      }
+   }
+
+   while (ring_cl_cnt_)
+      ring_del_client(0);
+   oe_close(lfd);
+   (void) unlink(CNF(ring_path));
+
+   return NULL;
+}
+
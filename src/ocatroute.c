@@ -27,6 +27,7 @@
 #include "ocat.h"
 #include "ocat_netdesc.h"
 #include "ocathosts.h"
+#include "ocatresolv.h"
 
 #ifdef HAVE_STRUCT_IPHDR
 #define IPPKTLEN(x) ntohs(((struct iphdr*) (x))->tot_len)
@@ -36,9 +37,33 @@
 #define IPHDLEN sizeof(struct ip)
 #endif
 
-// file descriptors of socket_receiver pipe
+// wakeup notifier of socket_receiver
 // used for internal communication
-static int lpfd_[2];
+static OcatNotify_t recv_notify_ = {{-1, -1}, 0};
+// queue and wakeup notifier of tun_writer
+static OcatMpscNode_t *tun_inbox_ = NULL;
+static OcatNotify_t tun_notify_ = {{-1, -1}, 0};
+// wakeup notifier of socket_acceptor, signalled if listeners changed
+static OcatNotify_t listen_notify_ = {{-1, -1}, 0};
+// pending list of listeners, protected by lock_setup()
+static struct sockaddr **listen_new_ = NULL;
+static int listen_new_cnt_ = 0;
+static int acceptor_running_ = 0;
+
+//! number of slots of the table of last receive times, must be a power of 2
+#define HEARD_SLOTS 256
+//! number of consecutive slots searched for an address
+#define HEARD_PROBE 8
+
+//! time of the last receive from a remote address on any of its connections
+typedef struct OcatHeard
+{
+   struct in6_addr addr;
+   time_t t;
+} OcatHeard_t;
+
+static OcatHeard_t heard_[HEARD_SLOTS];
+static pthread_mutex_t heard_mutex_ = PTHREAD_MUTEX_INITIALIZER;
 
 #ifdef PACKET_QUEUE
 // packet queue pointer
@@ -49,6 +74,47 @@ static pthread_cond_t queue_cond_ = PTHREAD_COND_INITIALIZER;
 #endif
 
 
+static unsigned heard_hash(const struct in6_addr *addr)
+{
+   uint32_t a;
+
+   // the lower bits are derived from the onion name and thus random
+   memcpy(&a, &addr->s6_addr[12], sizeof(a));
+   return a;
+}
+
+
+/*! Record that data was received from a remote address. If all slots within
+ * the probe window are used by other addresses, the oldest one is replaced.
+ * @param addr Pointer to remote address.
+ * @param t Time of receive.
+ */
+static void heard_update(const struct in6_addr *addr, time_t t)
+{
+   OcatHeard_t *h, *victim = NULL;
+   unsigned i, n;
+
+   if (IN6_IS_ADDR_UNSPECIFIED(addr))
+      return;
+
+   pthread_mutex_lock(&heard_mutex_);
+   for (i = 0, n = heard_hash(addr); i < HEARD_PROBE; i++)
+   {
+      h = &heard_[(n + i) & (HEARD_SLOTS - 1)];
+      if (IN6_ARE_ADDR_EQUAL(&h->addr, addr))
+      {
+         victim = h;
+         break;
+      }
+      if (victim == NULL || h->t < victim->t)
+         victim = h;
+   }
+   IN6_ADDR_COPY(&victim->addr, addr);
+   victim->t = t;
+   pthread_mutex_unlock(&heard_mutex_);
+}
+
+
 int forward_packet(const struct in6_addr *addr, const char *buf, int buflen)
 {
    OcatPeer_t *peer;
@@ -67,6 +133,11 @@ int forward_packet(const struct in6_addr *addr, const char *buf, int buflen)
 
    log_debug("forwarding %d bytes to TCP fd %d", buflen, peer->tcpfd);
 
+   // bind outgoing connection to local identity on first IPv6 packet
+   if (CNF(ident_cnt) && IN6_IS_ADDR_UNSPECIFIED(&peer->laddr) && buflen >= (int) IP6HLEN && (*buf & 0xf0) == 0x60
+         && get_ident(&((struct ip6_hdr*) buf)->ip6_src) != NULL)
+      IN6_ADDR_COPY(&peer->laddr, &((struct ip6_hdr*) buf)->ip6_src);
+
    if ((len = send(peer->tcpfd, buf, buflen, MSG_DONTWAIT)) == -1)
    {
       log_msg(LOG_ERR, "could not write %d bytes to peer %d: \"%s\", dropping", buflen, peer->tcpfd, strerror(errno));
@@ -88,15 +159,52 @@ int forward_packet(const struct in6_addr *addr, const char *buf, int buflen)
 
 
 #ifdef PACKET_QUEUE
-void queue_packet(const struct in6_addr *addr, const char *buf, int buflen)
+/*! Remove the oldest packet from the packet queue.
+ * @return 0 if a packet was removed, -1 if the queue is empty.
+ */
+static int drop_oldest_packet(void)
+{
+   PacketQueue_t **queue, *fqueue;
+
+   pthread_mutex_lock(&queue_mutex_);
+   for (queue = &queue_; *queue && (*queue)->next; queue = &(*queue)->next);
+   if ((fqueue = *queue) != NULL)
+      *queue = NULL;
+   pthread_mutex_unlock(&queue_mutex_);
+
+   if (fqueue == NULL)
+      return -1;
+
+   mem_release(MEM_PKTQ, sizeof(PacketQueue_t) + fqueue->psize);
+   free(fqueue);
+   return 0;
+}
+
+
+/*! Add a packet to the packet queue.
+ * @return 0 if the packet was queued, -1 if it was dropped.
+ */
+int queue_packet(const struct in6_addr *addr, const char *buf, int buflen)
 {
    PacketQueue_t *queue;
 
+   // make room by dropping the oldest packets if memory limit is reached
+   while (mem_charge(MEM_PKTQ, sizeof(PacketQueue_t) + buflen) == -1)
+   {
+      if (drop_oldest_packet() == -1)
+      {
+         log_msg(LOG_WARNING, "memory limit reached, dropping packet");
+         return -1;
+      }
+      log_debug("memory limit reached, dropped oldest packet from queue");
+   }
+
    log_debug("copying packet to heap for queue");
    if (!(queue = malloc(sizeof(PacketQueue_t) + buflen)))
    {
       log_msg(LOG_ERR, "%s for packet to queue", strerror(errno));
-      return;
+      mem_release(MEM_PKTQ, sizeof(PacketQueue_t) + buflen);
+      return -1;
    }
 
    //memcpy(&queue->addr, addr, sizeof(struct in6_addr));
@@ -113,36 +221,92 @@ void queue_packet(const struct in6_addr *addr, const char *buf, int buflen)
    log_debug("waking up dequeuer");
    pthread_cond_signal(&queue_cond_);
    pthread_mutex_unlock(&queue_mutex_);
+   return 0;
+}
+
+
+/*! Remove the queued packets of a destination from the packet queue and
+ * copy them to a buffer, the oldest packet first. Packets which do not fit
+ * into the buffer are kept in the queue.
+ * @param addr Pointer to destination address.
+ * @param buf Pointer to buffer.
+ * @param size Number of bytes available in buf.
+ * @return Number of bytes copied to buf.
+ */
+int dequeue_packets(const struct in6_addr *addr, char *buf, int size)
+{
+   PacketQueue_t **queue, *fqueue, *list = NULL;
+   int len = 0;
+
+   pthread_mutex_lock(&queue_mutex_);
+   // the queue is ordered newest first, thus reverse it
+   for (queue = &queue_; *queue; )
+   {
+      if (!IN6_ARE_ADDR_EQUAL(&(*queue)->addr, addr))
+      {
+         queue = &(*queue)->next;
+         continue;
+      }
+      fqueue = *queue;
+      *queue = fqueue->next;
+      fqueue->next = list;
+      list = fqueue;
+   }
+
+   for (; list && len + list->psize <= size; list = fqueue)
+   {
+      memcpy(buf + len, list->data, list->psize);
+      len += list->psize;
+      fqueue = list->next;
+      mem_release(MEM_PKTQ, sizeof(PacketQueue_t) + list->psize);
+      free(list);
+   }
+
+   // requeue remaining packets
+   for (; list; list = fqueue)
+   {
+      fqueue = list->next;
+      list->next = queue_;
+      queue_ = list;
+   }
+   pthread_mutex_unlock(&queue_mutex_);
+
+   return len;
+}
+
+
+/*! Wake up the packet dequeuer, e.g. if a new peer is available.
+ */
+void wake_dequeuer(void)
+{
+   pthread_mutex_lock(&queue_mutex_);
+   pthread_cond_signal(&queue_cond_);
+   pthread_mutex_unlock(&queue_mutex_);
 }
 
 
+/*! The dequeuer sends queued packets as soon as a peer gets available
+ * (insert_peer() wakes it up). It additionally wakes up at the time when the
+ * oldest packet expires to remove it from the queue.
+ */
 void *packet_dequeuer(void *p)
 {
    PacketQueue_t **queue, *fqueue;
    struct timespec ts;
-   struct timeval tv;
    int rc, timed = 0;
-   time_t delay;
+   time_t delay, expire = 0;
 
    for (;;)
    {
       pthread_mutex_lock(&queue_mutex_);
       if (timed)
       {
-          // replaced clock_gettime() due to portability issues
-         if (gettimeofday(&tv, NULL) == -1)
-         {
-            log_msg(LOG_ERR, "couldn't gettime: \"%s\"", strerror(errno));
-            memset(&tv, 0, sizeof(tv));
-         }
-         else
-         {
-            ts.tv_sec = tv.tv_sec;
-            ts.tv_nsec = tv.tv_usec * 1000;
-         }
-         ts.tv_sec += DEQUEUER_WAKEUP;
+         ts.tv_sec = expire;
+         ts.tv_nsec = 0;
          log_debug("timed conditional wait...");
          rc = pthread_cond_timedwait(&queue_cond_, &queue_mutex_, &ts);
+         if (rc == ETIMEDOUT)
+            rc = 0;
       }
       else
       {
@@ -154,6 +318,7 @@ void *packet_dequeuer(void *p)
          log_msg(LOG_EMERG, "woke up: \"%s\"", strerror(rc));
 
       log_debug("starting dequeuing");
+      expire = 0;
       for (queue = &queue_; *queue; /*queue = &(*queue)->next*/)
       {
          rc = forward_packet(&(*queue)->addr, (*queue)->data, (*queue)->psize);
@@ -164,10 +329,13 @@ void *packet_dequeuer(void *p)
          {
             fqueue = *queue;
             *queue = (*queue)->next;
+            mem_release(MEM_PKTQ, sizeof(PacketQueue_t) + fqueue->psize);
             free(fqueue);
             log_debug("packet dequeued, delay = %d", delay);
             continue;
          }
+         if (!expire || (*queue)->time + MAX_QUEUE_DELAY + 1 < expire)
+            expire = (*queue)->time + MAX_QUEUE_DELAY + 1;
          queue = &(*queue)->next;
       }
       timed = queue_ != NULL;
@@ -222,7 +390,7 @@ int set_peer_dest(struct in6_addr *dest, const struct in6_addr *addr)
       return -1;
    }
 
-   if (IN6_ARE_ADDR_EQUAL(addr, &CNF(ocat_addr)))
+   if (is_local_addr(addr))
    {
       log_msg(LOG_WARNING, "source address is local address");
       return -1;
@@ -277,6 +445,7 @@ int handle_keepalive(OcatPeer_t *peer,  const struct ip6_hdr *i6h)
 {
    // FIXME: should that be activated only if lookup is enabled?
    char *buf;
+   time_t now;
    int len;
 
    // check if ip6 packet without specific content (header only)
@@ -315,13 +484,20 @@ int handle_keepalive(OcatPeer_t *peer,  const struct ip6_hdr *i6h)
    }
 
    log_msg(LOG_INFO, "seems to be OC4 keepalive");
-   hosts_add_entry(&i6h->ip6_src, buf, HSRC_KPLV, time(NULL), HOSTS_KPLV_TTL);
-   strlcpy(peer->sname, buf, sizeof(peer->sname));
+   // the hosts db is only touched if the name changed or the entry is due
+   // for refresh, repeated keepalives do not need to take the hosts lock
+   now = time(NULL);
+   if (strcmp(peer->cold->sname, buf) || now - peer->cold->hosts_time >= HOSTS_KPLV_REFRESH)
+   {
+      hosts_add_entry(&i6h->ip6_src, buf, HSRC_KPLV, now, HOSTS_KPLV_TTL);
+      peer->cold->hosts_time = now;
+   }
+   strlcpy(peer->cold->sname, buf, sizeof(peer->cold->sname));
    return 0;
 
 hk_poc4:
    log_msg(LOG_INFO, "treating as pre-OC4 keepalive");
-   *peer->sname = '\0';
+   *peer->cold->sname = '\0';
    return 1;
 }
 
@@ -388,7 +564,7 @@ int ident_loopback(OcatPeer_t *peer, const struct ip6_hdr *i6h)
 
    log_debug("identified valid loopback keepalive");
    IN6_ADDR_COPY(&lpeer->saddr, &peer->saddr);
-   memcpy(lpeer->sname, peer->sname, sizeof(lpeer->sname));
+   memcpy(lpeer->cold->sname, peer->cold->sname, sizeof(lpeer->cold->sname));
    unlock_peer(lpeer);
    return 0;
 }
@@ -445,6 +621,39 @@ int ident_packet(const char *buf, int len, uint32_t *tunhdr)
 }
 
 
+/*! Get the length of the IP packet in buf as found in its header.
+ * @param buf Pointer to the buffer.
+ * @param len Bytes available in the buffer.
+ * @return Length of the packet or 0 if the header is incomplete or the data
+ * is neither IPv6 nor IPv4.
+ */
+static int packet_length(const char *buf, int len)
+{
+   if ((buf[0] & 0xf0) == 0x60 && len >= (int) IP6HLEN)
+      return ntohs(((struct ip6_hdr*) buf)->ip6_plen) + IP6HLEN;
+   if ((buf[0] & 0xf0) == 0x40 && len >= (int) IPHDLEN)
+      return IPPKTLEN(buf);
+   return 0;
+}
+
+
+#ifdef PACKET_QUEUE
+/*! Put packets which were taken with dequeue_packets() back to the packet
+ * queue, e.g. if they could not be sent.
+ * @param addr Pointer to destination address.
+ * @param buf Pointer to the packets as returned by dequeue_packets().
+ * @param len Number of bytes in buf.
+ */
+void requeue_packets(const struct in6_addr *addr, const char *buf, int len)
+{
+   int plen;
+
+   for (; len > 0 && (plen = packet_length(buf, len)) > 0 && plen <= len; buf += plen, len -= plen)
+      queue_packet(addr, buf, plen);
+}
+#endif
+
+
 int is_ipv6(const OcatPeer_t *peer)
 {
    return *peer->tunhdr == CNF(fhd_key[IPV6_KEY]);
@@ -457,13 +666,75 @@ int is_ipv4(const OcatPeer_t *peer)
 }
 
 
+/*! Send an ICMPv6 Packet Too Big message (RFC4443) back to the source of an
+ * IPv6 packet which does not fit into the frame buffer. It contains as much
+ * of the invoking packet as is available in the fragment buffer without
+ * exceeding the minimum MTU. No message is sent for ICMPv6 error messages.
+ * There is no further rate limiting because the remote side has to send a
+ * complete oversized packet for each message.
+ * Peer MUST be locked.
+ * @param peer Pointer to peer, the invoking packet is found at the beginning
+ * of its fragment buffer.
+ * @param mtu MTU to be reported.
+ * @return 0 on success, -1 if no message was sent.
+ */
+static int send_ptb(OcatPeer_t *peer, int mtu)
+{
+   char buf[MIN_TUN_MTU];
+   struct ip6_hdr *hdr = (struct ip6_hdr*) buf;
+   struct icmp6_hdr *icmp = (struct icmp6_hdr*) (hdr + 1);
+   const struct ip6_hdr *ohdr = (struct ip6_hdr*) peer->fragbuf;
+   const OcatIdent_t *id;
+   uint16_t *ckb;
+   int len;
+
+   if ((peer->fragbuf[0] & 0xf0) != 0x60 || peer->fraglen < (int) IP6HLEN)
+      return -1;
+   if (ohdr->ip6_nxt == IPPROTO_ICMPV6 && (peer->fraglen <= (int) IP6HLEN || !(peer->fragbuf[IP6HLEN] & ICMP6_INFOMSG_MASK)))
+      return -1;
+
+   len = sizeof(buf) - sizeof(*hdr) - sizeof(*icmp);
+   if (peer->fraglen < len)
+      len = peer->fraglen;
+
+   memset(buf, 0, sizeof(*hdr) + sizeof(*icmp));
+   hdr->ip6_vfc = 0x60;
+   hdr->ip6_nxt = IPPROTO_ICMPV6;
+   hdr->ip6_plen = htons(sizeof(*icmp) + len);
+   hdr->ip6_hlim = 255;
+   if ((id = get_ident(&ohdr->ip6_dst)) != NULL)
+      IN6_ADDR_COPY(&hdr->ip6_src, &id->addr);
+   else
+      IN6_ADDR_COPY(&hdr->ip6_src, &CNF(ocat_addr));
+   IN6_ADDR_COPY(&hdr->ip6_dst, &ohdr->ip6_src);
+
+   icmp->icmp6_type = ICMP6_PACKET_TOO_BIG;
+   icmp->icmp6_mtu = htonl(mtu);
+   memcpy(icmp + 1, peer->fragbuf, len);
+   ckb = malloc_ckbuf(hdr->ip6_src, hdr->ip6_dst, ntohs(hdr->ip6_plen), IPPROTO_ICMPV6, icmp);
+   icmp->icmp6_cksum = checksum(ckb, ntohs(hdr->ip6_plen) + sizeof(struct ip6_psh));
+   free_ckbuf(ckb);
+
+   len += sizeof(*hdr) + sizeof(*icmp);
+   log_debug("sending packet too big (mtu = %d) to fd %d", mtu, peer->tcpfd);
+   if ((len = send(peer->tcpfd, buf, len, MSG_DONTWAIT)) == -1)
+   {
+      log_msg(LOG_ERR, "could not send packet too big: %s", strerror(errno));
+      return -1;
+   }
+   peer->out += len;
+   return 0;
+}
+
+
 /*! This function queues a new request for the OC address in6 if there is no
  * peer yet available.
  * @param in6 Pointer to IPv6 address to connect to.
+ * @param laddr Pointer to address of the local identity or NULL.
  * @return If a new connection was queued, 0 is returned. If a peer is already
  * available, nothing will be done and the function will return -1.
  */
-int socks_queue_ifnopeer(const struct in6_addr *in6)
+int socks_queue_ifnopeer(const struct in6_addr *in6, const struct in6_addr *laddr)
 {
    char addr[INET6_ADDRSTRLEN];
    OcatPeer_t *rpeer;
@@ -476,7 +747,7 @@ int socks_queue_ifnopeer(const struct in6_addr *in6)
       return -1;
 
    log_msg(LOG_INFO, "creating immediate return peer to %s", inet_ntop(AF_INET6, in6, addr, INET6_ADDRSTRLEN));
-   socks_queue(*in6, 0);
+   socks_queue_ident(*in6, 0, laddr);
    return 0;
 }
 
@@ -502,7 +773,7 @@ int socks_queue_ifnopeer(const struct in6_addr *in6)
  */
 int ident_peer(OcatPeer_t *peer)
 {
-   struct in6_addr *in6;
+   struct in6_addr *in6, gw;
 
    if (is_ipv6(peer))
    {
@@ -526,9 +797,9 @@ int ident_peer(OcatPeer_t *peer)
    {
       // check if there is a route back
 #ifdef HAVE_STRUCT_IPHDR
-      if (!(in6 = ipv4_lookup_route(ntohl(((struct iphdr*) peer->fragbuf)->saddr))))
+      if (!(in6 = ipv4_lookup_route(ntohl(((struct iphdr*) peer->fragbuf)->saddr), &gw)))
 #else
-      if (!(in6 = ipv4_lookup_route(ntohl(((struct ip*) peer->fragbuf)->ip_src.s_addr))))
+      if (!(in6 = ipv4_lookup_route(ntohl(((struct ip*) peer->fragbuf)->ip_src.s_addr), &gw)))
 #endif
       {
          log_msg(LOG_WARNING, "no route back, dropping");
@@ -544,7 +815,7 @@ int ident_peer(OcatPeer_t *peer)
    // create return peer if not yet opened if in unidirectional mode
    if (CNF(unidirectional))
    {
-      (void) socks_queue_ifnopeer(in6);
+      (void) socks_queue_ifnopeer(in6, &peer->laddr);
    }
    // if in bidirectional mode set peer destination
    else
@@ -557,6 +828,195 @@ int ident_peer(OcatPeer_t *peer)
 }
 
 
+/*! Hand over a packet to the tun writer. The function does not block, thus
+ * it may be called while the peer is locked. If there is no tunnel device
+ * (libocat) the packet is dropped.
+ * @param buf Pointer to IP packet.
+ * @param len Length of packet.
+ * @param tunhdr Tunnel header of packet.
+ * @return 0 on success, -1 if the packet was dropped.
+ */
+static int tun_enqueue(const char *buf, int len, uint32_t tunhdr)
+{
+   OcatTunFrame_t *tf;
+   size_t size = sizeof(*tf) + FRAME_HDR_LEN + len;
+
+   if (CNF(tunfd[1]) == -1)
+   {
+      log_debug("no tunnel device, dropping packet");
+      return -1;
+   }
+
+   if (mem_charge(MEM_TUNQ, size) == -1)
+   {
+      log_debug("tun queue full, dropping packet");
+      return -1;
+   }
+
+   if ((tf = malloc(size)) == NULL)
+   {
+      mem_release(MEM_TUNQ, size);
+      log_msg(LOG_ERR, "could not get memory for tun frame: \"%s\"", strerror(errno));
+      return -1;
+   }
+
+   tf->len = len;
+   tf->tunhdr = tunhdr;
+   memcpy(tf->frame + FRAME_HDR_LEN, buf, len);
+
+   mpsc_push(&tun_inbox_, &tf->node);
+   notify_signal(&tun_notify_);
+   return 0;
+}
+
+
+static void tun_free_frame(OcatTunFrame_t *tf)
+{
+   mem_release(MEM_TUNQ, sizeof(*tf) + FRAME_HDR_LEN + tf->len);
+   free(tf);
+}
+
+
+/*! Write a single frame to the tunnel device. In case of a TAP device the
+ * ethernet header is created.
+ * @param tf Pointer to frame.
+ * @return 0 if the frame was written or dropped, -1 if the tunnel device
+ * would block.
+ */
+static int tun_write_frame(OcatTunFrame_t *tf)
+{
+   struct ether_header *eh = (struct ether_header*) (tf->frame + 4);
+   struct ip6_hdr *ip6 = (struct ip6_hdr*) (tf->frame + FRAME_HDR_LEN);
+   char *buf;
+   int len;
+
+   if (!CNF(use_tap))
+   {
+      buf = tf->frame + sizeof(struct ether_header);
+      len = tf->len + 4;
+   }
+   // create ethernet header and handle MAC on TAP device
+   else if (tf->tunhdr == CNF(fhd_key[IPV6_KEY]))
+   {
+      log_debug("creating ethernet header");
+
+      // FIXME: should differentiate between IPv6 and IP!!
+      memset(eh->ether_dst, 0, ETHER_ADDR_LEN);
+      if (mac_set(&ip6->ip6_dst, eh->ether_dst) == -1)
+      {
+         log_debug("dest MAC unknown, resolving");
+         ndp_solicit(&ip6->ip6_src, &ip6->ip6_dst);
+         return 0;
+      }
+      memcpy(eh->ether_src, CNF(ocat_hwaddr), ETHER_ADDR_LEN);
+      eh->ether_type = htons(ETHERTYPE_IPV6);
+      buf = tf->frame;
+      len = tf->len + FRAME_HDR_LEN;
+   }
+   else
+   {
+      log_debug("protocol %x not implemented on TAP device", ntohs(tf->tunhdr));
+      return 0;
+   }
+
+   set_tunheader(buf, tf->tunhdr);
+   log_debug("writing to tun %d framesize %d + %d", CNF(tunfd[1]), len - 4, 4 - BUF_OFF);
+   if (tun_write(CNF(tunfd[1]), buf + BUF_OFF, len - BUF_OFF) != len - BUF_OFF)
+   {
+      if (errno == EAGAIN)
+         return -1;
+      log_msg(LOG_ERR, "could not write %d bytes to tunnel %d", len - BUF_OFF, CNF(tunfd[1]));
+   }
+   return 0;
+}
+
+
+/*! Initialize the notifier of the tun writer. This must be called before
+ * the socket_receiver is started.
+ * @return 0 on success, -1 on error.
+ */
+int init_tun_writer(void)
+{
+   return notify_init(&tun_notify_);
+}
+
+
+/*! The tun_writer is the thread which writes the packets received by the
+ * socket_receiver to the tunnel device. Thereby the socket_receiver never
+ * blocks on the tunnel device while a peer is locked. The frames are written
+ * in batches. If the tunnel device would block, the remaining frames are kept
+ * until the device gets writable again.
+ */
+void *tun_writer(void *UNUSED(p))
+{
+   OcatTunFrame_t *head = NULL, *tail = NULL, *tf;
+   fd_set rset, wset;
+   int maxfd;
+
+   // without tunnel device the fd is stdout which must not be changed
+#if !defined(__CYGWIN__) && !defined(__OpenBSD__) && !defined(WITHOUT_TUN)
+   set_nonblock(CNF(tunfd[1]));
+#endif
+
+   for (;;)
+   {
+      update_thread_activity();
+      // check for termination request
+      if (term_req())
+         break;
+
+      FD_ZERO(&rset);
+      FD_ZERO(&wset);
+      FD_SET(tun_notify_.fd[0], &rset);
+      maxfd = tun_notify_.fd[0];
+      // wait for tunnel device if frames are pending
+      if (head != NULL)
+         MFD_SET(CNF(tunfd[1]), &wset, maxfd);
+
+      if (oc_select(maxfd + 1, &rset, &wset, NULL) == -1)
+         continue;
+
+      if (FD_ISSET(tun_notify_.fd[0], &rset))
+      {
+         notify_clear(&tun_notify_);
+         if ((tf = (OcatTunFrame_t*) mpsc_take(&tun_inbox_)) != NULL)
+         {
+            if (head == NULL)
+               head = tf;
+            else
+               tail->node.next = &tf->node;
+            for (tail = tf; tail->node.next; tail = (OcatTunFrame_t*) tail->node.next);
+         }
+      }
+
+      for (; head != NULL; head = tf)
+      {
+         if (tun_write_frame(head) == -1)
+         {
+            log_debug("tun %d would block, frames pending", CNF(tunfd[1]));
+            break;
+         }
+         tf = (OcatTunFrame_t*) head->node.next;
+         tun_free_frame(head);
+      }
+   }
+
+   for (; head != NULL; head = tf)
+   {
+      tf = (OcatTunFrame_t*) head->node.next;
+      tun_free_frame(head);
+   }
+   for (head = (OcatTunFrame_t*) mpsc_take(&tun_inbox_); head != NULL; head = tf)
+   {
+      tf = (OcatTunFrame_t*) head->node.next;
+      tun_free_frame(head);
+   }
+   notify_close(&tun_notify_);
+
+   return NULL;
+}
+
+
 /*! The socket_receiver is the thread which handles incoming packets from
  * remote OnionCats over the network. It does several checks on the packets,
  * also identifies the remote lookback handler, and handles the incoming
@@ -565,14 +1025,12 @@ int ident_peer(OcatPeer_t *peer)
 void *socket_receiver(void *UNUSED(p))
 {
    int maxfd, len;
-   char buf[FRAME_SIZE];
    char addr[INET6_ADDRSTRLEN];
    fd_set rset;
    OcatPeer_t *peer;
-   struct ether_header *eh = (struct ether_header*) (buf + 4);
 
-   if (pipe(lpfd_) < 0)
-      log_msg(LOG_EMERG, "could not create pipe for socket_receiver: \"%s\"", strerror(errno)), exit(1);
+   if (notify_init(&recv_notify_) == -1)
+      log_msg(LOG_EMERG, "could not create notifier for socket_receiver"), exit(1);
 
    for (;;)
    {
@@ -582,8 +1040,8 @@ void *socket_receiver(void *UNUSED(p))
          break;
 
       FD_ZERO(&rset);
-      FD_SET(lpfd_[0], &rset);
-      maxfd = lpfd_[0];
+      FD_SET(recv_notify_.fd[0], &rset);
+      maxfd = recv_notify_.fd[0];
 
       // create set of all available peers to read
       lock_peers();
@@ -608,11 +1066,10 @@ void *socket_receiver(void *UNUSED(p))
       if ((maxfd = oc_select(maxfd + 1, &rset, NULL, NULL)) == -1)
          continue;
 
-      // thread woke up because of internal pipe read => restart selection
-      if (FD_ISSET(lpfd_[0], &rset))
+      // thread woke up because of internal notification => restart selection
+      if (FD_ISSET(recv_notify_.fd[0], &rset))
       {
-         if (read(lpfd_[0], buf, FRAME_SIZE - 4) == -1)
-            log_msg(LOG_ERR, "read from pipe %d failed: %s", lpfd_[0], strerror(errno));
+         notify_clear(&recv_notify_);
          maxfd--;
       }
 
@@ -657,7 +1114,7 @@ void *socket_receiver(void *UNUSED(p))
          log_debug("reading from %d", peer->tcpfd);
 
          // read/append data to peer's fragment buffer
-         if ((len = read(peer->tcpfd, peer->fragbuf + peer->fraglen, FRAME_SIZE - 4 - peer->fraglen)) == -1)
+         if ((len = read(peer->tcpfd, peer->fragbuf + peer->fraglen, CNF(frame_size) - 4 - peer->fraglen)) == -1)
          {
             // this might happen on linux, see SELECT(2)
             log_debug("spurious wakup of %d: \"%s\"", peer->tcpfd, strerror(errno));
@@ -674,11 +1131,23 @@ void *socket_receiver(void *UNUSED(p))
 
             log_debug("mark peer with fd %d for deletion", peer->tcpfd);
             peer->state = PEER_DELETE;
+            // a DIRECT connection with TCP Fast Open which never received
+            // anything most probably was refused after the peer was
+            // activated, thus reconnect permanent peers with a delay and
+            // hold back requests for temporary peers for the same time
+            if (peer->dir == PEER_OUTGOING && !peer->in && CNF(tcp_fastopen) && CNF(socks5) == CONNTYPE_DIRECT)
+            {
+               log_msg(LOG_INFO, "connection on fd %d failed, delaying reconnect by %d seconds", peer->tcpfd, TOR_SOCKS_CONN_TIMEOUT);
+               if (peer->perm)
+                  socks_queue_delayed(peer->addr, 1, &peer->laddr, TOR_SOCKS_CONN_TIMEOUT);
+               else
+                  socks_hold(peer->addr, TOR_SOCKS_CONN_TIMEOUT);
+            }
             // restart connection of permanent peers
-            if (peer->perm)
+            else if (peer->perm)
             {
                log_debug("reconnection permanent peer");
-               socks_queue(peer->addr, 1);
+               socks_queue_ident(peer->addr, 1, &peer->laddr);
             }
             unlock_peer(peer);
             continue;
@@ -686,9 +1155,18 @@ void *socket_receiver(void *UNUSED(p))
 
          peer->fraglen += len;
          // update timestamp
-         peer->time = time(NULL);
+         peer->time = peer->rtime = time(NULL);
          peer->in += len;
 
+         // drop remaining data of oversized packet
+         if (peer->skip)
+         {
+            len = peer->skip < peer->fraglen ? peer->skip : peer->fraglen;
+            peer->skip -= len;
+            peer->fraglen -= len;
+            memmove(peer->fragbuf, peer->fragbuf + len, peer->fraglen);
+         }
+
          while (peer->fraglen)
          {
             if ((len = ident_packet(peer->fragbuf, peer->fraglen, peer->tunhdr)) <= 0)
@@ -701,13 +1179,19 @@ void *socket_receiver(void *UNUSED(p))
                   log_debug("fragment buffer reset");
                   peer->fraglen = 0;
                }
-               break;
-
-               if (len < 0)
+               // packet does not fit into frame buffer
+               else if ((len = packet_length(peer->fragbuf, peer->fraglen)) > CNF(frame_size) - FRAME_HDR_LEN)
+               {
+                  log_msg(LOG_WARNING, "dropping oversized packet of %d bytes on fd %d", len, peer->tcpfd);
+                  (void) send_ptb(peer, CNF(frame_size) - FRAME_HDR_LEN);
+                  peer->skip = len - peer->fraglen;
+                  peer->fraglen = 0;
+               }
+               else
                {
                   log_debug("partial packet, waiting for more data");
-                  break;
                }
+               break;
             }
 
             // check if destination address has OC prefix
@@ -729,51 +1213,31 @@ void *socket_receiver(void *UNUSED(p))
                if (ident_peer(peer) != 0)
                   goto sr_fin;
 
-            // write directly on TUN device
-            if (!CNF(use_tap))
+            // hand over packet to embedding application if registered
+            if (!lib_deliver_packet(peer->fragbuf, len))
             {
-               log_debug("writing to tun %d framesize %d + %d", CNF(tunfd[1]), len, 4 - BUF_OFF);
-               if (tun_write(CNF(tunfd[1]), ((char*) peer->tunhdr) + BUF_OFF, len + 4 - BUF_OFF) != (len + 4 - BUF_OFF))
-                  log_msg(LOG_ERR, "could not write %d bytes to tunnel %d", len + 4 - BUF_OFF, CNF(tunfd[1]));
+               log_debug("%d bytes delivered to packet receiver", len);
             }
-            // create ethernet header and handle MAC on TAP device
-            else if (*peer->tunhdr == CNF(fhd_key[IPV6_KEY]))
+            // deliver packet to shared memory rings of local applications
+            else if (!ring_deliver_packet(peer->fragbuf, len))
             {
-               log_debug("creating ethernet header");
-
-               // FIXME: should differentiate between IPv6 and IP!!
-               memset(eh->ether_dst, 0, ETHER_ADDR_LEN);
-               if (mac_set(&((struct ip6_hdr*)peer->fragbuf)->ip6_dst, eh->ether_dst) == -1)
-               {
-                  log_debug("dest MAC unknown, resolving");
-                  ndp_solicit(&((struct ip6_hdr*)peer->fragbuf)->ip6_src, &((struct ip6_hdr*)peer->fragbuf)->ip6_dst);
-               }
-               else
-               {
-                  set_tunheader(buf, *peer->tunhdr);
-                  memcpy(buf + 4 + sizeof(struct ether_header), peer->fragbuf, len);
-                  memcpy(eh->ether_src, CNF(ocat_hwaddr), ETHER_ADDR_LEN);
-
-                  if (*peer->tunhdr == CNF(fhd_key[IPV6_KEY]))
-                     eh->ether_type = htons(ETHERTYPE_IPV6);
-                  else if (*peer->tunhdr == CNF(fhd_key[IPV4_KEY]))
-                     eh->ether_type = htons(ETHERTYPE_IP);
-
-                  if (tun_write(CNF(tunfd[1]), buf + BUF_OFF, len + 4 + sizeof(struct ether_header) - BUF_OFF) != (len + 4 + (int) sizeof(struct ether_header) - BUF_OFF))
-                     log_msg(LOG_ERR, "could not write %d bytes to tunnel %d", len + 4 + (int) sizeof(struct ether_header) - BUF_OFF, CNF(tunfd[1]));
-               }
+               log_debug("%d bytes delivered to packet rings", len);
             }
-            else
+            // hand over packet to tun writer
+            else if (tun_enqueue(peer->fragbuf, len, *peer->tunhdr) == -1)
             {
-               log_debug("protocol %x not implemented on TAP device", ntohs(*peer->tunhdr));
+               goto sr_fin;
             }
 
+            // dropped packets are not accounted
+            flow_account(peer->fragbuf, len, FLOW_IN);
+
    sr_fin:
             peer->fraglen -= len;
             if (peer->fraglen)
             {
                log_debug("moving fragment. fragsize %d", peer->fraglen);
-               memmove(peer->fragbuf, peer->fragbuf + len, FRAME_SIZE - 4 - len);
+               memmove(peer->fragbuf, peer->fragbuf + len, peer->fraglen);
             }
             else
             {
@@ -781,13 +1245,17 @@ void *socket_receiver(void *UNUSED(p))
             }
          } // while (peer->fraglen)
 
+         // the liveness of permanent peers is based on all connections of
+         // the remote host, see peer_heard()
+         heard_update(&peer->saddr, peer->rtime);
+         if (!IN6_ARE_ADDR_EQUAL(&peer->saddr, &peer->addr))
+            heard_update(&peer->addr, peer->rtime);
+
          unlock_peer(peer);
       } // while (maxfd)
    } // for (;;)
 
-   // closing pipe
-   oe_close(lpfd_[0]);
-   oe_close(lpfd_[1]);
+   notify_close(&recv_notify_);
 
    return NULL;
 }
@@ -809,13 +1277,50 @@ void set_nonblock(int fd)
 }
 
 
+/*! Set TCP_USER_TIMEOUT on a socket. Thereby the kernel aborts the
+ * connection if sent data is not acknowledged within the given time.
+ * @param fd Socket file descriptor.
+ * @param ms Timeout in milliseconds.
+ */
+static void set_user_timeout(int fd, unsigned ms)
+{
+#ifdef TCP_USER_TIMEOUT
+   if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms)) == -1)
+      log_msg(LOG_WARNING, "could not set TCP_USER_TIMEOUT on %d: \"%s\"", fd, strerror(errno));
+#else
+   (void) fd;
+   (void) ms;
+#endif
+}
+
+
+/*! Wake up socket_receiver to make it rebuild its set of file descriptors.
+ */
+void wake_socket_receiver(void)
+{
+   log_debug("waking up socket_receiver");
+   notify_signal(&recv_notify_);
+}
+
+
 int insert_peer(int fd, const SocksQueue_t *sq, /*const struct in6_addr *addr,*/ time_t dly)
 {
    OcatPeer_t *peer;
+   const OcatIdent_t *id = NULL;
 
    log_msg(LOG_INFO | LOG_FCONN, "inserting peer fd %d to active peer list", fd);
 
+   // bind incoming connections to the identity of the listener
+   if (!sq && (id = get_ident_by_fd(fd)) != NULL)
+   {
+      log_debug("fd %d belongs to identity %s", fd, id->onion_url);
+   }
+
    set_nonblock(fd);
+   // only DIRECT connections go to the remote host, otherwise the timeout
+   // would apply just to the connection to the local SOCKS server
+   if (sq && sq->perm && CNF(socks5) == CONNTYPE_DIRECT)
+      set_user_timeout(fd, PERM_USER_TIMEOUT);
 
    lock_peers();
    if (!(peer = get_empty_peer()))
@@ -829,7 +1334,7 @@ int insert_peer(int fd, const SocksQueue_t *sq, /*const struct in6_addr *addr,*/
 
    peer->tcpfd = fd;
    peer->state = PEER_ACTIVE;
-   peer->otime = peer->time = time(NULL);
+   peer->otime = peer->time = peer->rtime = time(NULL);
    peer->sdelay = dly;
    if (sq)
    {
@@ -840,19 +1345,37 @@ int insert_peer(int fd, const SocksQueue_t *sq, /*const struct in6_addr *addr,*/
    }
    else
       peer->dir = PEER_INCOMING;
+   if (id)
+      IN6_ADDR_COPY(&peer->laddr, &id->addr);
+   // outgoing connections are bound to the identity they were requested for
+   // before the first keepalive is sent
+   else if (sq)
+      IN6_ADDR_COPY(&peer->laddr, &sq->laddr);
    unlock_peer(peer);
 
-   // wake up socket_receiver
-   log_debug("waking up socket_receiver");
-   if (write(lpfd_[1], &fd, 1) != 1)
-      log_msg(LOG_EMERG, "couldn't write to socket_receiver pipe: \"%s\"", strerror(errno));
+   wake_socket_receiver();
+#ifdef PACKET_QUEUE
+   // queued packets may now be sent
+   wake_dequeuer();
+#endif
 
    return 1;
 }
 
 
+/*! Insert a peer of an incoming connection. The connection is refused if the
+ * memory limit of the peers is reached.
+ * @param fd File descriptor of incoming connection.
+ * @return 0 on success, -1 on error.
+ */
 int insert_anon_peer(int fd)
 {
+   if (!mem_avail(MEM_PEER, sizeof(OcatPeer_t)) || !mem_avail(MEM_RXBUF, PEER_COLD_SIZE))
+   {
+      log_msg(LOG_WARNING, "memory limit reached, refusing incoming connection on fd %d", fd);
+      oe_close(fd);
+      return -1;
+   }
    return insert_peer(fd, NULL, 0);
 }
 
@@ -891,6 +1414,13 @@ int create_listener(struct sockaddr *addr, int sock_len)
       return -1;
    }
 
+#ifdef TCP_FASTOPEN
+   // accept data within the SYN of incoming connections
+   so = TFO_QUEUE_LEN;
+   if (CNF(tcp_fastopen) && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &so, sizeof(so)) == -1)
+      log_msg(LOG_WARNING, "could not set TCP_FASTOPEN on listener %d: \"%s\"", fd, strerror(errno));
+#endif
+
    if (listen(fd, 32) < 0)
    {
       log_msg(LOG_WARNING, "could not bring listener %d to listening state: \"%s\"", fd, strerror(errno));
@@ -906,6 +1436,8 @@ int create_listener(struct sockaddr *addr, int sock_len)
 /*! run_listeners(...) is a generic socket acceptor for TCP ports.  It listens
  * on a given list of sockets.  Every time a connection comes in the function
  * action_accept is called with the incoming file descriptor as parameter.
+ * Listeners are only created for entries of sockfd which are -1, entries
+ * which contain a valid file descriptor are reused.
  *
  * @param addr Double pointer to sockaddr structs. It MUST be terminated by a
  * null pointer.  
@@ -913,9 +1445,12 @@ int create_listener(struct sockaddr *addr, int sock_len)
  * much entries as the sockaddr pointer has entries.  
  * @param action_accept Function pointer to function that should be called if a
  * connection arrives.  
- * @return Always 0.
+ * @param wakeup Pointer to a notifier or NULL. If the notifier is signalled
+ * the function returns without closing the listeners.
+ * @return 0 on termination, 1 if woken up by the notifier, or -1 if a
+ * listener could not be created.
  */
-int run_listeners(struct sockaddr **addr, int *sockfd, int cnt, int (action_accept)(int))
+int run_listeners(struct sockaddr **addr, int *sockfd, int cnt, int (action_accept)(int), OcatNotify_t *wakeup)
 {
    int fd;
    struct sockaddr_in6 in6;
@@ -926,6 +1461,8 @@ int run_listeners(struct sockaddr **addr, int *sockfd, int cnt, int (action_acce
 
    for (i = 0; i < cnt; i++)
    {
+      if (sockfd[i] != -1)
+         continue;
       log_debug("create listener");
       if ((sockfd[i] = create_listener(addr[i], SOCKADDR_SIZE(addr[i]))) == -1)
          return -1;
@@ -951,6 +1488,12 @@ int run_listeners(struct sockaddr **addr, int *sockfd, int cnt, int (action_acce
          if (sockfd[i] > maxfd)
             maxfd = sockfd[i];
       }
+      if (wakeup != NULL)
+      {
+         FD_SET(wakeup->fd[0], &rset);
+         if (wakeup->fd[0] > maxfd)
+            maxfd = wakeup->fd[0];
+      }
 
       if (maxfd == -1)
       {
@@ -961,10 +1504,17 @@ int run_listeners(struct sockaddr **addr, int *sockfd, int cnt, int (action_acce
       if ((maxfd = oc_select(maxfd + 1, &rset, NULL, NULL)) == -1)
          continue;
 
+      if (wakeup != NULL && FD_ISSET(wakeup->fd[0], &rset))
+      {
+         log_debug("listeners woken up");
+         notify_clear(wakeup);
+         return 1;
+      }
+
       for (i = 0; maxfd && (i < cnt); i++)
       {
          log_debug("checking fd %d (maxfd = %d, i = %d)", sockfd[i], maxfd, i);
-         if (!FD_ISSET(sockfd[i], &rset))
+         if (sockfd[i] == -1 || !FD_ISSET(sockfd[i], &rset))
             continue;
          maxfd--;
          alen = sizeof(in6);
@@ -987,16 +1537,138 @@ int run_listeners(struct sockaddr **addr, int *sockfd, int cnt, int (action_acce
 
    // closing listeners
    for (i = 0; i < cnt; i++)
-      oe_close(sockfd[i]);
+      if (sockfd[i] != -1)
+         oe_close(sockfd[i]);
 
    log_debug("run_listeners returns");
    return 0;
 }
 
 
+/*! Take over the pending list of listeners set by update_listeners(). Listeners
+ * which are in the old and in the new list are kept open, those which are not
+ * in the new list any more are closed and new ones are created. Addresses
+ * which cannot be bound are dropped from the list.
+ * This function is called by the acceptor thread.
+ */
+static void apply_listeners(void)
+{
+   struct sockaddr **addr, **oaddr;
+   int *fd, *ofd, cnt, ocnt, i, j;
+
+   lock_setup();
+   if ((addr = listen_new_) == NULL)
+   {
+      unlock_setup();
+      return;
+   }
+   cnt = listen_new_cnt_;
+   listen_new_ = NULL;
+
+   oaddr = CNF(oc_listen);
+   ofd = CNF(oc_listen_fd);
+   ocnt = CNF(oc_listen_cnt) > 0 ? CNF(oc_listen_cnt) : 0;
+
+   if ((fd = malloc(sizeof(int) * (cnt + 1))) == NULL)
+   {
+      unlock_setup();
+      log_msg(LOG_ERR, "could not get memory for listener fds: \"%s\"", strerror(errno));
+      delete_listeners(addr, NULL, cnt);
+      return;
+   }
+
+   // reuse listeners which are in both lists
+   for (i = 0; i < cnt; i++)
+   {
+      fd[i] = -1;
+      for (j = 0; j < ocnt; j++)
+         if (ofd[j] != -1 && SOCKADDR_SIZE(addr[i]) == SOCKADDR_SIZE(oaddr[j]) && !memcmp(addr[i], oaddr[j], SOCKADDR_SIZE(addr[i])))
+         {
+            fd[i] = ofd[j];
+            ofd[j] = -1;
+            break;
+         }
+   }
+
+   // close listeners which were removed
+   for (j = 0; j < ocnt; j++)
+      if (ofd[j] != -1)
+      {
+         log_msg(LOG_NOTICE, "closing listener %d", ofd[j]);
+         oe_close(ofd[j]);
+      }
+
+   // create new listeners
+   for (i = 0; i < cnt; i++)
+   {
+      if (fd[i] != -1)
+         continue;
+      if ((fd[i] = create_listener(addr[i], SOCKADDR_SIZE(addr[i]))) == -1)
+      {
+         log_msg(LOG_ERR, "dropping listener which could not be created");
+         free(addr[i]);
+         memmove(&addr[i], &addr[i + 1], sizeof(*addr) * (cnt - i - 1));
+         memmove(&fd[i], &fd[i + 1], sizeof(*fd) * (cnt - i - 1));
+         cnt--;
+         i--;
+         continue;
+      }
+      log_msg(LOG_NOTICE, "created listener %d", fd[i]);
+   }
+
+   CNF(oc_listen) = addr;
+   CNF(oc_listen_fd) = fd;
+   CNF(oc_listen_cnt) = cnt;
+   unlock_setup();
+
+   delete_listeners(oaddr, ofd, ocnt);
+}
+
+
+/*! Replace the listeners of the acceptor by a new list. The listeners are
+ * updated asynchronously by the acceptor thread which is started if it is not
+ * running yet.
+ * @param addr List of socket addresses which is taken over by this function,
+ * i.e. it must be allocated as done by add_listener().
+ * @param cnt Number of entries in addr.
+ */
+void update_listeners(struct sockaddr **addr, int cnt)
+{
+   int start;
+
+   lock_setup();
+   if (listen_new_ != NULL)
+      delete_listeners(listen_new_, NULL, listen_new_cnt_);
+   listen_new_ = addr;
+   listen_new_cnt_ = cnt;
+   if (!(start = !acceptor_running_))
+      acceptor_running_ = 1;
+   unlock_setup();
+
+   if (start)
+      run_ocat_thread("acceptor", socket_acceptor, NULL);
+   else
+      notify_signal(&listen_notify_);
+}
+
+
 void *socket_acceptor(void *UNUSED(p))
 {
-   if (run_listeners(CNF(oc_listen), CNF(oc_listen_fd), CNF(oc_listen_cnt), insert_anon_peer) == -1)
+   int rc;
+
+   lock_setup();
+   acceptor_running_ = 1;
+   if (notify_init(&listen_notify_) == -1)
+      log_msg(LOG_WARNING, "listeners cannot be updated at runtime");
+   unlock_setup();
+
+   for (rc = 1; rc == 1;)
+   {
+      apply_listeners();
+      rc = run_listeners(CNF(oc_listen), CNF(oc_listen_fd), CNF(oc_listen_cnt), insert_anon_peer, listen_notify_.fd[0] != -1 ? &listen_notify_ : NULL);
+   }
+
+   if (rc == -1)
    {
       log_msg(LOG_ERR, "failed to create listener, exiting...");
       exit(1);
@@ -1020,143 +1692,114 @@ static uint32_t get_saddr(const struct ip *ihdr)
 #endif
  
 
-void packet_forwarder(void)
+/*! Route and forward a single frame which was read from the tunnel device
+ * or injected by an embedding application (see ocatlib.c). The frame starts
+ * with the 4 byte tunnel header followed by the IP packet (or by the ethernet
+ * header in case of TAP).
+ * @param buf Pointer to the frame. The buffer must be at least
+ * CNF(frame_size) bytes long because it may be modified.
+ * @param rlen Length of the frame including the tunnel header.
+ * @return 0 if the packet was forwarded or queued, -1 if it was dropped.
+ */
+int forward_frame(char *buf, int rlen)
 {
-   char buf[FRAME_SIZE];
-   int rlen;
-   struct in6_addr *dest, destbuf;
+   struct in6_addr *dest, destbuf, gw;
    struct in_addr in;
    struct ether_header *eh = (struct ether_header*) &buf[4];
-#ifdef PACKET_LOG
-   int pktlog;
-
-   log_debug("opening packetlog");
-   if ((pktlog = open("pkt_log", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1)
-      log_debug("could not open packet log: %s", strerror(errno));
-#endif
+   int rc;
 
-   for (;;)
+   // just to be on the safe side but this should never happen
+   if ((!CNF(use_tap) && (rlen < 4)) || (CNF(use_tap) && (rlen < 4 + (int) sizeof(struct ether_header))))
    {
-      update_thread_activity();
-      // check if signals have arrived
-      proc_signals();
-
-      // check for termination request
-      if (term_req())
-         break;
+      log_msg(LOG_ERR, "frame effectively too short (rlen = %d)", rlen);
+      return -1;
+   }
 
-#ifdef __OpenBSD__
-      // workaround for OpenBSD userland threads
-      fcntl(CNF(tunfd[0]), F_SETFL, fcntl(CNF(tunfd[0]), F_GETFL) & ~O_NONBLOCK);
-#endif
-      log_debug("reading from tunfd[0] = %d", CNF(tunfd[0]));
-      if ((rlen = tun_read(CNF(tunfd[0]), buf + BUF_OFF, FRAME_SIZE - BUF_OFF)) == -1)
-      {
-         rlen = errno;
-         log_debug("read from tun %d returned on error: \"%s\"", CNF(tunfd[0]), strerror(rlen));
-         if (rlen == EINTR)
-         {
-            log_debug("restarting");
-            continue;
-         }
-         set_term_req();
-         break;
-      }
-      rlen += BUF_OFF;
+   // in case of TAP device handle ethernet header
+   if (CNF(use_tap))
+   {
+      if (eth_check(buf, rlen))
+         return -1;
 
-      log_debug("received on tunfd %d, framesize %d + %d", CNF(tunfd[0]), rlen - 4, 4 - BUF_OFF);
+      // removing ethernet header
+      // FIXME: it would be better to adjust pointers instead of moving data
+      rlen -= sizeof(struct ether_header);
+      memmove(eh, eh + 1, rlen - 4);
+   }
 
-#ifdef PACKET_LOG
-      if ((pktlog != -1) && (write(pktlog, buf, rlen) == -1))
-         log_debug("could not write frame to packet log: %s", strerror(errno));
+#if BUF_OFF
+   // tunnel driver does not send tunnel header (Solaris, Windows, Linux with
+   // IFF_NO_PI) thus we set it manually from the IP version
+   if ((buf[BUF_OFF] & 0xf0) == 0x60)
+      set_tunheader(buf, CNF(fhd_key[IPV6_KEY]));
+   else if ((buf[BUF_OFF] & 0xf0) == 0x40)
+      set_tunheader(buf, CNF(fhd_key[IPV4_KEY]));
+   else
+      set_tunheader(buf, -1);
 #endif
 
-      // just to be on the safe side but this should never happen
-      if ((!CNF(use_tap) && (rlen < 4)) || (CNF(use_tap) && (rlen < 4 + (int) sizeof(struct ether_header))))
-      {
-         log_msg(LOG_ERR, "frame effectively too short (rlen = %d)", rlen);
-         continue;
-      }
-
-      // in case of TAP device handle ethernet header
-      if (CNF(use_tap))
+   if (get_tunheader(buf) == CNF(fhd_key[IPV6_KEY]))
+   {
+      if (((rlen - 4) < (int) IP6HLEN))
       {
-         if (eth_check(buf, rlen))
-            continue;
-
-         // removing ethernet header
-         // FIXME: it would be better to adjust pointers instead of moving data
-         rlen -= sizeof(struct ether_header);
-         memmove(eh, eh + 1, rlen - 4);
+         log_debug("IPv6 packet too short (%d bytes). dropping", rlen - 4);
+         return -1;
       }
 
-#if defined(__sun__) || defined(__CYGWIN__)
-      // Solaris tunnel driver does not send tunnel
-      // header thus we guess and set it manually
-      if ((buf[BUF_OFF] & 0xf0) == 0x60)
-         set_tunheader(buf, CNF(fhd_key[IPV6_KEY]));
-      else if ((buf[BUF_OFF] & 0xf0) == 0x40)
-         set_tunheader(buf, CNF(fhd_key[IPV4_KEY]));
-      else
-         set_tunheader(buf, -1);
-#endif
+      IN6_ADDR_COPY(&destbuf, &buf[4 + offsetof(struct ip6_hdr, ip6_dst)]);
+      if (!(dest = ipv6_lookup_route(&destbuf, &gw)))
+         dest = &destbuf;
 
-      if (get_tunheader(buf) == CNF(fhd_key[IPV6_KEY]))
+      if (!has_ocat_prefix(dest))
       {
-         if (((rlen - 4) < (int) IP6HLEN))
-         {
-            log_debug("IPv6 packet too short (%d bytes). dropping", rlen - 4);
-            continue;
-         }
-
-         IN6_ADDR_COPY(&destbuf, &buf[4 + offsetof(struct ip6_hdr, ip6_dst)]);
-         if (!(dest = ipv6_lookup_route(&destbuf)))
-            dest = &destbuf;
-
-         if (!has_ocat_prefix(dest))
-         {
-            char abuf[INET6_ADDRSTRLEN];
-            if (!IN6_IS_ADDR_MULTICAST(&destbuf))
-               log_msg(LOG_ERR, "no route to destination %s, dropping frame.", inet_ntop(AF_INET6, &destbuf, abuf, INET6_ADDRSTRLEN));
-            continue;
-         }
+         char abuf[INET6_ADDRSTRLEN];
+         if (!IN6_IS_ADDR_MULTICAST(&destbuf))
+            log_msg(LOG_ERR, "no route to destination %s, dropping frame.", inet_ntop(AF_INET6, &destbuf, abuf, INET6_ADDRSTRLEN));
+         return -1;
       }
-      else if (get_tunheader(buf) == CNF(fhd_key[IPV4_KEY]))
+   }
+   else if (get_tunheader(buf) == CNF(fhd_key[IPV4_KEY]))
+   {
+      if (((rlen - 4) < (int) IPHDLEN))
       {
-         if (((rlen - 4) < (int) IPHDLEN))
-         {
-            log_debug("IPv4 packet too short (%d bytes). dropping", rlen - 4);
-            continue;
-         }
+         log_debug("IPv4 packet too short (%d bytes). dropping", rlen - 4);
+         return -1;
+      }
 
 #ifdef HAVE_STRUCT_IPHDR
-         in.s_addr = get_saddr((struct iphdr*) &buf[4]);
+      in.s_addr = get_saddr((struct iphdr*) &buf[4]);
 #else
-         in.s_addr = get_saddr((struct ip*) &buf[4]);
+      in.s_addr = get_saddr((struct ip*) &buf[4]);
 #endif
-         if (!(dest = ipv4_lookup_route(ntohl(in.s_addr))))
-         {
-            log_msg(LOG_ERR, "no route to destination %s, dropping frame.", inet_ntoa(in));
-            continue;
-         }
-      }
-      else
+      if (!(dest = ipv4_lookup_route(ntohl(in.s_addr), &gw)))
       {
-         log_msg(LOG_ERR, "protocol 0x%08x not supported. dropping frame.", ntohl(get_tunheader(buf)));
-         continue;
+         log_msg(LOG_ERR, "no route to destination %s, dropping frame.", inet_ntoa(in));
+         return -1;
       }
+   }
+   else
+   {
+      log_msg(LOG_ERR, "protocol 0x%08x not supported. dropping frame.", ntohl(get_tunheader(buf)));
+      return -1;
+   }
 
-      // now forward either directly or to the queue
-      if (forward_packet(dest, buf + 4, rlen - 4) == E_FWD_NOPEER)
-      {
-         log_debug("adding destination to SOCKS queue");
-         socks_queue(*dest, 0);
+   // now forward either directly or to the queue
+   if ((rc = forward_packet(dest, buf + 4, rlen - 4)) == E_FWD_NOPEER)
+   {
+      log_debug("adding destination to SOCKS queue");
+      // bind the connection to the identity which is the source of the packet
+      socks_queue_ident(*dest, 0, get_tunheader(buf) == CNF(fhd_key[IPV6_KEY]) ? &((struct ip6_hdr*) &buf[4])->ip6_src : NULL);
 #ifdef PACKET_QUEUE
-         log_debug("queuing packet");
-         queue_packet(dest, buf + 4, rlen - 4);
+      log_debug("queuing packet");
+      rc = queue_packet(dest, buf + 4, rlen - 4);
 #endif
-      }
    }
+
+   // dropped packets are not accounted
+   if (!rc)
+      flow_account(buf + 4, rlen - 4, FLOW_OUT);
+
+   return 0;
 }
 
 
@@ -1185,7 +1828,7 @@ int make_keepalive(const struct in6_addr *src, const struct in6_addr *dst, int f
 
    if (hostname != NULL && *hostname != '\0')
    {
-      len = snprintf(buf + slen, buflen - slen, "%c%s%s", 1, hostname, CNF(domain));
+      len = snprintf(buf + slen, buflen - slen, "%c%s%s", 1, hostname, NDESC_NT(addr_net_type(src), domain));
       if (len != -1 && len < buflen - slen)
       {
          len++;
@@ -1204,10 +1847,15 @@ int make_keepalive(const struct in6_addr *src, const struct in6_addr *dst, int f
 
 int send_keepalive(OcatPeer_t *peer)
 {
+   const OcatIdent_t *id;
    char buf[512];
    int len, slen;
 
-   slen = make_keepalive(&CNF(ocat_addr), &peer->addr, peer->rand, CNF(onion3_url), buf, sizeof(buf));
+   // send keepalive on behalf of the local identity of the peer
+   if ((id = get_ident(&peer->laddr)) != NULL)
+      slen = make_keepalive(&id->addr, &peer->addr, peer->rand, id->onion3_url, buf, sizeof(buf));
+   else
+      slen = make_keepalive(&CNF(ocat_addr), &peer->addr, peer->rand, CNF(onion3_url), buf, sizeof(buf));
 
    log_debug("sending %d bytes keepalive to fd %d", slen, peer->tcpfd);
 
@@ -1226,10 +1874,196 @@ int send_keepalive(OcatPeer_t *peer)
 }
 
 
-void cleanup_peers(void)
+/*! Send an ICMPv6 echo request to the peer. Any response from the remote
+ * side, regardless on which connection it is received, proves that the
+ * connection is alive.
+ * Peer MUST be locked.
+ * @param peer Pointer to peer.
+ * @return 0 on success, -1 on error.
+ */
+int send_probe(OcatPeer_t *peer)
+{
+   char buf[sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr)];
+   struct ip6_hdr *hdr = (struct ip6_hdr*) buf;
+   struct icmp6_hdr *icmp = (struct icmp6_hdr*) (hdr + 1);
+   const OcatIdent_t *id;
+   uint16_t *ckb;
+   int len;
+
+   memset(buf, 0, sizeof(buf));
+   hdr->ip6_vfc = 0x60;
+   hdr->ip6_nxt = IPPROTO_ICMPV6;
+   hdr->ip6_plen = htons(sizeof(*icmp));
+   hdr->ip6_hlim = 255;
+   if ((id = get_ident(&peer->laddr)) != NULL)
+      IN6_ADDR_COPY(&hdr->ip6_src, &id->addr);
+   else
+      IN6_ADDR_COPY(&hdr->ip6_src, &CNF(ocat_addr));
+   IN6_ADDR_COPY(&hdr->ip6_dst, &peer->addr);
+
+   icmp->icmp6_type = ICMP6_ECHO_REQUEST;
+   icmp->icmp6_id = htons(peer->rand);
+   icmp->icmp6_seq = htons(time(NULL));
+   ckb = malloc_ckbuf(hdr->ip6_src, hdr->ip6_dst, ntohs(hdr->ip6_plen), IPPROTO_ICMPV6, icmp);
+   icmp->icmp6_cksum = checksum(ckb, ntohs(hdr->ip6_plen) + sizeof(struct ip6_psh));
+   free_ckbuf(ckb);
+
+   log_debug("sending liveness probe to fd %d", peer->tcpfd);
+   if ((len = send(peer->tcpfd, buf, sizeof(buf), MSG_DONTWAIT)) == -1)
+   {
+      log_msg(LOG_ERR, "could not send probe: %s", strerror(errno));
+      return -1;
+   }
+   peer->out += len;
+   return 0;
+}
+
+
+/*! Return the latest time at which data from the remote host of a peer was
+ * received. This includes all connections which were opened by the remote
+ * host, i.e. its own outgoing connection in unidirectional mode. The times
+ * are recorded per remote address by socket_receiver().
+ * Peer MUST be locked.
+ * @param peer Pointer to peer.
+ * @return Timestamp of the latest receive.
+ */
+static time_t peer_heard(const OcatPeer_t *peer)
+{
+   time_t t = peer->rtime;
+   unsigned i, n;
+   OcatHeard_t *h;
+
+   pthread_mutex_lock(&heard_mutex_);
+   for (i = 0, n = heard_hash(&peer->addr); i < HEARD_PROBE; i++)
+   {
+      h = &heard_[(n + i) & (HEARD_SLOTS - 1)];
+      if (IN6_ARE_ADDR_EQUAL(&h->addr, &peer->addr))
+      {
+         if (h->t > t)
+            t = h->t;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&heard_mutex_);
+   return t;
+}
+
+
+/*! Return the timeout of a liveness probe. It is PERM_RTT_FACTOR times the
+ * round trip time of the previous probes but at least PERM_PROBE_TIMEOUT and
+ * at most PERM_PROBE_TIMEOUT_MAX seconds.
+ */
+static int perm_probe_timeout(const OcatPeer_t *peer)
+{
+   int tmo = peer->prtt * PERM_RTT_FACTOR;
+
+   if (tmo < PERM_PROBE_TIMEOUT)
+      return PERM_PROBE_TIMEOUT;
+   if (tmo > PERM_PROBE_TIMEOUT_MAX)
+      return PERM_PROBE_TIMEOUT_MAX;
+   return tmo;
+}
+
+
+/*! Check liveness of a permanent peer. If nothing was received for
+ * PERM_PROBE_TIME seconds a probe is sent. If it is not answered within the
+ * probe timeout (see perm_probe_timeout()) the peer is considered to be
+ * degraded and a standby connection is requested. As soon as the standby
+ * connection is active, it takes over the traffic (new peers are inserted at
+ * the beginning of the list) and the degraded peer is closed. If the peer
+ * answers before, the standby request is cancelled. Without standby it is
+ * closed PERM_FAIL_TIMEOUT seconds after the probe timeout.
+ * Peer list and peer MUST be locked.
+ * @param peer Pointer to permanent peer.
+ * @param t Current time.
+ * @return Time of the next check of this peer, 0 if there is none.
+ */
+static time_t check_perm_peer(OcatPeer_t *peer, time_t t)
+{
+   time_t heard;
+   int tmo;
+
+   if (peer->state != PEER_ACTIVE)
+      return 0;
+
+   // standby connection became active, switch over
+   if (peer->standby && search_peer(&peer->addr) != peer)
+   {
+      log_msg(LOG_NOTICE | LOG_FCONN, "switched over to standby, closing peer on fd %d", peer->tcpfd);
+      oe_close(peer->tcpfd);
+      peer->state = PEER_DELETE;
+      return 0;
+   }
+
+   heard = peer_heard(peer);
+   if (!peer->ptime)
+   {
+      if (t - heard >= PERM_PROBE_TIME && !send_probe(peer))
+      {
+         peer->ptime = t;
+         return t + perm_probe_timeout(peer);
+      }
+      // poll for the standby connection
+      return peer->standby ? t + PERM_CHECK_WAKEUP : heard + PERM_PROBE_TIME;
+   }
+
+   if (heard >= peer->ptime)
+   {
+      // smooth the round trip time with a gain of 1/4
+      peer->prtt = peer->prtt ? (3 * peer->prtt + (heard - peer->ptime) + 2) / 4 : heard - peer->ptime;
+      if (peer->standby)
+      {
+         log_msg(LOG_INFO | LOG_FCONN, "peer on fd %d recovered, cancelling standby connection", peer->tcpfd);
+         socks_cancel(peer->addr);
+         peer->standby = 0;
+      }
+      peer->ptime = 0;
+      return heard + PERM_PROBE_TIME;
+   }
+
+   tmo = perm_probe_timeout(peer);
+   if (t - peer->ptime >= tmo + PERM_FAIL_TIMEOUT)
+   {
+      log_msg(LOG_WARNING | LOG_FCONN, "peer on fd %d failed, closing", peer->tcpfd);
+      oe_close(peer->tcpfd);
+      peer->state = PEER_DELETE;
+      // make sure it gets reconnected
+      socks_queue_ident(peer->addr, 1, &peer->laddr);
+      return 0;
+   }
+
+   if (t - peer->ptime >= tmo && !peer->standby)
+   {
+      log_msg(LOG_WARNING | LOG_FCONN, "peer on fd %d degraded, requesting standby connection", peer->tcpfd);
+      socks_queue_ident(peer->addr, 1, &peer->laddr);
+      peer->standby = 1;
+   }
+   return peer->standby ? t + PERM_CHECK_WAKEUP : peer->ptime + tmo;
+}
+
+
+/*! Return the earlier one of two deadlines. 0 means no deadline.
+ */
+static time_t min_deadline(time_t a, time_t b)
+{
+   if (!a)
+      return b;
+   if (!b)
+      return a;
+   return a < b ? a : b;
+}
+
+
+/*! Close timed out peers, send keepalives and check the liveness of
+ * permanent peers.
+ * @return Time at which this function should be called next, 0 if there is
+ * no pending deadline.
+ */
+time_t cleanup_peers(void)
 {
    OcatPeer_t **p;
-   time_t act_time = time(NULL);
+   time_t act_time = time(NULL), deadline = 0;
+   int closed = 0;
 
    // cleanup peers
    lock_peers();
@@ -1246,18 +2080,26 @@ void cleanup_peers(void)
             send_keepalive(*p);
             (*p)->time = act_time;
          }
+         deadline = min_deadline(deadline, (*p)->time + KEEPALIVE_TIME);
+         deadline = min_deadline(deadline, check_perm_peer(*p, act_time));
       }
       // handle temporary connections
-      else if ((*p)->state && (*p)->state != PEER_DELETE && act_time - (*p)->time >= MAX_IDLE_TIME)
+      else if ((*p)->state && (*p)->state != PEER_DELETE)
       {
-         log_msg(LOG_INFO | LOG_FCONN, "peer %d timed out, closing and marking for deletion", (*p)->tcpfd);
-         oe_close((*p)->tcpfd);
-         (*p)->state = PEER_DELETE;
+         if (act_time - (*p)->time >= MAX_IDLE_TIME)
+         {
+            log_msg(LOG_INFO | LOG_FCONN, "peer %d timed out, closing and marking for deletion", (*p)->tcpfd);
+            oe_close((*p)->tcpfd);
+            (*p)->state = PEER_DELETE;
+         }
+         else
+            deadline = min_deadline(deadline, (*p)->time + MAX_IDLE_TIME);
       }
 
       if ((*p)->state == PEER_DELETE)
       {
          delete_peer0(p);
+         closed++;
          // restart loop at beginning
          p = get_first_peer_ptr();
       }
@@ -1265,16 +2107,25 @@ void cleanup_peers(void)
          unlock_peer(*p);
    }
    unlock_peers();
+
+   // make socket_receiver drop the closed file descriptors
+   if (closed)
+      wake_socket_receiver();
+
+   if (deadline && deadline <= act_time)
+      deadline = act_time + PERM_CHECK_WAKEUP;
+   return deadline;
 }
 
 
 /*! This thread wakes up every CLEANER_WAKUP seconds and does some house
- * keeping.
+ * keeping. In between it wakes up exactly at the next deadline of the peers
+ * to detect failing permanent connections early.
  */
 void *socket_cleaner(void *UNUSED(ptr))
 {
-   int stat_wup = 0, tid;
-   time_t act_time, saved_time = time(NULL);
+   int stat_wup = 0, tid, mod;
+   time_t act_time, saved_time = time(NULL), clean_time = time(NULL), deadline = 0, sync_time = 0;
 
    for (;;)
    {
@@ -1283,10 +2134,16 @@ void *socket_cleaner(void *UNUSED(ptr))
       if (term_req())
          break;
 
-      sleep(CLEANER_WAKEUP);
+      oc_select_until(0, NULL, NULL, NULL, min_deadline(deadline, clean_time + CLEANER_WAKEUP));
       log_debug2("wakeup");
 
+      // cleanup stale peers
+      deadline = cleanup_peers();
+
       act_time = time(NULL);
+      if (act_time - clean_time < CLEANER_WAKEUP)
+         continue;
+      clean_time = act_time;
 
       if ((tid = check_threads()))
       {
@@ -1294,13 +2151,24 @@ void *socket_cleaner(void *UNUSED(ptr))
          log_threads();
       }
 
-      // save cached hosts
-      if (is_hosts_db_modified() && act_time - saved_time > HOSTS_TIME)
+      // save cached hosts, refreshed timestamps only are saved less often
+      mod = is_hosts_db_modified();
+      if (((mod & HOSTS_MOD_DATA) && act_time - saved_time > HOSTS_TIME) ||
+            (mod && act_time - saved_time > HOSTS_AGE_TIME))
       {
          saved_time = act_time;
          hosts_save(CNF(hosts_cache));
       }
 
+#ifdef WITH_DNS_RESOLVER
+      // bulk synchronisation of hosts db
+      if (CNF(hosts_sync) && CNF(dns_lookup) && act_time - sync_time >= HOSTS_SYNC_TIME)
+      {
+         sync_time = act_time;
+         ocres_sync();
+      }
+#endif
+
       // stats output
       if (act_time - stat_wup >= STAT_WAKEUP)
       {
@@ -1320,9 +2188,6 @@ void *socket_cleaner(void *UNUSED(ptr))
       // cleanup MAC table
       mac_cleanup();
 
-      // cleanup stale peers
-      cleanup_peers();
-
       // refresh cached hosts entries
       hosts_refresh();
       // remove expired entries
@@ -1357,12 +2222,19 @@ static void memor(void *dst, const void *src, int n)
  */
 int loopback_loop(int fd)
 {
-   char buf[FRAME_SIZE];
+   char *buf;
    struct in6_addr addr;
-   struct ip6_hdr *ip6h = (struct ip6_hdr*) buf;
+   struct ip6_hdr *ip6h;
    int len, wlen, maxfd;
    fd_set rset;
 
+   if ((buf = malloc(CNF(frame_size))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not get memory for frame buffer: \"%s\"", strerror(errno));
+      return 0;
+   }
+   ip6h = (struct ip6_hdr*) buf;
+
    log_debug("starting loopback loop on fd %d", fd);
    while (!term_req())
    {
@@ -1388,7 +2260,7 @@ int loopback_loop(int fd)
       }
 
       // read from pipe
-      len = read(fd, buf, sizeof(buf));
+      len = read(fd, buf, CNF(frame_size));
       // check for error
       if (len == -1)
       {
@@ -1430,13 +2302,15 @@ int loopback_loop(int fd)
          log_msg(LOG_ERR, "truncated write: %d < %d", wlen, len);
    }
 
+   free(buf);
    return 0;
 }
 
 
 int loopback_handler(int fd, const struct in6_addr *laddr)
 {
-   char buf[FRAME_SIZE];
+   // only used for the keepalive
+   char buf[SIZE_1K];
    int len, wlen, uni;
    OcatPeer_t *peer;
 
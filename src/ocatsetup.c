@@ -112,8 +112,6 @@ struct OcatSetup setup_ =
    2
 #endif
    ,
-   // socksfd
-   {-1, -1},
    // net_type
    NTYPE_TOR,
    // max_ctrl, ctrl_active
@@ -143,7 +141,33 @@ struct OcatSetup setup_ =
    // expiry time
    HOSTS_EXPIRE,
    // verify_dest
-   1
+   1,
+   // ring_path
+   NULL,
+   // ident
+   NULL,
+   // ident_cnt
+   0,
+   // net2_type
+   -1,
+   // socks2_dst
+   {0},
+   // tun_mtu
+   0,
+   // frame_size
+   FRAME_SIZE,
+   // socks_opt_data
+   0,
+   // tcp_fastopen
+   0,
+   // hosts_sync
+   0,
+   // shm_hosts
+   NULL,
+   // flow_slots
+   0,
+   // expire_opt
+   0
 };
 
 
@@ -304,6 +328,17 @@ void print_setup_struct(int fd)
          "ocat_ns_port           = %d\n"
          "expire                 = %d\n"
          "verify_dest            = %d\n"
+         "ring_path              = %s\n"
+         "ident_cnt              = %d\n"
+         "net2_type              = %d\n"
+         "tun_mtu                = %d\n"
+         "frame_size             = %d\n"
+         "socks_opt_data         = %d\n"
+         "tcp_fastopen           = %d\n"
+         "hosts_sync             = %d\n"
+         "shm_hosts              = %s\n"
+         "flow_slots             = %d\n"
+         "expire_opt             = %d\n"
          "----------------------\n"
          ,
          IPV4_KEY, ntohl(setup_.fhd_key[IPV4_KEY]), IPV6_KEY, ntohl(setup_.fhd_key[IPV6_KEY]),
@@ -356,7 +391,18 @@ void print_setup_struct(int fd)
          setup_.validate_remnames,
          setup_.ocat_ns_port,
          setup_.expire,
-         setup_.verify_dest
+         setup_.verify_dest,
+         SSTR(setup_.ring_path),
+         setup_.ident_cnt,
+         setup_.net2_type,
+         setup_.tun_mtu,
+         setup_.frame_size,
+         setup_.socks_opt_data,
+         setup_.tcp_fastopen,
+         setup_.hosts_sync,
+         SSTR(setup_.shm_hosts),
+         setup_.flow_slots,
+         setup_.expire_opt
          );
 
    if (inet_ntops((struct sockaddr*) setup_.socks_dst, &sas))
@@ -373,6 +419,9 @@ void print_setup_struct(int fd)
    else
       log_msg(LOG_WARNING, "could not convert struct sockaddr: \"%s\"", strerror(errno));
 
+   if (setup_.net2_type != -1 && inet_ntops((struct sockaddr*) &setup_.socks2_dst, &sas))
+      dprintf(fd, "socks2_dst             = %s:%d\n", sas.sstr_addr, ntohs(sas.sstr_port));
+
    for (i = 0; i < CNF(oc_listen_cnt); i++)
    {
       if (inet_ntops(CNF(oc_listen)[i], &sas))
@@ -394,12 +443,240 @@ void print_setup_struct(int fd)
 
 void lock_setup(void)
 {
-   pthread_mutex_lock(&setup_.mutex);
+   oc_mutex_lock(&setup_.mutex, LOCK_SETUP);
 }
 
 
 void unlock_setup(void)
 {
-   pthread_mutex_unlock(&setup_.mutex);
+   oc_mutex_unlock(&setup_.mutex, LOCK_SETUP);
+}
+
+
+
+/*! Derive the local IPv6 (and IPv4) address from the onion hostname which
+ * was previously copied to CNF(onion_url). The domain is removed from
+ * CNF(onion_url) and v3 hostnames are additionally stored in
+ * CNF(onion3_url).
+ * @return 0 on success, -1 if the hostname is invalid.
+ */
+int set_ocat_addr(void)
+{
+   if (validate_hostname(CNF(onion_url)) == -1)
+      return -1;
+   *strchr(CNF(onion_url), '.') = '\0';
+
+   // if it is a v3 hostname
+   if ((int) strlen(CNF(onion_url)) == CNF(l_hs_namelen))
+   {
+      // copy it to the dedicated v3 variable
+      strlcpy(CNF(onion3_url), CNF(onion_url), sizeof(CNF(onion3_url)));
+      // truncate name for IPv6 conversion to the lower 16 chars
+      strlcpy(CNF(onion_url), &CNF(onion_url[CNF(l_hs_namelen) - 16]), 17);
+   }
+   if (oniontipv6(CNF(onion_url), &CNF(ocat_addr)) == -1)
+   {
+      log_msg(LOG_ERR, "parameter seems not to be valid onion hostname");
+      return -1;
+   }
+   if (CNF(ipv4_enable))
+      oniontipv4(CNF(onion_url), &CNF(ocat_addr4), ntohl(CNF(ocat_addr4_mask)));
+
+   // add own address to hosts DB
+   if (*CNF(onion3_url))
+   {
+      char hname[300];
+      snprintf(hname, sizeof(hname), "%s%s", CNF(onion3_url), CNF(domain));
+      hosts_add_entry(&CNF(ocat_addr), hname, HSRC_SELF, time(NULL), -1);
+   }
+
+   memcpy(&CNF(ocat_hwaddr[3]), &CNF(ocat_addr.s6_addr[13]), 3);
+
+   return 0;
+}
+
+
+/*! Add an additional local onion identity. The hostname may be followed by
+ * a colon and a port number. In that case a separate listener is created on
+ * that port and incoming connections on this listener are bound to the
+ * identity. This must be called after set_ocat_addr() because identities
+ * which equal the main address are rejected.
+ * @param spec Hostname including domain, optionally followed by ":port".
+ * @return 0 on success, -1 on error.
+ */
+int add_ocat_ident(const char *spec)
+{
+   char name[SIZE_256], *s;
+   OcatIdent_t *id;
+   int len, port = 0;
+
+   strlcpy(name, spec, sizeof(name));
+   if ((s = strchr(name, ':')) != NULL)
+   {
+      *s++ = '\0';
+      if ((port = atoi(s)) <= 0 || port > 65535)
+      {
+         log_msg(LOG_ERR, "illegal port number \"%s\"", s);
+         return -1;
+      }
+   }
+
+   if (CNF(ident_cnt) >= MAX_IDENT)
+   {
+      log_msg(LOG_ERR, "maximum number of identities (%d) reached", MAX_IDENT);
+      return -1;
+   }
+
+   if ((id = realloc(CNF(ident), sizeof(*id) * (CNF(ident_cnt) + 1))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not get memory for identity: \"%s\"", strerror(errno));
+      return -1;
+   }
+   CNF(ident) = id;
+   id = &CNF(ident[CNF(ident_cnt)]);
+   memset(id, 0, sizeof(*id));
+
+   if ((len = validate_onionname(name, &id->addr)) == -1)
+      return -1;
+   id->net_type = addr_net_type(&id->addr);
+
+   if (is_local_addr(&id->addr))
+   {
+      log_msg(LOG_ERR, "identity \"%s\" already exists", name);
+      return -1;
+   }
+
+   if (len == NDESC_NT(id->net_type, l_hs_namelen))
+   {
+      strlcpy(id->onion3_url, name, sizeof(id->onion3_url));
+      *strchr(id->onion3_url, '.') = '\0';
+      hosts_add_entry(&id->addr, name, HSRC_SELF, time(NULL), -1);
+   }
+   strlcpy(id->onion_url, &name[len - ONION_URL_LEN], sizeof(id->onion_url));
+   id->port = port;
+   CNF(ident_cnt)++;
+
+   log_msg(LOG_INFO, "added identity %s, port %d", name, port);
+   return 0;
 }
 
+
+/*! Add the listeners of the additional identities. This must be called
+ * after the default listeners were set up.
+ */
+void add_ident_listeners(void)
+{
+   char def[100];
+   int i;
+
+   for (i = 0; i < CNF(ident_cnt); i++)
+   {
+      if (!CNF(ident[i].port))
+         continue;
+      snprintf(def, sizeof(def), "%s:%d", CNF(socks5) == CONNTYPE_DIRECT ? "[::]" : "127.0.0.1", CNF(ident[i].port));
+      add_listener(def);
+   }
+}
+
+
+/*! Find additional identity by its IPv6 address.
+ * @return Pointer to identity or NULL if the address is not an additional
+ * identity.
+ */
+const OcatIdent_t *get_ident(const struct in6_addr *addr)
+{
+   int i;
+
+   for (i = 0; i < CNF(ident_cnt); i++)
+      if (IN6_ARE_ADDR_EQUAL(&CNF(ident[i].addr), addr))
+         return &CNF(ident[i]);
+
+   return NULL;
+}
+
+
+/*! Find additional identity by the local port of an accepted connection.
+ * @param fd File descriptor of the connection.
+ * @return Pointer to identity or NULL if the connection was not accepted on
+ * the listener of an additional identity.
+ */
+const OcatIdent_t *get_ident_by_fd(int fd)
+{
+   struct sockaddr_in6 in6;
+   socklen_t alen = sizeof(in6);
+   int i, port;
+
+   if (!CNF(ident_cnt))
+      return NULL;
+
+   if (getsockname(fd, (struct sockaddr*) &in6, &alen) == -1)
+   {
+      log_msg(LOG_ERR, "getsockname() on %d failed: \"%s\"", fd, strerror(errno));
+      return NULL;
+   }
+
+   // port is at the same position in sockaddr_in and sockaddr_in6
+   port = ntohs(in6.sin6_port);
+   for (i = 0; i < CNF(ident_cnt); i++)
+      if (CNF(ident[i].port) == port)
+         return &CNF(ident[i]);
+
+   return NULL;
+}
+
+
+/*! Check if address is one of the local addresses.
+ * @return 1 if addr is CNF(ocat_addr) or one of the additional identities,
+ * otherwise 0.
+ */
+int is_local_addr(const struct in6_addr *addr)
+{
+   return IN6_ARE_ADDR_EQUAL(addr, &CNF(ocat_addr)) || get_ident(addr) != NULL;
+}
+
+
+void print_idents(int fd)
+{
+   char astr[INET6_ADDRSTRLEN];
+   int i;
+
+   inet_ntop(AF_INET6, &CNF(ocat_addr), astr, sizeof(astr));
+   dprintf(fd, "%s %s%s (default)\n", astr, *CNF(onion3_url) ? CNF(onion3_url) : CNF(onion_url), CNF(domain));
+   for (i = 0; i < CNF(ident_cnt); i++)
+   {
+      inet_ntop(AF_INET6, &CNF(ident[i].addr), astr, sizeof(astr));
+      dprintf(fd, "%s %s%s port %d\n", astr, *CNF(ident[i].onion3_url) ? CNF(ident[i].onion3_url) : CNF(ident[i].onion_url), NDESC_NT(CNF(ident[i].net_type), domain), CNF(ident[i].port));
+   }
+}
+
+
+/*! Enable the 2nd network (I2P in OnionCat mode, Tor in GarliCat mode) and
+ * set the address of its SOCKS server. Destinations within the prefix of the
+ * 2nd network are connected through this SOCKS server.
+ * @param s Address string of the SOCKS server, [<ip>:]<port>.
+ * @return 0 on success, -1 on error.
+ */
+int set_socks2_dst(const char *s)
+{
+   struct sockaddr_in *sin = (struct sockaddr_in*) &CNF(socks2_dst);
+   const uint32_t loop_ = htonl(INADDR_LOOPBACK);
+
+   CNF(net2_type) = CNF(net_type) == NTYPE_TOR ? NTYPE_I2P : NTYPE_TOR;
+
+   memset(&CNF(socks2_dst), 0, sizeof(CNF(socks2_dst)));
+   sin->sin_family = AF_INET;
+   sin->sin_port = htons(NDESC_NT(CNF(net2_type), socks_port));
+   memcpy(&sin->sin_addr, &loop_, sizeof(sin->sin_addr));
+#ifdef HAVE_SIN_LEN
+   sin->sin_len = sizeof(*sin);
+#endif
+
+   if (strsockaddr(s, (struct sockaddr*) &CNF(socks2_dst)) == -1)
+   {
+      CNF(net2_type) = -1;
+      return -1;
+   }
+
+   log_msg(LOG_INFO, "serving %s network in parallel", CNF(net2_type) == NTYPE_I2P ? "I2P" : "Tor");
+   return 0;
+}
@@ -0,0 +1,326 @@
+/* Copyright 2008-2024 Bernhard R. Fischer.
+ *
+ * This file is part of OnionCat.
+ *
+ * OnionCat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * OnionCat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with OnionCat. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file ocatshm.c
+ *  This file contains the hosts store which is shared between several
+ *  OnionCat processes on the same host (option -Z). It is an open-addressing
+ *  hash table keyed by the IPv6 address within a file which is mapped with
+ *  mmap(2) by all processes. Each slot is protected by a sequence lock: a
+ *  writer makes the sequence number odd while it modifies the slot, readers
+ *  retry if the sequence number was odd or changed while they copied the slot.
+ *  Slots are never removed, expired slots are reused for new addresses.
+ *
+ *  \author Bernhard R. Fischer <bf@abenteuerland.at>
+ *  \date 2024/06/23
+ */
+
+
+#include <sched.h>
+
+#include "ocat.h"
+#include "ocathosts.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+
+//! magic number of shared hosts file ("OCSH")
+#define SHM_HOSTS_MAGIC 0x4f435348
+#define SHM_HOSTS_VERSION 1
+//! number of slots, must be a power of 2
+#define SHM_HOSTS_SLOTS 4096
+//! max. number of attempts to lock or read a slot
+#define SHM_HOSTS_SPIN 1000
+
+
+//! header of shared hosts file
+typedef struct ShmHostsHdr
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t slots;         //!< number of slots
+   uint32_t slot_size;     //!< size of a slot
+} ShmHostsHdr_t;
+
+//! slot of shared hosts table
+typedef struct ShmHostsEnt
+{
+   uint32_t seq;           //!< sequence lock, odd while the slot is written
+   int32_t source;         //!< source of entry (hsrc_t)
+   int32_t ttl;            //!< ttl relative to age, -1 never expires
+   int32_t pad;
+   int64_t age;            //!< time of last update
+   struct in6_addr addr;   //!< address, unspecified if slot is empty
+   char name[SIZE_256];
+} ShmHostsEnt_t;
+
+
+static ShmHostsHdr_t *shm_hdr_ = NULL;
+static ShmHostsEnt_t *shm_ent_ = NULL;
+
+
+/*! Open and map the shared hosts file. It is created and initialized if it
+ * does not exist yet.
+ * @param path Path to file.
+ * @return 0 on success, -1 on error.
+ */
+int shm_hosts_open(const char *path)
+{
+   size_t size = sizeof(ShmHostsHdr_t) + SHM_HOSTS_SLOTS * sizeof(ShmHostsEnt_t);
+   struct flock fl;
+   struct stat st;
+   void *p;
+   int fd;
+
+   if ((fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+   {
+      log_msg(LOG_ERR, "could not open shared hosts file \"%s\": \"%s\"", path, strerror(errno));
+      return -1;
+   }
+
+   // serialize initialization between processes
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = F_WRLCK;
+   fl.l_whence = SEEK_SET;
+   if (fcntl(fd, F_SETLKW, &fl) == -1)
+      log_msg(LOG_WARNING, "could not lock \"%s\": \"%s\"", path, strerror(errno));
+
+   if (fstat(fd, &st) == -1 || (st.st_size < (off_t) size && ftruncate(fd, size) == -1))
+   {
+      log_msg(LOG_ERR, "could not resize shared hosts file \"%s\": \"%s\"", path, strerror(errno));
+      oe_close(fd);
+      return -1;
+   }
+
+   if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+   {
+      log_msg(LOG_ERR, "could not map shared hosts file \"%s\": \"%s\"", path, strerror(errno));
+      oe_close(fd);
+      return -1;
+   }
+
+   shm_hdr_ = p;
+   if (!shm_hdr_->magic)
+   {
+      log_msg(LOG_INFO, "initializing shared hosts file \"%s\"", path);
+      shm_hdr_->version = SHM_HOSTS_VERSION;
+      shm_hdr_->slots = SHM_HOSTS_SLOTS;
+      shm_hdr_->slot_size = sizeof(ShmHostsEnt_t);
+      __atomic_store_n(&shm_hdr_->magic, SHM_HOSTS_MAGIC, __ATOMIC_RELEASE);
+   }
+   // the lock is released by close
+   oe_close(fd);
+
+   if (shm_hdr_->magic != SHM_HOSTS_MAGIC || shm_hdr_->version != SHM_HOSTS_VERSION ||
+         shm_hdr_->slots != SHM_HOSTS_SLOTS || shm_hdr_->slot_size != sizeof(ShmHostsEnt_t))
+   {
+      log_msg(LOG_ERR, "incompatible shared hosts file \"%s\"", path);
+      munmap(p, size);
+      shm_hdr_ = NULL;
+      return -1;
+   }
+
+   shm_ent_ = (ShmHostsEnt_t*) (shm_hdr_ + 1);
+   log_msg(LOG_INFO, "hosts db shared through \"%s\"", path);
+   return 0;
+}
+
+
+static unsigned shm_hash(const struct in6_addr *addr)
+{
+   uint32_t a, b;
+
+   // the lower 64 bits are derived from the onion name and thus random
+   memcpy(&a, &addr->s6_addr[8], sizeof(a));
+   memcpy(&b, &addr->s6_addr[12], sizeof(b));
+   return (a ^ b) & (SHM_HOSTS_SLOTS - 1);
+}
+
+
+static int shm_expired(const ShmHostsEnt_t *e, time_t now)
+{
+   return e->ttl >= 0 && e->age + e->ttl < now;
+}
+
+
+/*! Lock a slot for writing.
+ * @return 0 on success, -1 if the slot could not be locked which may happen
+ * if a process died while it wrote the slot.
+ */
+static int shm_lock(ShmHostsEnt_t *e)
+{
+   uint32_t seq;
+   int i;
+
+   for (i = 0; i < SHM_HOSTS_SPIN; i++)
+   {
+      seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+      if (!(seq & 1) && __atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+         return 0;
+      sched_yield();
+   }
+   return -1;
+}
+
+
+static void shm_unlock(ShmHostsEnt_t *e)
+{
+   __atomic_add_fetch(&e->seq, 1, __ATOMIC_RELEASE);
+}
+
+
+/*! Copy a slot consistently.
+ * @return 0 on success, -1 if no consistent copy could be made.
+ */
+static int shm_read(const ShmHostsEnt_t *e, ShmHostsEnt_t *dst)
+{
+   uint32_t seq;
+   int i;
+
+   for (i = 0; i < SHM_HOSTS_SPIN; i++)
+   {
+      if ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1)
+      {
+         sched_yield();
+         continue;
+      }
+      memcpy(dst, e, sizeof(*dst));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+      {
+         dst->name[sizeof(dst->name) - 1] = '\0';
+         return 0;
+      }
+   }
+   return -1;
+}
+
+
+/*! Add or update an entry in the shared hosts table. An existing entry is
+ * only updated if the source is less or equal, or if it is expired (see
+ * hosts_add_entry_unlocked()). Only entries learned from the network with a
+ * finite TTL are stored, otherwise they would never leave the table.
+ * @param addr Pointer to IPv6 address.
+ * @param name Pointer to hostname.
+ * @param source Source of entry.
+ * @param age Time of update.
+ * @param ttl TTL relative to age.
+ * @return 0 on success, -1 if the entry was not stored.
+ */
+int shm_hosts_put(const struct in6_addr *addr, const char *name, int source, time_t age, int ttl)
+{
+   ShmHostsEnt_t *e, *free_slot = NULL;
+   time_t now = time(NULL);
+   unsigned h, i;
+
+   if (shm_ent_ == NULL || source < HSRC_KPLV || ttl < 0 || strlen(name) >= sizeof(e->name))
+      return -1;
+
+   // look up address until an empty slot is found, remember first free slot
+   for (i = 0, h = shm_hash(addr); i < SHM_HOSTS_SLOTS; i++, h = (h + 1) & (SHM_HOSTS_SLOTS - 1))
+   {
+      e = &shm_ent_[h];
+      // a skipped slot could contain the address, thus give up
+      if (shm_lock(e) == -1)
+         return -1;
+
+      if (IN6_ARE_ADDR_EQUAL(&e->addr, addr))
+      {
+         if (e->source >= source || shm_expired(e, now))
+         {
+            strlcpy(e->name, name, sizeof(e->name));
+            e->source = source;
+            e->age = age;
+            e->ttl = ttl;
+         }
+         shm_unlock(e);
+         return 0;
+      }
+
+      if (IN6_IS_ADDR_UNSPECIFIED(&e->addr))
+      {
+         shm_unlock(e);
+         if (free_slot == NULL)
+            free_slot = e;
+         break;
+      }
+
+      if (free_slot == NULL && shm_expired(e, now))
+         free_slot = e;
+      shm_unlock(e);
+   }
+
+   if (free_slot == NULL || shm_lock(free_slot) == -1)
+      return -1;
+
+   // slot may have been taken by another process in between
+   if (!IN6_IS_ADDR_UNSPECIFIED(&free_slot->addr) && !shm_expired(free_slot, now) &&
+         !IN6_ARE_ADDR_EQUAL(&free_slot->addr, addr))
+   {
+      shm_unlock(free_slot);
+      return -1;
+   }
+
+   strlcpy(free_slot->name, name, sizeof(free_slot->name));
+   free_slot->source = source;
+   free_slot->age = age;
+   free_slot->ttl = ttl;
+   IN6_ADDR_COPY(&free_slot->addr, addr);
+   shm_unlock(free_slot);
+   return 0;
+}
+
+
+/*! Look up an address in the shared hosts table. Expired entries are
+ * ignored.
+ * @param addr Pointer to IPv6 address.
+ * @param name Pointer to buffer which receives the hostname.
+ * @param len Size of buffer.
+ * @param source Pointer to variable which receives the source.
+ * @param age Pointer to variable which receives the age.
+ * @param ttl Pointer to variable which receives the ttl.
+ * @return 0 if the entry was found, otherwise -1.
+ */
+int shm_hosts_get(const struct in6_addr *addr, char *name, int len, int *source, time_t *age, int *ttl)
+{
+   ShmHostsEnt_t e;
+   unsigned h, i;
+
+   if (shm_ent_ == NULL)
+      return -1;
+
+   for (i = 0, h = shm_hash(addr); i < SHM_HOSTS_SLOTS; i++, h = (h + 1) & (SHM_HOSTS_SLOTS - 1))
+   {
+      if (shm_read(&shm_ent_[h], &e) == -1)
+         continue;
+      if (IN6_IS_ADDR_UNSPECIFIED(&e.addr))
+         break;
+      if (!IN6_ARE_ADDR_EQUAL(&e.addr, addr))
+         continue;
+      if (shm_expired(&e, time(NULL)))
+         break;
+
+      strlcpy(name, e.name, len);
+      *source = e.source;
+      *age = e.age;
+      *ttl = e.ttl;
+      return 0;
+   }
+   return -1;
+}
+
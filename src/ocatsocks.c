@@ -33,6 +33,25 @@
 
 // SOCKS connector queue vars
 static SocksQueue_t *socks_queue_ = NULL;
+//! requests of other threads to the connector
+static OcatMpscNode_t *socks_inbox_ = NULL;
+//! wakeup notifier of the connector
+static OcatNotify_t socks_notify_ = {{-1, -1}, 0};
+
+//! number of hash buckets of the pending set, must be a power of 2
+#define PENDING_HASH_SIZE 256
+
+//! element of the set of pending destinations
+typedef struct SocksPending
+{
+   struct SocksPending *next;
+   struct in6_addr addr;
+   time_t hold;            //!< requests are dropped until this time, 0 while queued
+} SocksPending_t;
+
+//! set of destinations which are queued or connecting, shared by all threads
+static SocksPending_t *pending_[PENDING_HASH_SIZE];
+static pthread_mutex_t pending_mutex_ = PTHREAD_MUTEX_INITIALIZER;
 
 #define SOCKS_MIN_BUFLEN (sizeof(SocksHdr_t) + NDESC(name_size) + strlen(CNF(usrname)) + 2)
 #define SOCKS_BUFLEN (SOCKS_MIN_BUFLEN + NI_MAXHOST + 32)
@@ -56,13 +75,25 @@ static int get_hostname(const SocksQueue_t *sq, char *onion, int onion_size)
    if (ret == -1 && onion != NULL)
    {
       ipv6tonion(&sq->addr, onion);
-      strlcat(onion, CNF(domain), onion_size);
+      strlcat(onion, NDESC_NT(addr_net_type(&sq->addr), domain), onion_size);
    }
 
    return ret;
 }
 
 
+/*! Get SOCKS server of the network the address belongs to.
+ * @param addr Pointer to destination address.
+ * @return Pointer to sockaddr of SOCKS server.
+ */
+static const struct sockaddr *socks_dst_by_addr(const struct in6_addr *addr)
+{
+   if (CNF(net2_type) != -1 && addr_net_type(addr) == CNF(net2_type))
+      return (struct sockaddr*) &CNF(socks2_dst);
+   return (struct sockaddr*) CNF(socks_dst);
+}
+
+
 #define DIRECT_CONNECTIONS
 #ifdef DIRECT_CONNECTIONS
 static int hostname_addr(const char *name, struct sockaddr *addr, socklen_t *len)
@@ -104,6 +135,153 @@ static int hostname_addr(const char *name, struct sockaddr *addr, socklen_t *len
 
    return 0;
 }
+
+
+//! cache entry of name lookups for DIRECT connections
+typedef struct DirectCache
+{
+   struct DirectCache *next;
+   char name[NI_MAXHOST];
+   struct sockaddr_storage addr;
+   socklen_t len;          //!< length of addr, 0 if lookup failed
+   time_t expire;          //!< expiry time, 0 while lookup is pending
+   int busy;               //!< lookup is in progress
+} DirectCache_t;
+
+static DirectCache_t *dcache_ = NULL;
+static pthread_mutex_t dcache_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dcache_cond_ = PTHREAD_COND_INITIALIZER;
+//! number of running and idle resolver threads
+static int dresolver_cnt_ = 0;
+static int dresolver_idle_ = 0;
+
+
+/*! The direct_resolver is a worker thread which resolves the hostnames of
+ * DIRECT connections with the blocking getaddrinfo(3). Thereby the
+ * connector never blocks on name lookups. Up to DIRECT_RESOLVERS threads are
+ * started, thus a slow lookup does not delay the others. The results are
+ * cached for DIRECT_CACHE_TTL seconds (failed lookups for
+ * DIRECT_CACHE_NEG_TTL seconds) because getaddrinfo(3) does not return the
+ * TTL of the records. The threads terminate on a termination request after
+ * they were woken up by wake_direct_resolvers().
+ */
+static void *direct_resolver(void *UNUSED(p))
+{
+   char name[NI_MAXHOST];
+   struct sockaddr_storage ss;
+   socklen_t len;
+   DirectCache_t *dc;
+
+   pthread_mutex_lock(&dcache_mutex_);
+   while (!term_req())
+   {
+      for (dc = dcache_; dc && (dc->expire || dc->busy); dc = dc->next);
+      if (dc == NULL)
+      {
+         dresolver_idle_++;
+         pthread_cond_wait(&dcache_cond_, &dcache_mutex_);
+         dresolver_idle_--;
+         continue;
+      }
+      dc->busy = 1;
+      strlcpy(name, dc->name, sizeof(name));
+      pthread_mutex_unlock(&dcache_mutex_);
+
+      log_debug("resolving \"%s\"", name);
+      len = sizeof(ss);
+      if (hostname_addr(name, (struct sockaddr*) &ss, &len))
+         len = 0;
+
+      pthread_mutex_lock(&dcache_mutex_);
+      // entry may not be removed while it is pending
+      memcpy(&dc->addr, &ss, sizeof(ss));
+      dc->len = len;
+      dc->busy = 0;
+      dc->expire = time(NULL) + (len ? DIRECT_CACHE_TTL : DIRECT_CACHE_NEG_TTL);
+      sig_socks_connector();
+   }
+   dresolver_cnt_--;
+   pthread_mutex_unlock(&dcache_mutex_);
+
+   return NULL;
+}
+
+
+/*! Wake up all idle direct_resolver threads, e.g. to let them terminate.
+ */
+static void wake_direct_resolvers(void)
+{
+   pthread_mutex_lock(&dcache_mutex_);
+   pthread_cond_broadcast(&dcache_cond_);
+   pthread_mutex_unlock(&dcache_mutex_);
+}
+
+
+/*! Look up the address of the hostname of a DIRECT connection in the cache.
+ * If it is not found, the lookup is handed over to the direct_resolver()
+ * thread which wakes up the connector when the result is available. Expired
+ * entries are removed from the cache.
+ * @param name Pointer to hostname.
+ * @param addr Pointer to sockaddr which receives the address.
+ * @param len Pointer to length of addr, it is set to the length of the
+ * address.
+ * @return 0 on success, 1 if the lookup is pending, -1 if the lookup failed.
+ */
+static int direct_lookup(const char *name, struct sockaddr *addr, socklen_t *len)
+{
+   DirectCache_t **dc, *d;
+   time_t t = time(NULL);
+   int ret = 1;
+
+   pthread_mutex_lock(&dcache_mutex_);
+   for (dc = &dcache_; *dc; )
+   {
+      if ((*dc)->expire && (*dc)->expire <= t)
+      {
+         d = *dc;
+         *dc = d->next;
+         mem_release(MEM_RESOLV, sizeof(*d));
+         free(d);
+         continue;
+      }
+      if (!strcmp((*dc)->name, name))
+         break;
+      dc = &(*dc)->next;
+   }
+
+   if ((d = *dc) != NULL)
+   {
+      if (d->expire && d->len)
+      {
+         memcpy(addr, &d->addr, d->len > *len ? *len : d->len);
+         *len = d->len;
+         ret = 0;
+      }
+      else if (d->expire)
+         ret = -1;
+   }
+   else if (mem_charge(MEM_RESOLV, sizeof(*d)) == -1 || (d = calloc(1, sizeof(*d))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not queue lookup of \"%s\"", name);
+      ret = -1;
+   }
+   else
+   {
+      strlcpy(d->name, name, sizeof(d->name));
+      *dc = d;
+      // start another resolver if all are busy
+      if (!dresolver_idle_ && dresolver_cnt_ < DIRECT_RESOLVERS)
+      {
+         dresolver_cnt_++;
+         run_ocat_thread("dresolver", direct_resolver, NULL);
+      }
+      else
+         pthread_cond_signal(&dcache_cond_);
+   }
+   pthread_mutex_unlock(&dcache_mutex_);
+
+   return ret;
+}
 #endif
 
 
@@ -175,10 +353,37 @@ int socks_rec_response(SocksQueue_t *sq)
 }
 
 
+#ifdef PACKET_QUEUE
+/*! Release the optimistic data of a SOCKS request.
+ * @param sq Pointer to SOCKS queue element.
+ * @param requeue Set to 1 to put the packets back to the packet queue
+ * because the connection failed and they were not delivered.
+ */
+static void socks_free_opt_data(SocksQueue_t *sq, int requeue)
+{
+   if (sq->opt_data == NULL)
+      return;
+
+   if (requeue)
+   {
+      log_debug("requeuing %d bytes of optimistic data", sq->opt_len);
+      requeue_packets(&sq->addr, sq->opt_data, sq->opt_len);
+   }
+   free(sq->opt_data);
+   sq->opt_data = NULL;
+   sq->opt_len = 0;
+}
+#else
+#define socks_free_opt_data(x, y)
+#endif
+
+
 int socks_activate_peer(SocksQueue_t *sq)
 {
    OcatPeer_t *peer;
 
+   // the optimistic data was delivered with the connection
+   socks_free_opt_data(sq, 0);
    insert_peer(sq->fd, sq, time(NULL) - sq->connect_time);
 
    // Send first keepalive immediately
@@ -198,41 +403,122 @@ int socks_activate_peer(SocksQueue_t *sq)
 }
 
 
-/*! This writes a SocksQueue element to the socks connector pipe.
- * @param sq Filled out SocksQueue_t struct.
- */
-void socks_pipe_request(const SocksQueue_t *sq)
+static unsigned pending_hash(const struct in6_addr *addr)
 {
-   fd_set wset;
-   int maxfd;
-   int len = sizeof(*sq), ret;
+   uint32_t h;
+
+   // the lower bits of OnionCat addresses are part of a hash anyway
+   memcpy(&h, &addr->s6_addr[12], sizeof(h));
+   return h & (PENDING_HASH_SIZE - 1);
+}
 
-   for (maxfd = 0; !maxfd;)
-   {
-      FD_ZERO(&wset);
-      FD_SET(CNF(socksfd[1]), &wset);
-      if ((maxfd = oc_select(CNF(socksfd[1]) + 1, NULL, &wset, NULL)) == -1)
-         return;
-   }
 
-   if (FD_ISSET(CNF(socksfd[1]), &wset))
+/*! Add an address to the set of pending destinations. Destinations which
+ * are held back by socks_hold() are reported as pending until the hold
+ * expires. Expired holds of other destinations in the same bucket are
+ * removed.
+ * @param addr Pointer to IPv6 address.
+ * @return 0 if the address was added, 1 if it already was pending, or -1 on
+ * error.
+ */
+static int pending_add(const struct in6_addr *addr)
+{
+   SocksPending_t **sp, *p;
+   time_t t = time(NULL);
+
+   pthread_mutex_lock(&pending_mutex_);
+   for (sp = &pending_[pending_hash(addr)]; *sp; )
    {
-      log_debug("writing %d bytes to fd %d", len, CNF(socksfd[1]));
-      if ((ret = write(CNF(socksfd[1]), sq, len)) == -1)
+      p = *sp;
+      if (IN6_ARE_ADDR_EQUAL(&p->addr, addr))
       {
-         log_msg(LOG_WARNING, "error writing to SOCKS request pipe fd %d: \"%s\"", CNF(socksfd[1]), strerror(errno));
+         if (!p->hold || p->hold > t)
+         {
+            pthread_mutex_unlock(&pending_mutex_);
+            return 1;
+         }
+         // hold expired, entry is taken over by the new request
+         p->hold = 0;
+         pthread_mutex_unlock(&pending_mutex_);
+         return 0;
       }
-      else if (ret < len)
+      if (p->hold && p->hold <= t)
       {
-         log_msg(LOG_WARNING, "write to SOCKS request pipe fd %d truncated to %d bytes of %d", CNF(socksfd[1]), ret, len);
+         *sp = p->next;
+         mem_release(MEM_SOCKS, sizeof(*p));
+         free(p);
+         continue;
       }
-      else
+      sp = &p->next;
+   }
+
+   if ((p = malloc(sizeof(*p))) == NULL)
+   {
+      pthread_mutex_unlock(&pending_mutex_);
+      log_msg(LOG_ERR, "could not get memory for pending SOCKS request: \"%s\"", strerror(errno));
+      return -1;
+   }
+   mem_account(MEM_SOCKS, sizeof(*p));
+   IN6_ADDR_COPY(&p->addr, addr);
+   p->hold = 0;
+   p->next = NULL;
+   *sp = p;
+   pthread_mutex_unlock(&pending_mutex_);
+
+   return 0;
+}
+
+
+/*! Remove an address from the set of pending destinations.
+ * @param addr Pointer to IPv6 address.
+ */
+static void pending_del(const struct in6_addr *addr)
+{
+   SocksPending_t **sp, *p;
+
+   pthread_mutex_lock(&pending_mutex_);
+   for (sp = &pending_[pending_hash(addr)]; *sp; sp = &(*sp)->next)
+      if (IN6_ARE_ADDR_EQUAL(&(*sp)->addr, addr))
       {
-         log_debug("wrote %d bytes to SOCKS request pipe fd %d", len, CNF(socksfd[1]));
+         p = *sp;
+         *sp = p->next;
+         mem_release(MEM_SOCKS, sizeof(*p));
+         free(p);
+         break;
       }
+   pthread_mutex_unlock(&pending_mutex_);
+}
+
+
+/*! This passes a SocksQueue element to the connector thread. The element is
+ * copied to the lock-free request queue and the connector is woken up. The
+ * wakeups of several requests are coalesced.
+ * @param sq Filled out SocksQueue_t struct.
+ * @return 0 on success, -1 if the request was not queued.
+ */
+int socks_pipe_request(const SocksQueue_t *sq)
+{
+   SocksQueue_t *req;
+
+   // queue output requests of the controller are never refused
+   if (IN6_IS_ADDR_UNSPECIFIED(&sq->addr))
+      mem_account(MEM_SOCKS, sizeof(*req));
+   else if (mem_charge(MEM_SOCKS, sizeof(*req)) == -1)
+   {
+      log_msg(LOG_WARNING, "memory limit reached, SOCKS request not queued");
+      return -1;
    }
-   else
-      log_msg(LOG_WARNING, "fd %d not in write set", CNF(socksfd[1]));
+
+   if (!(req = malloc(sizeof(*req))))
+   {
+      log_msg(LOG_ERR, "could not get memory for SOCKS request: \"%s\"", strerror(errno));
+      mem_release(MEM_SOCKS, sizeof(*req));
+      return -1;
+   }
+   memcpy(req, sq, sizeof(*req));
+   mpsc_push(&socks_inbox_, (OcatMpscNode_t*) req);
+   notify_signal(&socks_notify_);
+   return 0;
 }
 
 
@@ -240,10 +526,17 @@ void socks_pipe_request(const SocksQueue_t *sq)
  */
 void sig_socks_connector(void)
 {
-   SocksQueue_t sq;
+   notify_signal(&socks_notify_);
+}
 
-   memset(&sq, 0, sizeof(sq));
-   socks_pipe_request(&sq);
+
+/*! Initialize the request notifier of the connector thread. This must be
+ * called before the connector is started.
+ * @return 0 on success, -1 on error.
+ */
+int init_socks_connector(void)
+{
+   return notify_init(&socks_notify_);
 }
 
 
@@ -264,7 +557,9 @@ void socks_query_callback(void *UNUSED(p), struct in6_addr UNUSED(in6), int UNUS
 }
 
 
-/*! Check if address addr exists within SOCKS request queue.
+/*! Check if address addr exists within SOCKS request queue. This must only
+ * be called by the connector thread, other threads use the pending set (see
+ * socks_queue()).
  * @param addr IPv6 Address to check for.
  * @return If the request for the address exists a pointer to the queued
  * element is returned. Otherwise NULL is returned.
@@ -280,53 +575,166 @@ SocksQueue_t *socks_get_req(const struct in6_addr *addr)
 }
 
 
-/*! Add and link a SOCKS request to the SOCKS queue.
- *  @param sq Request structure to add.
+/*! Link an allocated SOCKS request to the SOCKS queue. The queue takes
+ *  over the element, it is freed if the request already exists.
+ *  @param squeue Request structure to add.
  */
-void socks_enqueue(const SocksQueue_t *sq)
+static void socks_enqueue0(SocksQueue_t *squeue)
 {
-   SocksQueue_t *squeue;
-
    log_debug("queueing new SOCKS connection request");
-   if (socks_get_req(&sq->addr))
+   if (socks_get_req(&squeue->addr))
    {
       log_debug("SOCKS request exists");
+      mem_release(MEM_SOCKS, sizeof(*squeue));
+      free(squeue);
       return;
    }
-   if (!(squeue = malloc(sizeof(SocksQueue_t))))
-      log_msg(LOG_EMERG, "could not get memory for SocksQueue entry: \"%s\"", strerror(errno)), exit(1);
-   memcpy(squeue, sq, sizeof(*squeue));
 
+   // requests which do not pass socks_queue() are added to the pending set here
+   (void) pending_add(&squeue->addr);
    squeue->next = socks_queue_;
    socks_queue_ = squeue;
 }
 
 
+/*! Add and link a SOCKS request to the SOCKS queue.
+ *  @param sq Request structure to add.
+ */
+void socks_enqueue(const SocksQueue_t *sq)
+{
+   SocksQueue_t *squeue;
+
+   if (!(squeue = malloc(sizeof(SocksQueue_t))))
+      log_msg(LOG_EMERG, "could not get memory for SocksQueue entry: \"%s\"", strerror(errno)), exit(1);
+   mem_account(MEM_SOCKS, sizeof(*squeue));
+   memcpy(squeue, sq, sizeof(*squeue));
+   socks_enqueue0(squeue);
+}
+
+
 /*! Initialize a new SOCKS request and send it to the request pipe in order to
- *  get added to the SOCKS queue with socks_enqueue().
+ *  get added to the SOCKS queue with socks_enqueue(). Requests for
+ *  destinations which are already pending are dropped with a single lookup
+ *  in the pending set, thus this is cheap for every packet of a flow while
+ *  the peer is connecting.
  *  @param addr IPv6 address to be requested
  *  @param perm 1 if connection should kept opened inifitely after successful request, 0 else.
  */
 void socks_queue(struct in6_addr addr, int perm)
 {
-   SocksQueue_t *squeue, sq;
+   socks_queue_ident(addr, perm, NULL);
+}
+
+
+/*! Same as socks_queue() but the connection is opened on behalf of a local
+ *  identity, i.e. the first keepalive is sent from its address.
+ *  @param addr IPv6 address to be requested
+ *  @param perm 1 if connection should kept opened inifitely after successful request, 0 else.
+ *  @param laddr Address of the local identity. If it is NULL or not an
+ *  additional identity (see get_ident()), the main identity is used.
+ */
+void socks_queue_ident(struct in6_addr addr, int perm, const struct in6_addr *laddr)
+{
+   socks_queue_delayed(addr, perm, laddr, 0);
+}
+
+
+/*! Same as socks_queue_ident() but the connection is not started before dly
+ *  seconds have passed. This is used to reconnect permanent peers whose
+ *  connection failed without having received any data, e.g. if a DIRECT
+ *  connection with TCP Fast Open was refused after the peer was activated.
+ *  Delayed requests bypass the pending set because the request which
+ *  activated the peer may still be pending. Duplicates are dropped by the
+ *  connector in socks_enqueue0().
+ *  @param addr IPv6 address to be requested
+ *  @param perm 1 if connection should kept opened inifitely after successful request, 0 else.
+ *  @param laddr Address of the local identity or NULL.
+ *  @param dly Delay in seconds, 0 means immediately.
+ */
+void socks_queue_delayed(struct in6_addr addr, int perm, const struct in6_addr *laddr, time_t dly)
+{
+   SocksQueue_t sq;
+   int pend = -1;
 
    // dont queue if SOCKS is disabled (-t none)
    if (!CNF(socks_dst)->sin_family)
       return;
 
-   if ((squeue = socks_get_req(&addr)) != NULL)
+   if (!dly && (pend = pending_add(&addr)) == 1)
    {
       log_debug("connection already exists, not queueing SOCKS connection");
       return;
    }
+   // out of memory, queue it anyway, duplicates are dropped by socks_enqueue0()
+   if (!dly && pend == -1)
+      log_msg(LOG_WARNING, "request not added to pending set, queueing anyway");
 
    log_debug("queueing new SOCKS connection request");
    memset(&sq, 0, sizeof(sq));
    IN6_ADDR_COPY(&sq.addr, &addr);
    sq.perm = perm;
+   if (laddr != NULL && get_ident(laddr) != NULL)
+      IN6_ADDR_COPY(&sq.laddr, laddr);
+   if (dly)
+      sq.restart_time = time(NULL) + dly;
    log_debug("signalling connector");
-   socks_pipe_request(&sq);
+   if (socks_pipe_request(&sq) == -1 && !pend)
+      pending_del(&addr);
+}
+
+
+/*! Drop requests for a destination for dly seconds, i.e. this is a
+ *  negative cache entry in the pending set. It is used for temporary DIRECT
+ *  peers whose connection with TCP Fast Open was refused after the peer was
+ *  activated. Otherwise every packet sent to the destination would trigger
+ *  another connection attempt immediately. A request which is already
+ *  queued is not touched.
+ *  @param addr IPv6 address of the destination.
+ *  @param dly Hold time in seconds.
+ */
+void socks_hold(struct in6_addr addr, time_t dly)
+{
+   SocksPending_t **sp, *p;
+
+   pthread_mutex_lock(&pending_mutex_);
+   for (sp = &pending_[pending_hash(&addr)]; *sp; sp = &(*sp)->next)
+      if (IN6_ARE_ADDR_EQUAL(&(*sp)->addr, &addr))
+         break;
+
+   if ((p = *sp) != NULL)
+   {
+      if (p->hold)
+         p->hold = time(NULL) + dly;
+   }
+   else if ((p = malloc(sizeof(*p))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not get memory for pending SOCKS request: \"%s\"", strerror(errno));
+   }
+   else
+   {
+      mem_account(MEM_SOCKS, sizeof(*p));
+      IN6_ADDR_COPY(&p->addr, &addr);
+      p->hold = time(NULL) + dly;
+      p->next = NULL;
+      *sp = p;
+   }
+   pthread_mutex_unlock(&pending_mutex_);
+}
+
+
+/*! Cancel a SOCKS request which was queued with socks_queue(), e.g. the
+ *  standby connection of a permanent peer which recovered. The request is
+ *  removed by the connector unless it already turned into a peer.
+ *  @param addr IPv6 address of the request.
+ */
+void socks_cancel(struct in6_addr addr)
+{
+   SocksQueue_t sq;
+
+   memset(&sq, 0, sizeof(sq));
+   IN6_ADDR_COPY(&sq.addr, &addr);
+   sq.state = SOCKS_DELETE;
+   (void) socks_pipe_request(&sq);
 }
 
 
@@ -341,7 +749,10 @@ void socks_unqueue(SocksQueue_t *squeue)
       if (*sq == squeue)
       {
          *sq = (*sq)->next;
+         pending_del(&squeue->addr);
+         socks_free_opt_data(squeue, 0);
          log_debug("freeing SOCKS queue element at %p", squeue);
+         mem_release(MEM_SOCKS, sizeof(*squeue));
          free(squeue);
          break;
       }
@@ -352,8 +763,9 @@ void print_socks_queue(int fd)
 {
    SocksQueue_t sq;
 
+   // requests with unspecified address carry the output fd
    memset(&sq, 0, sizeof(sq));
-   sq.next = (SocksQueue_t*) (intptr_t) fd;
+   sq.fd = fd;
    socks_pipe_request(&sq);
 }
 
@@ -376,7 +788,7 @@ void socks_output_queue(int fd)
             i, 
             addrstr, 
             ipv6tonion(&squeue->addr, onstr),
-            CNF(domain),
+            NDESC_NT(addr_net_type(&squeue->addr), domain),
             squeue->state,
             squeue->perm ? "PERMANENT" : "TEMPORARY",
             squeue->perm,
@@ -390,10 +802,62 @@ void socks_output_queue(int fd)
 }
 
 
-int socks5_greet(const SocksQueue_t *sq)
+/*! Create a SOCKS5 CONNECT request.
+ * @param sq Pointer to SOCKS queue element.
+ * @param buf Pointer to buffer which must be at least sizeof(Socks5Hdr_t) +
+ * sizeof(uint16_t) + NI_MAXHOST bytes long.
+ * @return Length of request.
+ */
+static int socks5_request(const SocksQueue_t *sq, char *buf)
 {
-   char buf[] = {5, 1, 0}; // version 5, 1 auth method, method no_auth (0)
-   int ret, len = sizeof(buf);
+   char onion[NI_MAXHOST];
+   Socks5Hdr_t *s5hdr = (Socks5Hdr_t*) buf;
+   uint16_t port = htons(CNF(ocat_dest_port));
+
+   get_hostname(sq, onion, sizeof(onion));
+   s5hdr->ver = 5;
+   s5hdr->cmd = 1;   // CONNECT
+   s5hdr->rsv = 0;   // reserved
+   s5hdr->atyp = 3;  // DOMAIN
+   s5hdr->addr = strlen(onion);
+   memcpy(buf + sizeof(*s5hdr), onion, strlen(onion));
+   memcpy(buf + sizeof(*s5hdr) + strlen(onion), &port, sizeof(port));
+
+   return sizeof(*s5hdr) + strlen(onion) + sizeof(port);
+}
+
+
+/*! Send the SOCKS5 greeting and the CONNECT request in a single write, i.e.
+ * the request is pipelined and not sent after the greeting response. If
+ * optimistic data is enabled (option -O) the queued packets of the
+ * destination are sent right behind the request. Thereby they do not have to
+ * wait for the SOCKS response which saves a round trip through Tor. A copy of
+ * them is kept in the queue element until the SOCKS response arrives. If the
+ * request fails they are put back to the packet queue by socks_reset().
+ * @param sq Pointer to SOCKS queue element.
+ * @return 0 on success, -1 on error.
+ */
+int socks5_greet(SocksQueue_t *sq)
+{
+   // version 5, 1 auth method, method no_auth (0)
+   char buf[3 + sizeof(Socks5Hdr_t) + sizeof(uint16_t) + NI_MAXHOST + SOCKS_OPT_DATA] = {5, 1, 0};
+   int ret, len = 3;
+
+   len += socks5_request(sq, buf + len);
+#ifdef PACKET_QUEUE
+   if (CNF(socks_opt_data) && (ret = dequeue_packets(&sq->addr, buf + len, SOCKS_OPT_DATA)) > 0)
+   {
+      log_debug("sending %d bytes of optimistic data on fd %d", ret, sq->fd);
+      if ((sq->opt_data = malloc(ret)) != NULL)
+      {
+         memcpy(sq->opt_data, buf + len, ret);
+         sq->opt_len = ret;
+      }
+      else
+         log_msg(LOG_WARNING, "could not keep optimistic data: \"%s\"", strerror(errno));
+      len += ret;
+   }
+#endif
 
    if ((ret = write(sq->fd, buf, len)) == -1)
    {
@@ -405,7 +869,7 @@ int socks5_greet(const SocksQueue_t *sq)
       log_msg(LOG_ERR, "SOCKS5 greeting truncated to %d of %d bytes", ret, len);
       return -1;
    }
-   log_debug("SOCKS5 greeting sent successfully");
+   log_debug("SOCKS5 greeting and request sent successfully");
    return 0;
 }
 
@@ -437,38 +901,6 @@ int socks5_greet_response(const SocksQueue_t *sq)
 }
 
 
-int socks5_send_request(const SocksQueue_t *sq)
-{
-   char buf[sizeof(Socks5Hdr_t) + sizeof(uint16_t) + NI_MAXHOST];
-   char onion[NI_MAXHOST];
-   Socks5Hdr_t *s5hdr = (Socks5Hdr_t*) buf;
-   int len, ret;
-
-   get_hostname(sq, onion, sizeof(onion));
-   s5hdr->ver = 5;
-   s5hdr->cmd = 1;   // CONNECT
-   s5hdr->rsv = 0;   // reserved
-   s5hdr->atyp = 3;  // DOMAIN
-   s5hdr->addr = strlen(onion);
-   memcpy(buf + sizeof(*s5hdr), onion, strlen(onion));
-   *((uint16_t*) &buf[sizeof(*s5hdr) + strlen(onion)]) = htons(CNF(ocat_dest_port));
-
-   len = sizeof(*s5hdr) + strlen(onion) + sizeof(uint16_t);
-   if ((ret = write(sq->fd, s5hdr, len)) == -1)
-   {
-      log_msg(LOG_ERR, "error writing %d bytes to fd %d: \"%s\"", len, sq->fd, strerror(errno));
-      return -1;
-   }
-   if (ret < len)
-   {
-      log_msg(LOG_ERR, "SOCKS5 request truncated to %d of %d bytes", ret, len);
-      return -1;
-   }
-   log_debug("SOCKS5 request sent successfully");
-   return 0;
-}
-
-
 int socks5_rec_response(SocksQueue_t *sq)
 {
    char buf[sizeof(Socks5Hdr_t) + sizeof(uint16_t) + NI_MAXHOST];
@@ -476,7 +908,7 @@ int socks5_rec_response(SocksQueue_t *sq)
    int len, ret;
 
    len = sizeof(buf);
-   if ((ret = read(sq->fd, s5hdr, len)) == -1)
+   if ((ret = recv(sq->fd, s5hdr, len, MSG_PEEK)) == -1)
    {
       log_msg(LOG_ERR, "reading SOCKS5 response on fd %d failed: \"%s\"", sq->fd, strerror(errno));
       return -1;
@@ -489,6 +921,27 @@ int socks5_rec_response(SocksQueue_t *sq)
       return -1;
    }
 
+   // consume only the response, data of the peer may follow immediately
+   switch (s5hdr->atyp)
+   {
+      case 1:
+         len = sizeof(*s5hdr) - 1 + 4 + sizeof(uint16_t);
+         break;
+      case 3:
+         len = sizeof(*s5hdr) + (unsigned char) s5hdr->addr + sizeof(uint16_t);
+         break;
+      case 4:
+         len = sizeof(*s5hdr) - 1 + 16 + sizeof(uint16_t);
+         break;
+      default:
+         len = ret;
+   }
+   if (ret < len || read(sq->fd, buf, len) < len)
+   {
+      log_msg(LOG_ERR, "SOCKS5 response truncated to %d of %d bytes", ret, len);
+      return -1;
+   }
+
    if (s5hdr->ver != 5 || s5hdr->rsv != 0)
    {
       log_msg(LOG_ERR, "unexpected SOCKS5 response");
@@ -507,6 +960,16 @@ int socks5_rec_response(SocksQueue_t *sq)
 int socks_tcp_connect(int fd, struct sockaddr *addr, int len)
 {
    char astr[INET6_ADDRSTRLEN];
+#ifdef TCP_FASTOPEN_CONNECT
+   int so = 1;
+
+   // the SYN is deferred until the first write, i.e. the first keepalive
+   // travels within the SYN
+   if (CNF(tcp_fastopen) && CNF(socks5) == CONNTYPE_DIRECT
+         && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &so, sizeof(so)) == -1)
+      log_msg(LOG_WARNING, "could not set TCP_FASTOPEN_CONNECT on %d: \"%s\"", fd, strerror(errno));
+#endif
+
    if (connect(fd, addr, len) == -1)
    {
       if (errno != EINPROGRESS)
@@ -532,6 +995,7 @@ int socks_tcp_connect(int fd, struct sockaddr *addr, int len)
 void socks_reset(SocksQueue_t *squeue)
 {
    log_debug("resetting SOCKS request");
+   socks_free_opt_data(squeue, 1);
    if (squeue->fd > 0)
    {
       oe_close(squeue->fd);
@@ -623,9 +1087,9 @@ int socks_dns_recv(SocksQueue_t *sq)
 void *socks_connector_sel(void *UNUSED(p))
 {
    fd_set rset, wset;
-   int maxfd = 0, len, so_err;
-   SocksQueue_t *squeue, sq;
-   time_t t;
+   int maxfd = 0, so_err;
+   SocksQueue_t *squeue, *next, *req, sq;
+   time_t t, deadline;
    socklen_t err_len;
    struct sockaddr_storage ss;
    char name[NI_MAXHOST];
@@ -634,11 +1098,16 @@ void *socks_connector_sel(void *UNUSED(p))
    {
       update_thread_activity();
       if (term_req())
+      {
+#ifdef DIRECT_CONNECTIONS
+         wake_direct_resolvers();
+#endif
          return NULL;
+      }
 
       FD_ZERO(&rset);
       FD_ZERO(&wset);
-      MFD_SET(CNF(socksfd[0]), &rset, maxfd);
+      MFD_SET(socks_notify_.fd[0], &rset, maxfd);
       t = time(NULL);
 
       for (squeue = socks_queue_; squeue; squeue = squeue->next)
@@ -723,7 +1192,14 @@ void *socks_connector_sel(void *UNUSED(p))
                      continue;
                   }
                   err_len = sizeof(ss);
-                  if (hostname_addr(name, (struct sockaddr*) &ss, &err_len))
+                  if ((so_err = direct_lookup(name, (struct sockaddr*) &ss, &err_len)) == 1)
+                  {
+                     // connector is woken up if lookup finished
+                     log_debug("lookup of \"%s\" pending", name);
+                     squeue->retry--;
+                     continue;
+                  }
+                  if (so_err)
                   {
                      log_msg(LOG_ERR, "no IP for hostname \"%s\" found", name);
                      continue;
@@ -732,8 +1208,11 @@ void *socks_connector_sel(void *UNUSED(p))
                else
 #endif
                {
-                  err_len = SOCKADDR_SIZE(CNF(socks_dst));
-                  memcpy(&ss, CNF(socks_dst), err_len);
+                  // SOCKS server may be changed by a config reload
+                  lock_setup();
+                  err_len = SOCKADDR_SIZE(socks_dst_by_addr(&squeue->addr));
+                  memcpy(&ss, socks_dst_by_addr(&squeue->addr), err_len);
+                  unlock_setup();
                }
 
                log_debug("creating socket for unconnected SOCKS request");
@@ -757,6 +1236,11 @@ void *socks_connector_sel(void *UNUSED(p))
 
                break;
 
+            // connect still in progress
+            case SOCKS_CONNECTING:
+               MFD_SET(squeue->fd, &wset, maxfd);
+               break;
+
             case SOCKS_4AREQ_SENT:
             case SOCKS_5GREET_SENT:
             case SOCKS_5REQ_SENT:
@@ -841,36 +1325,48 @@ void *socks_connector_sel(void *UNUSED(p))
          }
       }
 
+      // sleep until the next request is scheduled but at least 1s
+      deadline = 0;
+      for (squeue = socks_queue_; squeue; squeue = squeue->next)
+         if ((squeue->state == SOCKS_NEW || squeue->state == SOCKS_DNS_SENT) && (!deadline || squeue->restart_time < deadline))
+            deadline = squeue->restart_time;
+      if (deadline && deadline <= t)
+         deadline = t + 1;
+
       // select all file descriptors
-      if ((maxfd = oc_select0(maxfd + 1, &rset, &wset, NULL, SOCKS_DNS_RETRY_TIMEOUT)) == -1)
+      if ((maxfd = oc_select_until(maxfd + 1, &rset, &wset, NULL, deadline)) == -1)
          continue;
 
-      // check socks request pipe
-      if (FD_ISSET(CNF(socksfd[0]), &rset))
+      // check socks request queue
+      if (FD_ISSET(socks_notify_.fd[0], &rset))
       {
          maxfd--;
-         if ((len = read(CNF(socksfd[0]), &sq, sizeof(sq))) == -1)
-            log_msg(LOG_ERR, "failed to read from SOCKS request pipe, fd = %d: \"%s\"", 
-                  CNF(socksfd[0]), strerror(errno));
-         if (len < (int) sizeof(sq))
-            log_msg(LOG_ERR, "read from SOCKS request pipe truncated to %d of %d bytes, ignoring.", 
-                  len, (int) sizeof(sq));
-         else
+         notify_clear(&socks_notify_);
+         for (squeue = (SocksQueue_t*) mpsc_take(&socks_inbox_); squeue; squeue = next)
          {
-            log_debug("received %d bytes on SOCKS request pipe fd %d", len, CNF(socksfd[0]));
-            if (sq.next)
+            next = squeue->next;
+            if (IN6_IS_ADDR_UNSPECIFIED(&squeue->addr))
             {
                log_debug("output of SOCKS request queue triggered");
-               socks_output_queue((intptr_t) sq.next);
+               socks_output_queue(squeue->fd);
+               mem_release(MEM_SOCKS, sizeof(*squeue));
+               free(squeue);
             }
-            else if (IN6_IS_ADDR_UNSPECIFIED(&sq.addr))
+            else if (squeue->state == SOCKS_DELETE)
             {
-               log_debug("wakeup request on SOCKS request pipe received");
+               log_debug("SOCKS cancel request received");
+               if ((req = socks_get_req(&squeue->addr)) != NULL)
+               {
+                  socks_reset(req);
+                  req->state = SOCKS_DELETE;
+               }
+               mem_release(MEM_SOCKS, sizeof(*squeue));
+               free(squeue);
             }
             else
             {
                log_debug("SOCKS queuing request received");
-               socks_enqueue(&sq);
+               socks_enqueue0(squeue);
             }
          }
       }
@@ -927,7 +1423,11 @@ void *socks_connector_sel(void *UNUSED(p))
                }
                else if (CNF(socks5) == CONNTYPE_DIRECT)
                {
-                  // no further handshake required for direct peers
+                  // no further handshake required for direct peers. With
+                  // TCP_FASTOPEN_CONNECT the socket is writable before the
+                  // SYN was sent, thus connection errors are not seen here
+                  // but by the socket_receiver which reschedules the request
+                  // with socks_queue_delayed().
                   log_debug("activating peer fd %d", squeue->fd);
                   socks_activate_peer(squeue);
                   squeue->state = SOCKS_DELETE;
@@ -969,14 +1469,8 @@ void *socks_connector_sel(void *UNUSED(p))
                      socks_reschedule(squeue);
                      continue;
                   }
-                  // greeting was successful, send request
-                  if (socks5_send_request(squeue) == -1)
-                  {
-                     log_msg(LOG_ERR, "sending SOCKS5 request failed");
-                     socks_reschedule(squeue);
-                     continue;
-                  }
-                  // request successfully sent, advance state machine
+                  // greeting was successful, request was already sent with
+                  // the greeting, advance state machine
                   squeue->state = SOCKS_5REQ_SENT;
                   break;
 
@@ -1131,14 +1625,8 @@ int synchron_socks_connect(const struct in6_addr *addr)
                sq.state = SOCKS_DELETE;
                continue;
             }
-            // greeting was successful, send request
-            if (socks5_send_request(&sq) == -1)
-            {
-               log_msg(LOG_ERR, "sending SOCKS5 request failed");
-               sq.state = SOCKS_DELETE;
-               continue;
-            }
-            // request successfully sent, advance state machine
+            // greeting was successful, request was already sent with the
+            // greeting, advance state machine
             sq.state = SOCKS_5REQ_SENT;
             continue;
 
@@ -1154,6 +1642,7 @@ int synchron_socks_connect(const struct in6_addr *addr)
             continue;
 
          case SOCKS_DELETE:
+            socks_free_opt_data(&sq, 0);
             oe_close(sq.fd);
             sq.fd = -1;
             sq.state = SOCKS_NEW;
@@ -1166,10 +1655,11 @@ int synchron_socks_connect(const struct in6_addr *addr)
       }
 
       log_msg(LOG_INFO, "Restarting in a moment...");
-      oc_select(0, NULL, NULL, NULL);
+      oc_select0(0, NULL, NULL, NULL, SELECT_TIMEOUT);
    }
 
 rlr_exit:
+   socks_free_opt_data(&sq, 0);
    return sq.fd;
 }
 
@@ -24,14 +24,122 @@
  */
 
 
+// CPU_SET() and pthread_setaffinity_np() are GNU extensions
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "ocat.h"
 
 
+//! CPU affinity configured for a thread name
+typedef struct ThreadAffinity
+{
+   char name[THREAD_NAME_LEN];
+   char cpus[SIZE_256];
+} ThreadAffinity_t;
+
+
 // global thread id var and mutex for thread initializiation
 static pthread_mutex_t thread_mutex_ = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t thread_cond_ = PTHREAD_COND_INITIALIZER;
 static OcatThread_t *octh_ = NULL;
 static volatile sig_atomic_t term_req_ = 0;
+//! file descriptors which get readable on termination request
+static int term_fd_[2] = {-1, -1};
+static pthread_once_t term_once_ = PTHREAD_ONCE_INIT;
+// configured CPU affinities, protected by thread_mutex_
+static ThreadAffinity_t affinity_[MAX_AFFINITY];
+static int affinity_cnt_ = 0;
+
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/*! Parse a list of CPUs such as "0-3,6" into a CPU set.
+ * @param s Pointer to CPU list.
+ * @param set Pointer to CPU set which will be filled.
+ * @return 0 on success, -1 if the list is invalid.
+ */
+static int parse_cpu_list(const char *s, cpu_set_t *set)
+{
+   char *end;
+   long a, b;
+
+   CPU_ZERO(set);
+   for (;;)
+   {
+      a = strtol(s, &end, 10);
+      if (end == s || a < 0 || a >= CPU_SETSIZE)
+         return -1;
+      b = a;
+      if (*end == '-')
+      {
+         s = end + 1;
+         b = strtol(s, &end, 10);
+         if (end == s || b < a || b >= CPU_SETSIZE)
+            return -1;
+      }
+      for (; a <= b; a++)
+         CPU_SET(a, set);
+
+      if (*end == '\0')
+         return 0;
+      if (*end != ',')
+         return -1;
+      s = end + 1;
+   }
+}
+
+
+/*! Output a CPU set as list of CPU ranges, e.g. "0-3,6".
+ */
+static void snprint_cpu_set(char *buf, int len, const cpu_set_t *set)
+{
+   int a, b, wlen;
+
+   *buf = '\0';
+   for (a = 0; a < CPU_SETSIZE && len > 1; a = b + 1)
+   {
+      if (!CPU_ISSET(a, set))
+      {
+         b = a;
+         continue;
+      }
+      for (b = a; b + 1 < CPU_SETSIZE && CPU_ISSET(b + 1, set); b++);
+      wlen = a == b ? snprintf(buf, len, ",%d", a) : snprintf(buf, len, ",%d-%d", a, b);
+      if (wlen >= len)
+         break;
+      buf += wlen;
+      len -= wlen;
+   }
+}
+#endif
+
+
+/*! Apply the configured CPU affinity to a thread.
+ * thread_mutex_ MUST be locked. Nothing is logged here because log_msg()
+ * locks thread_mutex_ as well.
+ * @param th Pointer to thread structure.
+ * @return 0 if the affinity was set or if there is none configured for the
+ * thread, otherwise an error number is returned.
+ */
+static int init_thread_affinity(const OcatThread_t *th)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+   cpu_set_t set;
+   int i;
+
+   for (i = 0; i < affinity_cnt_; i++)
+      if (!strcmp(affinity_[i].name, th->name))
+      {
+         // CPU list was validated by set_thread_affinity()
+         (void) parse_cpu_list(affinity_[i].cpus, &set);
+         return pthread_setaffinity_np(th->handle, sizeof(set), &set);
+      }
+#else
+   (void) th;
+#endif
+   return 0;
+}
 
 
 /*! Find highest thread number.
@@ -51,6 +159,8 @@ static int highest_id(void)
 
 void init_ocat_thread_struct(OcatThread_t *th)
 {
+   int rc;
+
    // init ocat thread structure
    th->handle = pthread_self();
    th->t_act = time(NULL);
@@ -58,8 +168,11 @@ void init_ocat_thread_struct(OcatThread_t *th)
    th->id = highest_id() + 1;
    th->next = octh_;
    octh_ = th;
+   rc = init_thread_affinity(th);
    pthread_mutex_unlock(&thread_mutex_);
    log_debug("_init_ thread %d", th->id);
+   if (rc)
+      log_msg(LOG_ERR, "could not set CPU affinity: \"%s\"", strerror(rc));
 }
 
 
@@ -404,10 +517,47 @@ int term_req(void)
 }
 
 
-/*! Set termination request. */
+/*! Create the termination wakeup file descriptors. An eventfd is used if
+ * available, otherwise a pipe.
+ */
+static void init_term_fd(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+   if ((term_fd_[0] = eventfd(0, 0)) != -1)
+   {
+      term_fd_[1] = term_fd_[0];
+      return;
+   }
+   log_msg(LOG_WARNING, "could not create eventfd: \"%s\", falling back to pipe", strerror(errno));
+#endif
+   if (pipe(term_fd_) == -1)
+   {
+      log_msg(LOG_ERR, "could not create termination pipe: \"%s\"", strerror(errno));
+      term_fd_[0] = term_fd_[1] = -1;
+   }
+}
+
+
+/*! Return the file descriptor which gets readable as soon as termination was
+ * requested. It is used by oc_select_until() to wake up all sleeping threads
+ * at once.
+ * @return File descriptor or -1 if not available.
+ */
+int term_wakeup_fd(void)
+{
+   pthread_once(&term_once_, init_term_fd);
+   return term_fd_[0];
+}
+
+
+/*! Set termination request and wake up all threads. */
 void set_term_req(void)
 {
+   uint64_t v = 1;
+
    term_req_ = 1;
+   if (term_wakeup_fd() != -1 && write(term_fd_[1], &v, sizeof(v)) == -1)
+      log_msg(LOG_ERR, "could not signal termination: \"%s\"", strerror(errno));
 }
 
 
@@ -432,6 +582,31 @@ void update_thread_activity(void)
 }
 
 
+/*! Set the time until which the current thread legally sleeps because it
+ * waits for events. This prevents the watchdog from complaining about idle
+ * threads.
+ * @param t Time until the thread sleeps, 0 if it is active.
+ */
+void set_thread_wait(time_t t)
+{
+#ifdef DEBUG
+   OcatThread_t *th;
+   pthread_t thread = pthread_self();
+
+   pthread_mutex_lock(&thread_mutex_);
+   for (th = octh_; th; th = th->next)
+      if (pthread_equal(th->handle, thread))
+      {
+         th->t_wait = t;
+         break;
+      }
+   pthread_mutex_unlock(&thread_mutex_);
+#else
+   (void) t;
+#endif
+}
+
+
 /*! This function checks all threads for their activity (meaning if they are
  * still alive).
  * @return If all threads are alive, 0 is returned. Otherwise the id of the
@@ -445,7 +620,7 @@ int check_threads(void)
 
    pthread_mutex_lock(&thread_mutex_);
    for (th = octh_; th; th = th->next)
-      if (th->t_act + MAX_INACTIVITY < time(NULL))
+      if (th->t_act + MAX_INACTIVITY < time(NULL) && th->t_wait < time(NULL))
       {
          e = th->id;
          break;
@@ -489,3 +664,123 @@ int set_thread_flags(int UNUSED(f))
 }
 #endif
 
+
+/*! Set the CPU affinity of all threads with a specific name. The setting is
+ * stored and applied to running threads and to threads which are started
+ * later.
+ * @param name Name of thread as shown by the "threads" command.
+ * @param cpus List of CPUs, e.g. "0-3,6".
+ * @return 0 on success, -1 on error.
+ */
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+int set_thread_affinity(const char *name, const char *cpus)
+{
+   OcatThread_t *th;
+   char old[SIZE_256];
+   int i, rc = 0, e;
+   cpu_set_t set;
+
+   if (parse_cpu_list(cpus, &set) == -1)
+   {
+      log_msg(LOG_ERR, "invalid CPU list \"%s\"", cpus);
+      return -1;
+   }
+
+   pthread_mutex_lock(&thread_mutex_);
+   for (i = 0; i < affinity_cnt_; i++)
+      if (!strncmp(affinity_[i].name, name, THREAD_NAME_LEN - 1))
+         break;
+   if (i >= MAX_AFFINITY)
+   {
+      pthread_mutex_unlock(&thread_mutex_);
+      log_msg(LOG_ERR, "too many CPU affinity settings, max. %d", MAX_AFFINITY);
+      return -1;
+   }
+   if (i == affinity_cnt_)
+   {
+      affinity_cnt_++;
+      *old = '\0';
+   }
+   else
+      strlcpy(old, affinity_[i].cpus, sizeof(old));
+   strlcpy(affinity_[i].name, name, sizeof(affinity_[i].name));
+   strlcpy(affinity_[i].cpus, cpus, sizeof(affinity_[i].cpus));
+
+   for (th = octh_; th; th = th->next)
+      if (!strcmp(th->name, affinity_[i].name) && (e = init_thread_affinity(th)))
+         rc = e;
+
+   // restore previous setting on error
+   if (rc)
+   {
+      if (*old)
+         strlcpy(affinity_[i].cpus, old, sizeof(affinity_[i].cpus));
+      else
+         affinity_cnt_--;
+   }
+   pthread_mutex_unlock(&thread_mutex_);
+
+   if (rc)
+   {
+      log_msg(LOG_ERR, "could not set CPU affinity of \"%s\": \"%s\"", name, strerror(rc));
+      return -1;
+   }
+   log_msg(LOG_INFO, "CPU affinity of \"%s\" set to %s", name, cpus);
+   return 0;
+}
+#else
+int set_thread_affinity(const char *UNUSED(name), const char *UNUSED(cpus))
+{
+   log_msg(LOG_ERR, "CPU affinity not supported on this system");
+   return -1;
+}
+#endif
+
+
+/*! Parse an affinity setting of the form <thread>:<cpus> and set it with
+ * set_thread_affinity().
+ * @param spec Pointer to setting.
+ * @return 0 on success, -1 on error.
+ */
+int parse_thread_affinity(const char *spec)
+{
+   char name[THREAD_NAME_LEN];
+   const char *s;
+
+   if ((s = strchr(spec, ':')) == NULL || s == spec || s - spec >= THREAD_NAME_LEN)
+   {
+      log_msg(LOG_ERR, "affinity must be given as <thread>:<cpus>");
+      return -1;
+   }
+   memcpy(name, spec, s - spec);
+   name[s - spec] = '\0';
+   return set_thread_affinity(name, s + 1);
+}
+
+
+/*! Output the CPU affinity of all running threads.
+ * @param fd File descriptor to write to.
+ */
+void print_thread_affinity(int fd)
+{
+   OcatThread_t *th;
+   char buf[SIZE_256];
+
+   pthread_mutex_lock(&thread_mutex_);
+   for (th = octh_; th; th = th->next)
+   {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+      cpu_set_t set;
+
+      if (pthread_getaffinity_np(th->handle, sizeof(set), &set))
+         strlcpy(buf, ",?", sizeof(buf));
+      else
+         snprint_cpu_set(buf, sizeof(buf), &set);
+#else
+      strlcpy(buf, ",n/a", sizeof(buf));
+#endif
+      dprintf(fd, "%-10s id = %d, cpus = %s\n", th->name, th->id, *buf ? buf + 1 : "");
+   }
+   pthread_mutex_unlock(&thread_mutex_);
+}
+
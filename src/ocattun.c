@@ -262,6 +262,11 @@ int tun_config(int fd, char *dev, int devlen)
       ifr.ifr_flags = IFF_TAP;
    else
       ifr.ifr_flags = IFF_TUN;
+#ifdef TUN_NO_PI
+   // the protocol is derived from the IP version, see forward_frame()
+   ifr.ifr_flags |= IFF_NO_PI;
+   log_debug("opening tunnel device without packet information header");
+#endif
 
    // safety checks
    if (dev != NULL && *dev)
@@ -511,6 +516,60 @@ int tun_ifup(const char *dev)
 }
 
 
+/*! Set and/or retrieve the MTU of the interface.
+ *  @param dev Char pointer to device name.
+ *  @param mtu MTU to set. If mtu <= 0 the MTU is just retrieved.
+ *  @return Returns the MTU of the interface or -1 if it is unknown.
+ */
+int tun_mtu(const char *dev, int mtu)
+{
+#ifdef SIOCGIFMTU
+   struct ifreq ifr;
+   int sockfd;
+
+   if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP)) == -1)
+   {
+      log_msg(LOG_ERR, "failed to create temp socket: %s", strerror(errno));
+      return -1;
+   }
+
+   memset(&ifr, 0, sizeof(ifr));
+   strlcpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name));
+
+#ifdef SIOCSIFMTU
+   if (mtu > 0)
+   {
+      ifr.ifr_mtu = mtu;
+      if (ioctl(sockfd, SIOCSIFMTU, &ifr) == -1)
+         log_msg(LOG_ERR, "SIOCSIFMTU: %s", strerror(errno));
+   }
+#endif
+
+   if (ioctl(sockfd, SIOCGIFMTU, &ifr) == -1)
+   {
+      log_msg(LOG_ERR, "SIOCGIFMTU: %s", strerror(errno));
+      ifr.ifr_mtu = -1;
+   }
+
+   close(sockfd);
+   return ifr.ifr_mtu;
+#else
+#ifndef __CYGWIN__
+   char buf[SIZE_256];
+
+   if (mtu > 0)
+   {
+      // try generic mtu command
+      snprintf(buf, sizeof(buf), "ifconfig %s mtu %d", dev, mtu);
+      if (!system_w(buf))
+         return mtu;
+   }
+#endif
+   return -1;
+#endif
+}
+
+
 /*! Some operating systems do not automatically install a route into the
  * routing table if an IP address/netmask is assigned to an interface. This
  * function add the routes appropriately by calling external shell commands.
@@ -562,7 +621,7 @@ int tun_add_route(const char *dev, const struct in6_addr *prefix, int prefix_len
  */
 int tun_alloc(char *dev, int dev_s)
 {
-   int fd;
+   int fd, mtu, i;
 
    log_debug("opening tun \"%s\"", tun_dev_);
 #ifdef __CYGWIN__
@@ -582,6 +641,11 @@ int tun_alloc(char *dev, int dev_s)
    log_debug("trying to find ifname");
    tun_guess_ifname(dev, dev_s);
 
+   // size frame buffers according to the MTU
+   if ((mtu = tun_mtu(dev, CNF(tun_mtu))) > 0 && mtu + FRAME_HDR_LEN < FRAME_SIZE)
+      CNF(frame_size) = mtu + FRAME_HDR_LEN;
+   log_msg(LOG_INFO, "MTU of %s is %d, frame size set to %d", dev, mtu, CNF(frame_size));
+
    if (CNF(ifup) != NULL)
    {
       char astr[INET6_ADDRSTRLEN];
@@ -595,6 +659,8 @@ int tun_alloc(char *dev, int dev_s)
    {
       log_debug("setting up IPv6 address");
       tun_ipv6_config(dev, &CNF(ocat_addr), NDESC(prefix_len));
+      for (i = 0; i < CNF(ident_cnt); i++)
+         tun_ipv6_config(dev, &CNF(ident[i].addr), NDESC(prefix_len));
 
       // setting up IPv4 address
       if (CNF(ipv4_enable))
@@ -609,7 +675,11 @@ int tun_alloc(char *dev, int dev_s)
 
    // set route if necessary
    if (CNF(ipconfig))
+   {
       tun_add_route(dev, &NDESC(prefix), NDESC(prefix_len), &CNF(ocat_addr));
+      if (CNF(net2_type) != -1)
+         tun_add_route(dev, &NDESC_NT(CNF(net2_type), prefix), NDESC_NT(CNF(net2_type), prefix_len), &CNF(ocat_addr));
+   }
 
    return fd;
 }
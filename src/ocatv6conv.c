@@ -29,63 +29,92 @@
 #include "ocat_netdesc.h"
 
 static const char BASE32[] = "abcdefghijklmnopqrstuvwxyz234567ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-//! array contains inverse mapping of base32 starting with '2'.
-static const char deBASE32_[] = {
-   /*          2   3   4   5   6   7   8   9   
-              32  33  34  35  36  37  38  39  3a  3b  3c  3d  3e  3f */
-              26, 27, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1,
-   /*      A   B   C   D   E   F   G   H   I   J   K   L   M   N   O 
-      40  41  42  43  44  45  46  47  48  49  4a  4b  4c  4d  4e  4f */
-      -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 
-   /*  P   Q   R   S   T   U   V   W   X   Y   Z
-      50  51  52  53  54  55  56  57  58  59  5a */
-      15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25 };  
+//! inverse mapping of base32 (upper and lower case), -1 for invalid characters
+static const signed char deBASE32_[256] =
+{
+   /* 00 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* 10 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* 20 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* 30 */ -1, -1, 26, 27, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* 40 */ -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+   /* 50 */ 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+   /* 60 */ -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+   /* 70 */ 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+   /* 80 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* 90 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* a0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* b0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* c0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* d0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* e0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   /* f0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
 
 
 int has_ocat_prefix(const struct in6_addr *addr)
 {
-   return memcmp(addr, &NDESC(prefix), 6) == 0;
+   return memcmp(addr, &NDESC(prefix), 6) == 0 ||
+      (CNF(net2_type) != -1 && memcmp(addr, &NDESC_NT(CNF(net2_type), prefix), 6) == 0);
 }
 
 
-void set_tor_prefix(struct in6_addr *addr)
+/*! Get network type of an address.
+ * @param addr Pointer to IPv6 address.
+ * @return Returns CNF(net2_type) if the address is within the prefix of the
+ * 2nd network (option -x), otherwise CNF(net_type).
+ */
+int addr_net_type(const struct in6_addr *addr)
 {
-   memcpy(addr, &NDESC(prefix), 6);
+   if (CNF(net2_type) != -1 && !memcmp(addr, &NDESC_NT(CNF(net2_type), prefix), 6))
+      return CNF(net2_type);
+   return CNF(net_type);
 }
 
 
-/*! Shift byte buffer of size ONION_URL_LEN (=17) 5 bits to the left.
- *  @param bin Pointer to byte buffer, must be at least ONION_URL_LEN
- *             bytes long.
+/*! Get network type of a domain.
+ * @param domain Pointer to domain string including the leading '.'.
+ * @return Returns CNF(net_type) or CNF(net2_type) if the domain matches,
+ * otherwise -1.
  */
-void shl5(char *bin)
+int domain_net_type(const char *domain)
 {
-   int i;
+   if (!strcmp(domain, CNF(domain)))
+      return CNF(net_type);
+   if (CNF(net2_type) != -1 && !strcmp(domain, NDESC_NT(CNF(net2_type), domain)))
+      return CNF(net2_type);
+   return -1;
+}
 
-   for (i = 0; i < ONION_URL_LEN - 1; i++)
-   {
-      bin[i] <<= 5;
-      bin[i] |= (bin[i + 1] >> 3) & 0x1f;
-   }
-   bin[i] <<= 5;
+
+void set_tor_prefix(struct in6_addr *addr)
+{
+   memcpy(addr, &NDESC(prefix), 6);
 }
 
 
+/*! Convert onion-URL to IPv6 address. The 16 characters are decoded in two
+ * groups of 8 characters, each of which is 40 bits.
+ * @param onion Pointer to onion-URL, only the first 16 characters are used.
+ * @param ip6 Pointer to destination.
+ * @return 0 on success, -1 if the onion-URL contains invalid characters.
+ */
 int oniontipv6(const char *onion, struct in6_addr *ip6)
 {
-   int i, j;
+   uint64_t v;
+   int i, j, c;
 
    memset(ip6, 0, sizeof(struct in6_addr));
 
-   for (i = 0; i < 16; i++)
+   for (i = 0; i < 2; i++)
    {
-      shl5((char*) ip6);
-      j = toupper((int) onion[i]);
-      if ((j < '2') || (j > 'Z'))
-         return -1;
-      if ((j = deBASE32_[j - '2']) == -1)
-         return -1;
-      *(((char*) ip6) + 15) |= j;
+      for (j = 0, v = 0; j < 8; j++)
+      {
+         if ((c = deBASE32_[(unsigned char) *onion++]) == -1)
+            return -1;
+         v = v << 5 | c;
+      }
+      for (j = 4; j >= 0; j--, v >>= 8)
+         ip6->s6_addr[6 + i * 5 + j] = v;
    }
    set_tor_prefix(ip6);
    return 0;
@@ -116,18 +145,18 @@ int oniontipv4(const char *onion, struct in_addr *ip, int prefix_mask)
  */
 char *ipv6tonion(const struct in6_addr *ip6, char *onion)
 {
-   int i;
-   char bin[ONION_URL_LEN], *r = onion;
-
-   memcpy(bin, (char*) ip6 + 6, 10);
+   uint64_t v;
+   int i, j;
 
-   for (i = 0; i < ONION_URL_LEN; i++, onion++)
+   for (i = 0; i < 2; i++)
    {
-      *onion = BASE32[bin[0] >> 3 & 0x1f];
-      shl5(bin);
+      for (j = 0, v = 0; j < 5; j++)
+         v = v << 8 | ip6->s6_addr[6 + i * 5 + j];
+      for (j = 7; j >= 0; j--, v >>= 5)
+         onion[i * 8 + j] = BASE32[v & 0x1f];
    }
-   *onion = '\0';
-   return r;
+   onion[ONION_URL_LEN] = '\0';
+   return onion;
 }
 
 
@@ -197,14 +226,16 @@ void strtolower(char *s)
  * @param name Pointer to \0-terminated string containing a hostname.
  * @param addr If this parameter contains a valid (non-NULL) pointer to a
  * struct in6_addr structure it will receive the converted IPv6 address.
+ * @param lvl Log level of error messages, e.g. LOG_DEBUG for names received
+ * from remote.
  * @return On success, the function returns the length of the first label of
  * the hostname which is either 16 or CNF(l_hs_namelen). On error, -1 is
  * returned.
  */
-int validate_onionname(const char *name, struct in6_addr *addr)
+int validate_onionname0(const char *name, struct in6_addr *addr, int lvl)
 {
    char *pp;
-   int len;
+   int len, nt;
 
    // safety check
    if (name == NULL)
@@ -216,38 +247,49 @@ int validate_onionname(const char *name, struct in6_addr *addr)
    // get position of the 1st label separator
    if ((pp = strchr(name, '.')) == NULL)
    {
-      log_msg(LOG_ERR, "no domain in hostname");
+      log_msg(lvl, "no domain in hostname");
       return -1;
    }
 
    // calculate length of first part of string
    len = pp - name;
 
-   // check length
-   if (len != 16 && len != CNF(l_hs_namelen))
+   // check domain
+   if ((nt = domain_net_type(pp)) == -1)
    {
-      log_msg(LOG_ERR, "incorrect length of hostname");
+      log_msg(lvl, "incorrect domain");
       return -1;
    }
 
-   // check domain
-   if (strcmp(pp, CNF(domain)))
+   // check length
+   if (len != 16 && len != NDESC_NT(nt, l_hs_namelen))
    {
-      log_msg(LOG_ERR, "incorrect domain");
+      log_msg(lvl, "incorrect length of hostname");
       return -1;
    }
 
    // check charset
    if ((int) strspn(name, BASE32) != len)
    {
-      log_msg(LOG_ERR, "ill chars in hostname");
+      log_msg(lvl, "ill chars in hostname");
       return -1;
    }
 
    // convert to IPv6 address
    if (addr != NULL)
+   {
       (void) oniontipv6(name + len -16, addr);
+      memcpy(addr, &NDESC_NT(nt, prefix), 6);
+   }
 
    return len;
 }
 
+
+/*! Same as validate_onionname0() with error messages logged at LOG_ERR.
+ */
+int validate_onionname(const char *name, struct in6_addr *addr)
+{
+   return validate_onionname0(name, addr, LOG_ERR);
+}
+